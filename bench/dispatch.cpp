@@ -0,0 +1,108 @@
+#include <chrono>
+#include <stdlib.h>
+
+#include "../src/i8086.h"
+
+// Instructions/sec of the opcode dispatch path.
+// Runs a loop of MOVs so the result is dominated by fetch, decode and
+// dispatch rather than by memory access. The same loop is run
+// through execute() (table dispatch), through start() (computed goto where
+// the compiler supports it), through the recompiler, and through start() on
+// the core built with FastPolicy (no cycle accounting).
+
+static const Byte program[] = {
+    0xb8, 0x34, 0x12, // mov ax,1234h
+    0xb3, 0x05,       // mov bl,5
+    0x89, 0xc3,       // mov bx,ax
+    0x8a, 0xc3,       // mov al,bl
+    0xa3, 0x00, 0x02, // mov [0200h],ax
+    0xa0, 0x00, 0x02, // mov al,[0200h]
+    0xb1, 0x10,       // mov cl,10h
+    0xba, 0x78, 0x56, // mov dx,5678h
+    0x89, 0x87, 0x00, 0x03,             // mov [bx+0300h],ax
+    0xc7, 0x87, 0x02, 0x03, 0x34, 0x12, // mov word [bx+0302h],1234h
+};
+
+static const u32 PROGRAM_BASE = 0x10000; // 1000:0000
+static const u32 PROGRAM_REPEAT = 128;
+static const u32 INSTRUCTIONS_PER_LAP = PROGRAM_REPEAT * 10 + 1; // + the jmp back
+
+template <class Cpu>
+static u32 loadProgram(Cpu *cpu)
+{
+    u32 end = 0;
+    for (u32 i = 0; i < PROGRAM_REPEAT; i++)
+    {
+        for (u32 j = 0; j < sizeof(program); j++)
+        {
+            cpu->ram[PROGRAM_BASE + end++] = program[j];
+        }
+    }
+
+    // jmp near back to the start of the loop
+    Word displacement = (Word)(0 - (end + 3));
+    cpu->ram[PROGRAM_BASE + end++] = 0xe9;
+    cpu->ram[PROGRAM_BASE + end++] = displacement & 0xFF;
+    cpu->ram[PROGRAM_BASE + end++] = displacement >> 8;
+
+    cpu->CS = PROGRAM_BASE >> 4;
+    cpu->DS = 0;
+    cpu->IP = 0;
+    return end;
+}
+
+int main(int argc, char **argv)
+{
+    u32 laps = argc > 1 ? (u32)atoi(argv[1]) : 16000;
+
+    i8086 *cpu = new i8086;
+    cpu->init();
+    loadProgram(cpu);
+
+    // Table dispatch, one execute() call per instruction
+    u64 cyclesBefore = cpu->getCycles();
+    auto begin = std::chrono::steady_clock::now();
+    for (u32 i = 0; i < laps * INSTRUCTIONS_PER_LAP; i++)
+    {
+        cpu->execute();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    u64 cyclesPerLap = (cpu->getCycles() - cyclesBefore) / laps;
+
+    double instructions = (double)laps * INSTRUCTIONS_PER_LAP;
+    printf("execute(): %.0f instructions in %.3f s, %.2f M instructions/sec\n",
+           instructions, elapsed, instructions / elapsed / 1e6);
+
+    // Run loop in start(), same number of laps worth of cycles
+    cpu->IP = 0;
+    begin = std::chrono::steady_clock::now();
+    cpu->start(cyclesPerLap * laps);
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    printf("start():   %.0f instructions in %.3f s, %.2f M instructions/sec\n",
+           instructions, elapsed, instructions / elapsed / 1e6);
+
+    // Same again through the recompiler, memory operands still go to the interpreter
+    cpu->IP = 0;
+    begin = std::chrono::steady_clock::now();
+    cpu->start(cyclesPerLap * laps, ENGINE_JIT);
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    printf("jit:       %.0f instructions in %.3f s, %.2f M instructions/sec\n",
+           instructions, elapsed, instructions / elapsed / 1e6);
+
+    // Without cycle accounting the budget is in instructions
+    i8086Fast *fast = new i8086Fast;
+    fast->init();
+    loadProgram(fast);
+    begin = std::chrono::steady_clock::now();
+    fast->start((u64)laps * INSTRUCTIONS_PER_LAP);
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    printf("fast:      %.0f instructions in %.3f s, %.2f M instructions/sec\n",
+           instructions, elapsed, instructions / elapsed / 1e6);
+
+    delete fast;
+    delete cpu;
+    return 0;
+}
@@ -0,0 +1,271 @@
+#include <chrono>
+#include <stdlib.h>
+#include <vector>
+
+#include "../src/i8086.h"
+
+// Hot path benchmarks, results as JSON on stdout.
+//
+//   alu_branch        Register ALU ops and a taken branch, guest instructions/sec
+//                     on the cycle exact core, the fast core and the recompiler
+//   rep_movsw         REP MOVSW over 64 KiB, bytes/sec
+//   rep_stosw         REP STOSW over 64 KiB, bytes/sec
+//   modrm_cached      Instructions with memory operands, decode cache hits
+//   modrm_uncached    The same, but the code is too big for the decode cache
+//   modrm_decode      The difference, what decoding one of them costs
+//   read_byte         readByte() from the host, ns per call
+//   read_word         readWord() from the host, ns per call
+//   port_out          outBytePort() to a registered device, ns per call
+//   port_in           inBytePort() from it, ns per call
+//   interrupt         INT to an ISR that only IRETs, ns per round trip
+//
+// An optional argument scales the amount of work, 1 (the default) to 16.
+
+static const u32 PROGRAM_BASE = 0x10000; // 1000:0000
+static const u32 DATA_SEGMENT = 0x2000;
+
+struct BenchResult
+{
+    const char *name;
+    double value;
+    const char *unit;
+    u64 operations;
+    double seconds;
+};
+
+static std::vector<BenchResult> results;
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char *name, u64 operations, double seconds, bool perSecond, double scale, const char *unit)
+{
+    double value = perSecond ? operations / seconds / scale : seconds * scale / operations;
+    results.push_back({name, value, unit, operations, seconds});
+}
+
+template <class Cpu>
+static Cpu *machine(const std::vector<Byte> &program)
+{
+    Cpu *cpu = new Cpu;
+    cpu->init();
+    cpu->copyToGuest(PROGRAM_BASE, program.data(), program.size());
+    cpu->CS = cpu->SS = PROGRAM_BASE >> 4;
+    cpu->DS = DATA_SEGMENT;
+    cpu->ES = DATA_SEGMENT + 0x1000;
+    cpu->regs.SP = 0xFFFE;
+    cpu->IP = 0;
+    return cpu;
+}
+
+/* Runs until the program's CLI, HLT, the limit is only a backstop */
+template <class Cpu>
+static double runToHalt(Cpu *cpu, ExecutionEngine engine = ENGINE_INTERPRETER)
+{
+    double begin = now();
+    cpu->start(~0ull >> 1, engine);
+    double seconds = now() - begin;
+    if (!cpu->isHalted())
+    {
+        fprintf(stderr, "Error: Benchmark program didn't halt\n");
+        exit(1);
+    }
+    return seconds;
+}
+
+static void benchAluBranch(Word laps)
+{
+    std::vector<Byte> program = {
+        0xbf, (Byte)laps, (Byte)(laps >> 8), // mov di,laps
+        0xb9, 0xff, 0xff,                    // outer: mov cx,0ffffh
+        0x01, 0xd8,                          // inner: add ax,bx
+        0x29, 0xc2,                          // sub dx,ax
+        0x31, 0xd6,                          // xor si,dx
+        0x39, 0xf0,                          // cmp ax,si
+        0x43,                                // inc bx
+        0x49,                                // dec cx
+        0x75, 0xf4,                          // jnz inner
+        0x4f,                                // dec di
+        0x75, 0xee,                          // jnz outer
+        0xfa, 0xf4,                          // cli, hlt
+    };
+    u64 instructions = 1 + (u64)laps * (1 + 0xffff * 7 + 2) + 2;
+
+    i8086 *cpu = machine<i8086>(program);
+    report("alu_branch", instructions, runToHalt(cpu), true, 1e6, "M instructions/s");
+    delete cpu;
+
+    i8086Fast *fast = machine<i8086Fast>(program);
+    report("alu_branch_fast", instructions, runToHalt(fast), true, 1e6, "M instructions/s");
+    delete fast;
+
+    cpu = machine<i8086>(program);
+    report("alu_branch_jit", instructions, runToHalt(cpu, ENGINE_JIT), true, 1e6, "M instructions/s");
+    delete cpu;
+}
+
+static void benchRepString(const char *name, Byte opcode, Word laps)
+{
+    std::vector<Byte> program = {
+        0xfc,                                // cld
+        0xbb, (Byte)laps, (Byte)(laps >> 8), // mov bx,laps
+        0x31, 0xf6,                          // again: xor si,si
+        0x31, 0xff,                          // xor di,di
+        0xb9, 0x00, 0x80,                    // mov cx,8000h
+        0xf3, opcode,                        // rep movsw / rep stosw
+        0x4b,                                // dec bx
+        0x75, 0xf4,                          // jnz again
+        0xfa, 0xf4,                          // cli, hlt
+    };
+
+    i8086 *cpu = machine<i8086>(program);
+    report(name, (u64)laps * 0x10000, runToHalt(cpu), true, 1e6, "MB/s");
+    delete cpu;
+}
+
+/* Time per instruction of straight line code, copies of the pair over and over then a jmp back */
+static double modrmTime(u32 copies, u64 instructions)
+{
+    static const Byte pair[] = {
+        0x01, 0x81, 0x34, 0x12, // add [bx+di+1234h],ax
+        0x8b, 0x86, 0x00, 0x02, // mov ax,[bp+0200h]
+    };
+    std::vector<Byte> program;
+    for (u32 i = 0; i < copies; i++)
+    {
+        program.insert(program.end(), pair, pair + sizeof(pair));
+    }
+    Word back = (Word)(0 - (program.size() + 3));
+    program.push_back(0xe9); // jmp near to the start
+    program.push_back(back & 0xFF);
+    program.push_back(back >> 8);
+
+    // The fast core counts instructions rather than clocks, so the budget is exact
+    i8086Fast *cpu = machine<i8086Fast>(program);
+    double begin = now();
+    cpu->start(instructions);
+    double seconds = now() - begin;
+    delete cpu;
+    return seconds;
+}
+
+static void benchModRM(u64 instructions)
+{
+    // 2 KiB of code fits the decode cache, 32 KiB hits every entry eight times a lap
+    double cached = modrmTime(256, instructions);
+    double uncached = modrmTime(4096, instructions);
+    report("modrm_cached", instructions, cached, false, 1e9, "ns/instruction");
+    report("modrm_uncached", instructions, uncached, false, 1e9, "ns/instruction");
+    report("modrm_decode", instructions, uncached - cached, false, 1e9, "ns/instruction");
+}
+
+static void benchReads(u64 reads)
+{
+    i8086 *cpu = machine<i8086>({0xfa, 0xf4});
+    volatile u32 sink;
+
+    u32 sum = 0;
+    double begin = now();
+    for (u64 i = 0; i < reads; i++)
+    {
+        sum += cpu->readByte((u32)(i * 61) & 0xFFFF, DATA_SEGMENT); // Hops around so it isn't one cache line
+    }
+    report("read_byte", reads, now() - begin, false, 1e9, "ns/call");
+
+    begin = now();
+    for (u64 i = 0; i < reads; i++)
+    {
+        sum += cpu->readWord((u32)(i * 62) & 0xFFFF, DATA_SEGMENT);
+    }
+    report("read_word", reads, now() - begin, false, 1e9, "ns/call");
+    sink = sum;
+    (void)sink;
+    delete cpu;
+}
+
+/* Latch at a free port, the cheapest device there can be */
+struct LatchPort
+{
+    Byte value;
+
+    Byte inByte(Word port) { return value; }
+    void outByte(Word port, Byte value) { this->value = value; }
+};
+
+static void benchPorts(u64 accesses)
+{
+    i8086 *cpu = machine<i8086>({0xfa, 0xf4});
+    LatchPort latch = {0};
+    cpu->ioMap.map(0x300, 1, &latch);
+    volatile u32 sink;
+
+    double begin = now();
+    for (u64 i = 0; i < accesses; i++)
+    {
+        cpu->outBytePort(0x300, (Byte)i);
+    }
+    report("port_out", accesses, now() - begin, false, 1e9, "ns/call");
+
+    u32 sum = 0;
+    begin = now();
+    for (u64 i = 0; i < accesses; i++)
+    {
+        sum += cpu->inBytePort(0x300);
+    }
+    report("port_in", accesses, now() - begin, false, 1e9, "ns/call");
+    sink = sum;
+    (void)sink;
+    delete cpu;
+}
+
+static void benchInterrupt(Word laps)
+{
+    std::vector<Byte> program = {
+        0xbb, (Byte)laps, (Byte)(laps >> 8), // mov bx,laps
+        0xb9, 0x00, 0x80,                    // outer: mov cx,8000h
+        0xcd, 0x80,                          // inner: int 80h
+        0x49,                                // dec cx
+        0x75, 0xfb,                          // jnz inner
+        0x4b,                                // dec bx
+        0x75, 0xf5,                          // jnz outer
+        0xfa, 0xf4,                          // cli, hlt
+    };
+    program.resize(0x100);
+    program.push_back(0xcf); // 1000:0100 iret
+
+    i8086 *cpu = machine<i8086>(program);
+    cpu->writeWord(0x80 * 4, 0, 0x0100);
+    cpu->writeWord(0x80 * 4 + 2, 0, PROGRAM_BASE >> 4);
+    report("interrupt", (u64)laps * 0x8000, runToHalt(cpu), false, 1e9, "ns/round trip");
+    delete cpu;
+}
+
+int main(int argc, char **argv)
+{
+    u32 scale = argc > 1 ? (u32)atoi(argv[1]) : 1;
+    if (!scale || scale > 16) // Lap counts are guest words
+    {
+        fprintf(stderr, "Usage: bench_suite [scale]\n");
+        return 1;
+    }
+
+    benchAluBranch(40 * scale);
+    benchRepString("rep_movsw", 0xa5, 4000 * scale);
+    benchRepString("rep_stosw", 0xab, 4000 * scale);
+    benchModRM(20000000ull * scale);
+    benchReads(50000000ull * scale);
+    benchPorts(50000000ull * scale);
+    benchInterrupt(40 * scale);
+
+    printf("{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        printf("    {\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\", \"operations\": %llu, \"seconds\": %.6f}%s\n", r.name,
+               r.value, r.unit, r.operations, r.seconds, i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
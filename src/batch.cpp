@@ -0,0 +1,223 @@
+#include "batch.h"
+#include "workpool.h"
+
+#include <chrono>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+
+bool readManifest(const char *path, u64 cycles, std::vector<BatchJob> &jobs)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Can't open manifest %s\n", path);
+        return false;
+    }
+
+    char line[1024];
+    u32 number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file))
+    {
+        number++;
+        char *token = strtok(line, " \t\r\n");
+        if (!token || token[0] == '#')
+        {
+            continue; // Blank or comment
+        }
+
+        BatchJob job = {token, 0x1000, 0x0000, false, cycles};
+        while ((token = strtok(nullptr, " \t\r\n")))
+        {
+            unsigned segment, offset;
+            if (sscanf(token, "at=%x:%x", &segment, &offset) == 2)
+            {
+                job.segment = segment;
+                job.offset = offset;
+            }
+            else if (!strncmp(token, "cycles=", 7))
+            {
+                job.cycles = strtoull(token + 7, nullptr, 0);
+            }
+            else if (!strcmp(token, "enter"))
+            {
+                job.enter = true;
+            }
+            else
+            {
+                fprintf(stderr, "Error: %s line %u: unknown option '%s'\n", path, number, token);
+                ok = false;
+            }
+        }
+        jobs.push_back(job);
+    }
+    fclose(file);
+    return ok;
+}
+
+/* The file into guest memory through the CPU, so copy on write and the decode cache see it */
+template <class Cpu>
+static bool loadFile(Cpu &cpu, const BatchJob &job)
+{
+    FILE *file = fopen(job.path.c_str(), "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Can't open %s\n", job.path.c_str());
+        return false;
+    }
+
+    u32 address = job.segment * 16 + job.offset;
+    int value;
+    while ((value = fgetc(file)) != EOF)
+    {
+        cpu.writeByte(address & 0x0F, address >> 4, value);
+        address++;
+    }
+    fclose(file);
+    return true;
+}
+
+template <class Cpu>
+static BatchResult runJob(const BatchJob &job, const snapshotImage *image, const romImage *bios, ExecutionEngine engine,
+                          u32 profile)
+{
+    BatchResult result = {};
+    std::unique_ptr<Cpu> cpu(new Cpu); // Not value initialized, init() sets up what needs it
+    DebugPort debug;
+    traceRecorder recorder;
+    sampleProfiler profiler;
+
+    if (bios)
+    {
+        cpu->attachRom(*bios); // The same pages in every machine
+    }
+
+    if (image)
+    {
+        if (!cpu->fork(*image))
+        {
+            return result;
+        }
+    }
+    else
+    {
+        cpu->init();
+    }
+    cpu->ioMap.map(DEBUG_PORT, 1, &debug);
+    if (!loadFile(*cpu, job))
+    {
+        return result;
+    }
+    result.loaded = true;
+
+    if (job.enter || !image)
+    {
+        cpu->CS = job.segment;
+        cpu->IP = job.offset;
+    }
+    if (!image)
+    {
+        // Nothing set up from reset, give it its own segment like a .COM file
+        cpu->DS = cpu->ES = cpu->SS = job.segment;
+        cpu->regs.SP = 0xFFFE;
+    }
+
+    if constexpr (Cpu::PolicyType::trace)
+    {
+        if (!recorder.open((job.path + ".trace").c_str()))
+        {
+            result.loaded = false;
+            return result;
+        }
+        cpu->recorder = &recorder;
+    }
+    if (profile)
+    {
+        cpu->attachProfiler(&profiler, profile);
+    }
+
+    u64 startCycles = cpu->getCycles(); // A fork carries on from the snapshot's clock
+    auto start = std::chrono::steady_clock::now();
+    cpu->start(job.cycles, engine);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!recorder.close())
+    {
+        result.loaded = false;
+    }
+    if (profile && !(profiler.writeHotspots((job.path + ".profile").c_str()) &&
+                     profiler.writeFolded((job.path + ".folded").c_str())))
+    {
+        result.loaded = false;
+    }
+
+    result.halted = cpu->isHalted();
+    result.cycles = cpu->getCycles() - startCycles;
+    result.AX = cpu->regs.AX;
+    result.BX = cpu->regs.BX;
+    result.CX = cpu->regs.CX;
+    result.DX = cpu->regs.DX;
+    result.SI = cpu->regs.SI;
+    result.DI = cpu->regs.DI;
+    result.BP = cpu->regs.BP;
+    result.SP = cpu->regs.SP;
+    result.CS = cpu->CS;
+    result.DS = cpu->DS;
+    result.ES = cpu->ES;
+    result.SS = cpu->SS;
+    result.IP = cpu->IP;
+    result.flags = cpu->getFlags();
+    result.output = std::move(debug.output);
+    return result;
+}
+
+std::vector<BatchResult> runBatch(const std::vector<BatchJob> &jobs, const snapshotImage *image, const romImage *bios,
+                                  u32 threads, ExecutionEngine engine, bool trace, u32 profile)
+{
+    std::vector<BatchResult> results(jobs.size());
+    workPool pool(threads);
+    pool.run(jobs.size(), [&](size_t task) {
+        if (trace)
+            results[task] = runJob<i8086Traced>(jobs[task], image, bios, engine, profile);
+        else
+            results[task] = runJob<i8086>(jobs[task], image, bios, engine, profile);
+    });
+    return results;
+}
+
+/* Guest output on one line, C escapes for anything that isn't printable */
+static void printEscaped(FILE *out, const std::string &text)
+{
+    for (unsigned char c : text)
+    {
+        if (c == '\\' || c == '"')
+            fprintf(out, "\\%c", c);
+        else if (c == '\n')
+            fprintf(out, "\\n");
+        else if (c < 0x20 || c >= 0x7F)
+            fprintf(out, "\\x%02x", c);
+        else
+            fputc(c, out);
+    }
+}
+
+void printResults(FILE *out, const std::vector<BatchJob> &jobs, const std::vector<BatchResult> &results)
+{
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const BatchResult &r = results[i];
+        fprintf(out, "%s\t", jobs[i].path.c_str());
+        if (!r.loaded)
+        {
+            fprintf(out, "error\n");
+            continue;
+        }
+
+        fprintf(out, "%s\tcycles=%llu\t", r.halted ? "halt" : "limit", r.cycles);
+        fprintf(out, "AX=%04x BX=%04x CX=%04x DX=%04x SI=%04x DI=%04x BP=%04x SP=%04x ", r.AX, r.BX, r.CX, r.DX, r.SI, r.DI,
+                r.BP, r.SP);
+        fprintf(out, "CS=%04x DS=%04x ES=%04x SS=%04x IP=%04x FL=%04x\t\"", r.CS, r.DS, r.ES, r.SS, r.IP, r.flags);
+        printEscaped(out, r.output);
+        fprintf(out, "\"\n");
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "header.h"
+#include "i8086.h"
+#include "rom.h"
+#include "snapshot.h"
+
+#include <string>
+#include <vector>
+
+// Batch mode, many independent guest jobs on every host core.
+// Each job gets a machine of its own, forked from a shared snapshot image or
+// started from reset, has a file loaded into guest memory and runs until it
+// halts with interrupts off or its clock limit is up. See main.cpp for the
+// manifest format.
+
+#define DEBUG_PORT 0xE9 // Bytes written here are the job's output, like the Bochs and QEMU debug port
+
+/* Collects what the guest writes to DEBUG_PORT */
+struct DebugPort
+{
+    std::string output;
+
+    Byte inByte(Word port) { return DEBUG_PORT; } // Reads back as E9 so guests can tell it is there
+    void outByte(Word port, Byte value) { output += (char)value; }
+};
+
+struct BatchJob
+{
+    std::string path;  // Loaded into guest memory
+    Word segment;      // Where it goes
+    Word offset;
+    bool enter;        // Start running at it, rather than where the snapshot left off
+    u64 cycles;        // Clock limit
+};
+
+struct BatchResult
+{
+    bool loaded;
+    bool halted; // Ran into HLT with interrupts off before the clock limit
+    u64 cycles; // Run by the job
+    Word AX, BX, CX, DX, SI, DI, BP, SP;
+    Word CS, DS, ES, SS, IP, flags;
+    std::string output;
+    double seconds;
+};
+
+bool readManifest(const char *path, u64 cycles, std::vector<BatchJob> &jobs); // cycles is the limit for jobs that don't give one
+// image nullptr starts every machine from reset; trace records each job to its path with .trace appended;
+// profile samples every that many clocks into .profile and .folded files, 0 doesn't profile
+std::vector<BatchResult> runBatch(const std::vector<BatchJob> &jobs, const snapshotImage *image, const romImage *bios,
+                                  u32 threads, ExecutionEngine engine, bool trace = false, u32 profile = 0);
+void printResults(FILE *out, const std::vector<BatchJob> &jobs, const std::vector<BatchResult> &results);
@@ -0,0 +1,334 @@
+#include "disk.h"
+#include "i8086.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* INT 13h status codes in AH */
+#define DISK_OK 0x00
+#define DISK_BAD_COMMAND 0x01
+#define DISK_WRITE_PROTECTED 0x03
+#define DISK_SECTOR_NOT_FOUND 0x04
+#define DISK_TIMEOUT 0x80 // No such drive
+
+/* Floppy formats, told apart by their size */
+static const struct
+{
+    u64 size;
+    DiskGeometry geometry;
+    Byte type; // Drive type for AH=08h
+} floppyFormats[] = {
+    {163840, {40, 1, 8}, 1},   // 160K
+    {184320, {40, 1, 9}, 1},   // 180K
+    {327680, {40, 2, 8}, 1},   // 320K
+    {368640, {40, 2, 9}, 1},   // 360K
+    {737280, {80, 2, 9}, 3},   // 720K
+    {1228800, {80, 2, 15}, 2}, // 1.2M
+    {1474560, {80, 2, 18}, 4}, // 1.44M
+    {2949120, {80, 2, 36}, 5}, // 2.88M
+};
+
+diskImage::diskImage() : mapping(nullptr), size(0), readOnly(true), floppy(false), geometry(), nextLba(0), readaheadEnd(0)
+{
+}
+
+diskImage::~diskImage()
+{
+    if (mapping)
+    {
+        munmap(mapping, size);
+    }
+}
+
+bool diskImage::open(const char *path, bool floppy, bool readOnly)
+{
+    int fd = ::open(path, readOnly ? O_RDONLY : O_RDWR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Can't open disk image %s\n", path);
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        fprintf(stderr, "Error: Can't get the size of disk image %s\n", path);
+        close(fd);
+        return false;
+    }
+    u64 imageSize = info.st_size;
+
+    // Nothing changes until the new image is mapped, a failed open leaves the old one in place
+    DiskGeometry imageGeometry = {};
+    if (floppy)
+    {
+        for (const auto &format : floppyFormats)
+        {
+            if (format.size == imageSize)
+            {
+                imageGeometry = format.geometry;
+            }
+        }
+    }
+    else if (imageSize >= 16 * 63 * SECTOR_SIZE)
+    {
+        // The usual translation, 16 heads of 63 sectors and as many cylinders as fit up to the CHS limit
+        imageGeometry = {(u32)(imageSize / (16 * 63 * SECTOR_SIZE)), 16, 63};
+        if (imageGeometry.cylinders > 1024)
+        {
+            imageGeometry.cylinders = 1024;
+        }
+    }
+    if (!imageGeometry.cylinders)
+    {
+        fprintf(stderr, "Error: %s is no %s image size (%llu bytes)\n", path, floppy ? "floppy" : "hard disk", imageSize);
+        close(fd);
+        return false;
+    }
+
+    void *mapped = mmap(nullptr, imageSize, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Can't map disk image %s\n", path);
+        return false;
+    }
+
+    if (mapping)
+    {
+        munmap(mapping, size); // Opened before, the new image replaces it
+    }
+    mapping = (Byte *)mapped;
+    size = imageSize;
+    geometry = imageGeometry;
+    this->floppy = floppy;
+    this->readOnly = readOnly;
+    nextLba = 0;
+    readaheadEnd = 0;
+    return true;
+}
+
+bool diskImage::flush()
+{
+    return !mapping || readOnly || msync(mapping, size, MS_SYNC) == 0;
+}
+
+Byte *diskImage::access(u32 lba, u32 count)
+{
+    u64 start = (u64)lba * SECTOR_SIZE;
+    u64 end = start + (u64)count * SECTOR_SIZE;
+    if (end > size)
+    {
+        return nullptr;
+    }
+
+    // Carrying on where the last transfer stopped, have the kernel fetch the next stretch before the guest asks
+    if (lba == nextLba && end + READAHEAD_SIZE / 2 > readaheadEnd)
+    {
+        u64 from = (end > readaheadEnd ? end : readaheadEnd) & ~(u64)(sysconf(_SC_PAGESIZE) - 1);
+        u64 to = end + READAHEAD_SIZE < size ? end + READAHEAD_SIZE : size;
+        if (to > from)
+        {
+            madvise(mapping + from, to - from, MADV_WILLNEED);
+        }
+        readaheadEnd = to;
+    }
+    nextLba = lba + count;
+    return mapping + start;
+}
+
+bool diskImage::isReadOnly()
+{
+    return readOnly;
+}
+
+bool diskImage::isFloppy()
+{
+    return floppy;
+}
+
+u32 diskImage::getSectorCount()
+{
+    return size / SECTOR_SIZE;
+}
+
+const DiskGeometry &diskImage::getGeometry()
+{
+    return geometry;
+}
+
+template <class Cpu>
+diskBios<Cpu>::diskBios() : cpu(nullptr), floppies(), hardDisks(), status(DISK_OK)
+{
+}
+
+template <class Cpu>
+void diskBios<Cpu>::attach(Cpu &cpu)
+{
+    this->cpu = &cpu;
+    cpu.hookInterrupt(0x13, int13, this);
+}
+
+template <class Cpu>
+void diskBios<Cpu>::setDrive(Byte drive, diskImage *image)
+{
+    if (drive & 0x80)
+    {
+        hardDisks[drive & 0x01] = image;
+        cpu->writeByte(0x475, 0, (hardDisks[0] != nullptr) + (hardDisks[1] != nullptr)); // Hard disk count in the BIOS data area
+    }
+    else
+    {
+        floppies[drive & 0x01] = image;
+    }
+}
+
+template <class Cpu>
+diskImage *diskBios<Cpu>::getDrive(Byte drive)
+{
+    if (drive & 0x7E)
+    {
+        return nullptr; // Only two of each
+    }
+    return (drive & 0x80) ? hardDisks[drive & 0x01] : floppies[drive & 0x01];
+}
+
+/* Status into AH and CF, like the BIOS leaves them */
+template <class Cpu>
+void diskBios<Cpu>::finish(Byte result)
+{
+    status = result;
+    cpu->regs.AH = result;
+    cpu->setFlags((cpu->getFlags() & ~0x0001) | (result != DISK_OK));
+}
+
+/* AH=02h/03h: AL sectors from CH/CL cylinder and sector, DH head, at ES:BX */
+template <class Cpu>
+Byte diskBios<Cpu>::transfer(diskImage *disk, bool write)
+{
+    const DiskGeometry &geometry = disk->getGeometry();
+    u32 cylinder = cpu->regs.CH | (cpu->regs.CL & 0xC0) << 2;
+    u32 sector = cpu->regs.CL & 0x3F;
+    u32 head = cpu->regs.DH;
+    u32 count = cpu->regs.AL;
+
+    if (!count || !sector || sector > geometry.sectors || head >= geometry.heads || cylinder >= geometry.cylinders)
+    {
+        cpu->regs.AL = 0;
+        return DISK_SECTOR_NOT_FOUND;
+    }
+    if (write && disk->isReadOnly())
+    {
+        cpu->regs.AL = 0;
+        return DISK_WRITE_PROTECTED;
+    }
+
+    u32 lba = (cylinder * geometry.heads + head) * geometry.sectors + sector - 1;
+    Byte *sectors = disk->access(lba, count);
+    if (!sectors)
+    {
+        cpu->regs.AL = 0;
+        return DISK_SECTOR_NOT_FOUND;
+    }
+
+    // Straight between the mapping and guest memory
+    u32 buffer = cpu->ES * 16 + cpu->regs.BX;
+    if (write)
+    {
+        cpu->copyFromGuest(buffer, sectors, count * SECTOR_SIZE);
+    }
+    else
+    {
+        cpu->copyToGuest(buffer, sectors, count * SECTOR_SIZE);
+    }
+    return DISK_OK;
+}
+
+template <class Cpu>
+bool diskBios<Cpu>::int13(void *context, Byte vector)
+{
+    diskBios *bios = (diskBios *)context;
+    Cpu *cpu = bios->cpu;
+    diskImage *disk = bios->getDrive(cpu->regs.DL);
+
+    switch (cpu->regs.AH)
+    {
+    case 0x00: // Reset
+        bios->finish(disk ? DISK_OK : DISK_TIMEOUT);
+        break;
+    case 0x01: // Status of the last operation
+        bios->finish(bios->status);
+        break;
+    case 0x02: // Read sectors
+    case 0x03: // Write sectors
+        bios->finish(disk ? bios->transfer(disk, cpu->regs.AH == 0x03) : DISK_TIMEOUT);
+        break;
+    case 0x04: // Verify sectors, the image can't have bad ones
+        bios->finish(disk ? DISK_OK : DISK_TIMEOUT);
+        break;
+    case 0x08: // Drive parameters
+    {
+        if (!disk)
+        {
+            bios->finish(DISK_TIMEOUT);
+            break;
+        }
+        const DiskGeometry &geometry = disk->getGeometry();
+        u32 lastCylinder = geometry.cylinders - 1;
+        cpu->regs.CH = lastCylinder & 0xFF;
+        cpu->regs.CL = geometry.sectors | (lastCylinder >> 2 & 0xC0);
+        cpu->regs.DH = geometry.heads - 1;
+        if (disk->isFloppy())
+        {
+            cpu->regs.DL = (bios->floppies[0] != nullptr) + (bios->floppies[1] != nullptr);
+            cpu->regs.BL = 4;
+            for (const auto &format : floppyFormats)
+            {
+                if (format.geometry.cylinders == geometry.cylinders && format.geometry.sectors == geometry.sectors)
+                {
+                    cpu->regs.BL = format.type;
+                }
+            }
+            cpu->ES = 0; // No diskette parameter table
+            cpu->regs.DI = 0;
+        }
+        else
+        {
+            cpu->regs.DL = (bios->hardDisks[0] != nullptr) + (bios->hardDisks[1] != nullptr);
+        }
+        cpu->regs.AL = 0;
+        bios->finish(DISK_OK);
+        break;
+    }
+    case 0x15: // Disk type
+        if (!disk)
+        {
+            cpu->regs.AH = 0x00; // No such drive, and CF clear
+            cpu->setFlags(cpu->getFlags() & ~0x0001);
+            break;
+        }
+        bios->finish(DISK_OK);
+        if (disk->isFloppy())
+        {
+            cpu->regs.AH = 0x01; // Floppy without change line
+        }
+        else
+        {
+            cpu->regs.AH = 0x03;
+            cpu->regs.CX = disk->getSectorCount() >> 16;
+            cpu->regs.DX = disk->getSectorCount() & 0xFFFF;
+        }
+        break;
+    default: // Extensions (41h and up) and formatting aren't there
+        bios->finish(DISK_BAD_COMMAND);
+        break;
+    }
+    return true;
+}
+
+template class diskBios<i8086>;
+template class diskBios<i8086Fast>;
+template class diskBios<i8086Traced>;
+template class diskBios<i8086Checked>;
@@ -0,0 +1,69 @@
+#pragma once
+#include "header.h"
+
+// Floppy and hard disk drives, served through INT 13h.
+// A drive is a raw image file mmap'd shared: sector transfers are a copy
+// between the mapping and guest memory, with no read()/write() and no bounce
+// buffer. Sequential access is spotted and the next stretch of the image is
+// madvise()d in ahead of the guest. Writes land in the page cache, flush()
+// forces them out to the file.
+
+#define SECTOR_SIZE 512
+#define READAHEAD_SIZE 0x20000 // Advised ahead of a sequential run, 128 KiB
+
+struct DiskGeometry
+{
+    u32 cylinders;
+    u32 heads;
+    u32 sectors; // Per track, numbered from 1
+};
+
+class diskImage
+{
+public:
+    diskImage();
+    ~diskImage();
+
+    bool open(const char *path, bool floppy, bool readOnly = false); // Geometry from the size, standard formats for floppies
+    bool flush(); // msync(), dirty pages only reach the file when the kernel gets round to it otherwise
+
+    Byte *access(u32 lba, u32 count); // The sectors in the mapping, nullptr past the end
+    bool isReadOnly();
+    bool isFloppy();
+    u32 getSectorCount();
+    const DiskGeometry &getGeometry();
+
+private:
+    Byte *mapping;
+    u64 size;
+    bool readOnly;
+    bool floppy;
+    DiskGeometry geometry;
+
+    u32 nextLba;      // Where a sequential run would continue
+    u64 readaheadEnd; // Advised up to here
+};
+
+// The INT 13h disk services of the BIOS, run on the host instead of in the
+// guest. Drives 00h and 01h are floppies, 80h and 81h hard disks. Supports
+// reset, status, read, write, verify, drive parameters and disk type.
+template <class Cpu>
+class diskBios
+{
+public:
+    diskBios();
+
+    void attach(Cpu &cpu); // Hooks INT 13h
+    void setDrive(Byte drive, diskImage *image); // nullptr removes it
+
+private:
+    Cpu *cpu;
+    diskImage *floppies[2];
+    diskImage *hardDisks[2];
+    Byte status; // Of the last operation, for AH=01h
+
+    static bool int13(void *context, Byte vector);
+    diskImage *getDrive(Byte drive);
+    Byte transfer(diskImage *disk, bool write);
+    void finish(Byte result);
+};
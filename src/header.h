@@ -8,6 +8,4 @@ using Byte = unsigned char;
 using Word = unsigned short;
 
 using u32 = unsigned int;
-
-using InPortFunction = std::function<Byte()>;
-using OutPortFunction = std::function<void(Byte)>;
\ No newline at end of file
+using u64 = unsigned long long;
\ No newline at end of file
@@ -1,245 +1,571 @@
 #include "i8086.h"
+#include "strscan.h"
 
-void i8086::pushByte(Byte value)
+#include <string.h>
+
+template <class Policy>
+void basic_i8086<Policy>::pushByte(Byte value)
 {
-    SP--;
-    cycles -= 2;
-    writeByte(SP, SS, value);
+    regs.SP--;
+    writeByte(regs.SP, SS, value);
 }
 
-void i8086::pushWord(Word value)
+template <class Policy>
+void basic_i8086<Policy>::pushWord(Word value)
 {
-    SP -= 2;
-    cycles -= 3;
-    writeByte(SP, SS, value & 0xFF);            // Lower byte
-    writeByte(SP + 1, SS, (value >> 8) & 0xFF); // Higher byte
+    regs.SP -= 2;
+    writeWord(regs.SP, SS, value);
 }
 
-Byte i8086::popByte()
+template <class Policy>
+Byte basic_i8086<Policy>::popByte()
 {
-    Byte value = readByte(SP, SS);
-    SP++;
-    cycles -= 2;
+    Byte value = readByte(regs.SP, SS);
+    regs.SP++;
     return value;
 }
 
-Word i8086::popWord()
+template <class Policy>
+Word basic_i8086<Policy>::popWord()
 {
-    Byte lowByte = readByte(SP, SS);
-    Byte highByte = readByte(SP + 1, SS);
-    SP += 2;
-    cycles -= 3;
-    return (highByte << 8) | lowByte;
+    Word value = readWord(regs.SP, SS);
+    regs.SP += 2;
+    return value;
+}
+
+template <class Policy>
+Word basic_i8086<Policy>::getFlags()
+{
+    materializeFlags();
+    Word flags;
+    memcpy(&flags, &FR, sizeof(flags)); // Not through a Word pointer, that breaks strict aliasing
+    return flags | 0xF002;              // Bits 12-15 and 1 always read as set on the 8086
+}
+
+template <class Policy>
+void basic_i8086<Policy>::setFlags(Word flags)
+{
+    lazyFlags.op = FLAGOP_NONE; // Everything comes from the new value
+    memcpy(&FR, &flags, sizeof(FR));
+}
+
+template <class Policy>
+void basic_i8086<Policy>::setLazyFlags(Byte op, bool wide, Word dst, Word src, u32 result)
+{
+    lazyFlags.op = op;
+    lazyFlags.wide = wide;
+    lazyFlags.dst = dst;
+    lazyFlags.src = src;
+    lazyFlags.result = result & (wide ? 0x1FFFF : 0x1FF); // Keep the carry/borrow bit above the operand
+}
+
+template <class Policy>
+void basic_i8086<Policy>::materializeFlags()
+{
+    if (lazyFlags.op == FLAGOP_NONE)
+    {
+        return;
+    }
+
+    FR.CF = getCF();
+    FR.PF = getPF();
+    FR.AF = getAF();
+    FR.ZF = getZF();
+    FR.SF = getSF();
+    FR.OF = getOF();
+    lazyFlags.op = FLAGOP_NONE;
+}
+
+template <class Policy>
+bool basic_i8086<Policy>::getCF()
+{
+    switch (lazyFlags.op)
+    {
+    case FLAGOP_ADD:
+    case FLAGOP_SUB:
+        return (lazyFlags.result >> (lazyFlags.wide ? 16 : 8)) & 1; // Carry or borrow out of the top bit
+    case FLAGOP_LOGIC:
+        return false;
+    case FLAGOP_INC:
+    case FLAGOP_DEC:
+        return lazyFlags.carryIn;
+    default:
+        return FR.CF;
+    }
+}
+
+template <class Policy>
+bool basic_i8086<Policy>::getPF()
+{
+    if (lazyFlags.op == FLAGOP_NONE)
+    {
+        return FR.PF;
+    }
+
+    // Even parity of the low byte, folded down to a nibble lookup
+    Byte low = lazyFlags.result & 0xFF;
+    low ^= low >> 4;
+    return !((0x6996 >> (low & 0x0F)) & 1);
+}
+
+template <class Policy>
+bool basic_i8086<Policy>::getAF()
+{
+    switch (lazyFlags.op)
+    {
+    case FLAGOP_NONE:
+        return FR.AF;
+    case FLAGOP_LOGIC:
+        return false;
+    default:
+        return ((lazyFlags.dst ^ lazyFlags.src ^ lazyFlags.result) & 0x10) != 0; // Carry out of bit 3
+    }
+}
+
+template <class Policy>
+bool basic_i8086<Policy>::getZF()
+{
+    if (lazyFlags.op == FLAGOP_NONE)
+    {
+        return FR.ZF;
+    }
+    return (lazyFlags.result & (lazyFlags.wide ? 0xFFFF : 0xFF)) == 0;
+}
+
+template <class Policy>
+bool basic_i8086<Policy>::getSF()
+{
+    if (lazyFlags.op == FLAGOP_NONE)
+    {
+        return FR.SF;
+    }
+    return (lazyFlags.result & (lazyFlags.wide ? 0x8000 : 0x80)) != 0;
 }
 
-Word i8086::getFlags()
+template <class Policy>
+bool basic_i8086<Policy>::getOF()
 {
-    cycles -= 1;
-    return *(Word *)&FR;
+    u32 sign = lazyFlags.wide ? 0x8000 : 0x80;
+    u32 dst = lazyFlags.dst;
+    u32 src = lazyFlags.src;
+    u32 result = lazyFlags.result;
+
+    switch (lazyFlags.op)
+    {
+    case FLAGOP_ADD:
+    case FLAGOP_INC:
+        return ((dst ^ result) & (src ^ result) & sign) != 0; // Both operands differ in sign from the result
+    case FLAGOP_SUB:
+    case FLAGOP_DEC:
+        return ((dst ^ src) & (dst ^ result) & sign) != 0; // Operands differ in sign, result took the subtrahend's
+    case FLAGOP_LOGIC:
+        return false;
+    default:
+        return FR.OF;
+    }
 }
 
-void i8086::interrupt(Byte vector)
+template <class Policy>
+Word basic_i8086<Policy>::alu(Byte operation, bool wide, Word dst, Word src)
 {
-    bool isNonMaskable = vector <= 0x1F;
-    Word flags = getFlags();
-    cycles -= 15;
+    // operation is the 8086 encoding order: ADD, OR, ADC, SBB, AND, SUB, XOR, CMP
+    u32 result;
+    switch (operation)
+    {
+    case 0: // ADD
+        result = (u32)dst + src;
+        setLazyFlags(FLAGOP_ADD, wide, dst, src, result);
+        break;
+    case 1: // OR
+        result = dst | src;
+        setLazyFlags(FLAGOP_LOGIC, wide, dst, src, result);
+        break;
+    case 2: // ADC
+        result = (u32)dst + src + getCF();
+        setLazyFlags(FLAGOP_ADD, wide, dst, src, result);
+        break;
+    case 3: // SBB
+        result = (u32)dst - src - getCF();
+        setLazyFlags(FLAGOP_SUB, wide, dst, src, result);
+        break;
+    case 4: // AND
+        result = dst & src;
+        setLazyFlags(FLAGOP_LOGIC, wide, dst, src, result);
+        break;
+    case 6: // XOR
+        result = dst ^ src;
+        setLazyFlags(FLAGOP_LOGIC, wide, dst, src, result);
+        break;
+    case 5: // SUB
+    case 7: // CMP
+    default:
+        result = (u32)dst - src;
+        setLazyFlags(FLAGOP_SUB, wide, dst, src, result);
+        break;
+    }
+    return result & (wide ? 0xFFFF : 0xFF);
+}
 
-    // Proceed if the interrupt is non-maskable or if the IF is set
-    if (isNonMaskable || FR.IF)
+template <class Policy>
+void basic_i8086<Policy>::interrupt(Byte vector)
+{
+    // Whether a hardware interrupt may be taken (IF) is up to the caller
+    if constexpr (Policy::trace)
     {
-        u32 ivtAddress = vector * 4;
-        Word isrOffset = readWord(ivtAddress, 0);
-        Word isrSegment = readWord(ivtAddress + 2, 0);
+        if (recorder)
+            recorder->interrupt(vector);
+    }
+
+    u32 ivtAddress = vector * 4;
+    Word isrOffset = readWord(ivtAddress, 0);
+    Word isrSegment = readWord(ivtAddress + 2, 0);
 
-        pushWord(flags);
-        pushWord(CS);
-        pushWord(IP);
+    pushWord(getFlags());
+    pushWord(CS);
+    pushWord(IP);
 
-        // Clear the IF for maskable interrupts
-        if (!isNonMaskable)
+    FR.IF = 0;
+    FR.TF = 0;
+
+    CS = isrSegment;
+    IP = isrOffset;
+    if (profiler)
+        profiler->enter(vector, CS, IP, regs.SP);
+}
+
+// Work raised from outside the instruction stream, run by start() between
+// slices and by execute() before an instruction. A device that raises work
+// also ends the slice, so the inner loop never has to look at this.
+template <class Policy>
+void basic_i8086<Policy>::serviceWork()
+{
+    if ((pendingWork & WORK_IRQ) && FR.IF)
+    {
+        halt = false; // An interrupt ends HLT
+        interrupt(pic.acknowledge());
+        charge(61); // INTA cycles and the interrupt sequence
+    }
+}
+
+template <class Policy>
+void basic_i8086<Policy>::intrChanged(void *context, bool level)
+{
+    basic_i8086 *cpu = (basic_i8086 *)context;
+    if (level)
+    {
+        cpu->pendingWork |= WORK_IRQ;
+        if (cpu->FR.IF)
         {
-            FR.IF = 0;
+            cpu->endSlice();
         }
+    }
+    else
+    {
+        cpu->pendingWork &= ~WORK_IRQ;
+    }
+}
 
-        CS = isrSegment;
-        IP = isrOffset;
+template <class Policy>
+void basic_i8086<Policy>::interruptsEnabled()
+{
+    if (FR.IF && pendingWork)
+    {
+        endSlice(); // Something was waiting for IF
     }
 }
 
-Byte i8086::fetchByte()
+template <class Policy>
+Byte basic_i8086<Policy>::fetchByte()
 {
     Byte byte = readByte(IP, CS);
     IP += 1;
-    cycles--;
     return byte;
 }
 
-Word i8086::fetchWord()
+template <class Policy>
+Word basic_i8086<Policy>::fetchWord()
 {
     Word word = readWord(IP, CS);
     IP += 2;
-    cycles -= 2;
     return word;
 }
 
-void i8086::writeWord(u32 address, u32 segment, Word value)
+template <class Policy>
+void basic_i8086<Policy>::writeWord(u32 address, u32 segment, Word value)
+{
+    u32 physicalAddress = getPhysicalAddress(address, segment);
+
+    // Both bytes in one host page and no wrap at the end of the segment
+    if ((address & 0xFFFF) != 0xFFFF && (physicalAddress & PAGE_MASK) != PAGE_MASK)
+    {
+        Byte *host = memMap.writePage[physicalAddress >> PAGE_SHIFT];
+        if (host)
+        {
+            storeWord(host + (physicalAddress & PAGE_MASK), value);
+            if constexpr (Policy::trace)
+            {
+                if (recorder)
+                    recorder->write16(physicalAddress, value);
+            }
+            return;
+        }
+    }
+
+    writePhysical(physicalAddress, value & 0xFF);                                 // Lower byte
+    writePhysical(getPhysicalAddress(address + 1, segment), (value >> 8) & 0xFF); // Higher byte
+}
+
+template <class Policy>
+u32 basic_i8086<Policy>::getPhysicalAddress(u32 address, u32 segment)
+{
+    // The offset wraps inside the segment, the sum wraps at the top of the
+    // address space unless A20 lets it through to the HMA
+    return ((segment << 4) + (address & 0xFFFF)) & addressMask;
+}
+
+template <class Policy>
+void basic_i8086<Policy>::setA20(bool enabled)
+{
+    addressMask = enabled ? 0x1FFFFF : ADDRESS_MASK;
+}
+
+template <class Policy>
+bool basic_i8086<Policy>::getA20()
+{
+    return addressMask != ADDRESS_MASK;
+}
+
+template <class Policy>
+void basic_i8086<Policy>::writeByte(u32 address, u32 segment, Byte value)
 {
-    cycles -= 4;
-    Byte lowByte = value & 0xFF;
-    Byte highByte = (value >> 8) & 0xFF;
+    writePhysical(getPhysicalAddress(address, segment), value);
+}
 
-    writeByte(address, segment, lowByte);
-    writeByte(address + 1, segment, highByte);
+template <class Policy>
+Byte basic_i8086<Policy>::readByte(u32 address, u32 segment)
+{
+    return readPhysical(getPhysicalAddress(address, segment));
 }
 
-void i8086::writeByte(u32 address, u32 segment, Byte value)
+template <class Policy>
+Byte basic_i8086<Policy>::readPhysical(u32 physicalAddress)
 {
-    cycles -= 2;
-    u32 physicalAddress = (segment * 16) + address;
-    if (physicalAddress <= 0xEFFFF)
+    u32 page = physicalAddress >> PAGE_SHIFT;
+    Byte *host = memMap.readPage[page];
+    if (host) // RAM, ROM and unmapped pages
     {
-        ram[physicalAddress] = value;
+        return host[physicalAddress & PAGE_MASK];
     }
-    else if (physicalAddress >= 0xF0000 && physicalAddress <= 0xFFFFF)
+    return memMap.device[page]->readByte(physicalAddress);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::copyToGuest(u32 physicalAddress, const Byte *source, u32 size)
+{
+    if constexpr (Policy::trace)
     {
-        printf("Error: Writing to ROM is not allowed!\n");
+        if (recorder)
+            recorder->block(physicalAddress & addressMask, source, size);
     }
-    else
+
+    while (size)
     {
-        printf("Error: Trying to access out of bounds memory at %X:%X\n", segment, address);
+        physicalAddress &= addressMask;
+        u32 page = physicalAddress >> PAGE_SHIFT;
+        u32 offset = physicalAddress & PAGE_MASK;
+        u32 chunk = size < PAGE_SIZE - offset ? size : PAGE_SIZE - offset;
+
+        if (page < MAP_PAGES)
+        {
+            // The whole chunk is going to be written, do what the first byte through writeSlow() would once
+            if (memMap.flags[page] & PAGE_RAM)
+            {
+                prepareWrite(physicalAddress);
+            }
+
+            Byte *host = memMap.writePage[page];
+            if (host)
+            {
+                memcpy(host + offset, source, chunk);
+            }
+            else
+            {
+                for (u32 i = 0; i < chunk; i++) // ROM and devices
+                {
+                    writeSlow(physicalAddress + i, source[i]);
+                }
+            }
+        }
+        physicalAddress += chunk;
+        source += chunk;
+        size -= chunk;
     }
 }
 
-Byte i8086::readByte(u32 address, u32 segment)
+template <class Policy>
+void basic_i8086<Policy>::copyFromGuest(u32 physicalAddress, Byte *destination, u32 size)
 {
-    cycles -= 2;
-    u32 physicalAddress = (segment * 16) + address;
-    if (physicalAddress <= 0xEFFFF)
+    while (size)
     {
-        return ram[physicalAddress];
+        physicalAddress &= addressMask;
+        u32 page = physicalAddress >> PAGE_SHIFT;
+        u32 offset = physicalAddress & PAGE_MASK;
+        u32 chunk = size < PAGE_SIZE - offset ? size : PAGE_SIZE - offset;
+
+        if (page >= MAP_PAGES)
+        {
+            memset(destination, 0xFF, chunk); // Past the end of the map, open bus
+        }
+        else if (memMap.readPage[page])
+        {
+            memcpy(destination, memMap.readPage[page] + offset, chunk);
+        }
+        else
+        {
+            for (u32 i = 0; i < chunk; i++)
+            {
+                destination[i] = readPhysical(physicalAddress + i);
+            }
+        }
+        physicalAddress += chunk;
+        destination += chunk;
+        size -= chunk;
     }
-    else if (physicalAddress >= 0xF0000 && physicalAddress <= 0xFFFFF)
+}
+
+template <class Policy>
+void basic_i8086<Policy>::writePhysical(u32 physicalAddress, Byte value)
+{
+    if constexpr (Policy::trace)
     {
-        return rom[physicalAddress - 0xF0000];
+        if (recorder)
+            recorder->write8(physicalAddress, value);
     }
-    else
+
+    Byte *host = memMap.writePage[physicalAddress >> PAGE_SHIFT];
+    if (host) // RAM that holds no decoded code
     {
-        printf("Error: Trying to access out of bounds memory at %X:%X\n", segment, address);
-        return 0;
+        host[physicalAddress & PAGE_MASK] = value;
+        return;
     }
+    writeSlow(physicalAddress, value);
 }
 
-Word i8086::readWord(u32 address, u32 segment)
-{
-    cycles -= 4;
-    Byte lowByte = readByte(address, segment);
-    Byte highByte = readByte(address + 1, segment);
-    Word word = (highByte << 8) | lowByte;
-    return word;
-}
-
-Byte i8086::inBytePort(Word port)
+/* What the first write to a trapped RAM page has to do, after which it is usually back on the fast path */
+template <class Policy>
+void basic_i8086<Policy>::prepareWrite(u32 physicalAddress)
 {
-    cycles -= 1;
-    auto it = inPortMap.find(port);
-    if (it != inPortMap.end())
+    u32 page = physicalAddress >> PAGE_SHIFT;
+    if (memMap.flags[page] & PAGE_COW)
     {
-        return it->second();
+        memMap.copyOnWrite(page); // First write since the fork, this machine gets its own copy
     }
-    else
+    if ((memMap.flags[page] & (PAGE_WATCH | PAGE_DIRTY)) == PAGE_WATCH)
+    {
+        memMap.markDirty(page); // A device has something new to look at
+    }
+    if (memMap.flags[page] & PAGE_CODE)
     {
-        fprintf(stderr, "Warning: Trying to read from unmapped port \'%x\'", port);
-        return 0; // Its always gonna be 0...
+        invalidateCode(physicalAddress); // Self-modifying code
     }
 }
 
-void i8086::outBytePort(Word port, Byte value)
+template <class Policy>
+void basic_i8086<Policy>::writeSlow(u32 physicalAddress, Byte value)
 {
-    cycles -= 1;
-    auto it = outPortMap.find(port);
-    if (it != outPortMap.end())
+    u32 page = physicalAddress >> PAGE_SHIFT;
+    Byte flags = memMap.flags[page];
+
+    if (flags & PAGE_RAM) // With its writes trapped for one of the reasons in prepareWrite()
     {
-        it->second(value);
+        prepareWrite(physicalAddress);
+        memMap.hostPage[page][physicalAddress & PAGE_MASK] = value;
     }
-    else
+    else if (flags & PAGE_DEVICE)
+    {
+        memMap.device[page]->writeByte(physicalAddress, value);
+    }
+    else if constexpr (Policy::checks)
     {
-        // Handle the case where the port is not mapped
-        fprintf(stderr, "Warning: Trying to write to unmapped port \'%x\'", port);
+        fprintf(stderr, "Warning: Dropped write of %02x to %s at %05x\n", value, (flags & PAGE_ROM) ? "ROM" : "unmapped memory",
+                physicalAddress);
     }
+    // Writes to ROM and unmapped pages are dropped, like on the bus
 }
 
-Byte i8086::getRegister8Value(Byte regIndex)
+template <class Policy>
+Word basic_i8086<Policy>::readWord(u32 address, u32 segment)
 {
-    switch (regIndex)
+    u32 physicalAddress = getPhysicalAddress(address, segment);
+
+    // Both bytes in one host page and no wrap at the end of the segment
+    if ((address & 0xFFFF) != 0xFFFF && (physicalAddress & PAGE_MASK) != PAGE_MASK)
     {
-    case 0:
-        return regs.AL; // AL
-    case 1:
-        return regs.CL; // CL
-    case 2:
-        return regs.DL; // DL
-    case 3:
-        return regs.BL; // BL
-    case 4:
-        return regs.AH; // AH
-    case 5:
-        return regs.CH; // CH
-    case 6:
-        return regs.DH; // DH
-    case 7:
-        return regs.BH; // BH
-    default:
-        return 0; // Error case
-    }
-}
-void i8086::setRegister8Value(Byte rmIndex, Byte value)
-{
-    switch (rmIndex)
-    {
-    case 0:
-        regs.AL = value;
-        break; // AL
-    case 1:
-        regs.CL = value;
-        break; // CL
-    case 2:
-        regs.DL = value;
-        break; // DL
-    case 3:
-        regs.BL = value;
-        break; // BL
-    case 4:
-        regs.AH = value;
-        break; // AH
-    case 5:
-        regs.CH = value;
-        break; // CH
-    case 6:
-        regs.DH = value;
-        break; // DH
-    case 7:
-        regs.BH = value;
-        break; // BH
-    default:
-        break; // Error case
+        Byte *host = memMap.readPage[physicalAddress >> PAGE_SHIFT];
+        if (host)
+        {
+            return loadWord(host + (physicalAddress & PAGE_MASK));
+        }
     }
+
+    Byte lowByte = readPhysical(physicalAddress);
+    Byte highByte = readPhysical(getPhysicalAddress(address + 1, segment));
+    return (highByte << 8) | lowByte;
+}
+
+template <class Policy>
+Byte basic_i8086<Policy>::inBytePort(Word port)
+{
+    return ioMap.inByte(port);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::outBytePort(Word port, Byte value)
+{
+    ioMap.outByte(port, value);
+}
+
+template <class Policy>
+Word basic_i8086<Policy>::inWordPort(Word port)
+{
+    return ioMap.inWord(port);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::outWordPort(Word port, Word value)
+{
+    ioMap.outWord(port, value);
+}
+
+/* Byte registers index the halves of the first four words, see GPReg */
+template <class Policy>
+Byte basic_i8086<Policy>::getRegister8Value(Byte regIndex)
+{
+    return regs.r8[(regIndex & 3) << 1 | regIndex >> 2];
+}
+
+template <class Policy>
+void basic_i8086<Policy>::setRegister8Value(Byte rmIndex, Byte value)
+{
+    regs.r8[(rmIndex & 3) << 1 | rmIndex >> 2] = value;
 }
 
-void i8086::setSegmentRegister(Byte hexReg, Word value)
+template <class Policy>
+void basic_i8086<Policy>::setSegmentRegister(Byte hexReg, Word value)
 {
     switch (hexReg)
     {
     case 0x0:
-        CS = value;
+        ES = value;
         break;
     case 0x1:
-        DS = value;
+        CS = value;
         break;
     case 0x2:
         SS = value;
         break;
     case 0x3:
-        ES = value;
+        DS = value;
         break;
     case 0x4:
         FS = value;
@@ -253,18 +579,19 @@ void i8086::setSegmentRegister(Byte hexReg, Word value)
     }
 }
 
-Word i8086::getSegmentRegister(Byte hexReg)
+template <class Policy>
+Word basic_i8086<Policy>::getSegmentRegister(Byte hexReg)
 {
     switch (hexReg)
     {
     case 0x0:
-        return CS;
+        return ES;
     case 0x1:
-        return DS;
+        return CS;
     case 0x2:
         return SS;
     case 0x3:
-        return ES;
+        return DS;
     case 0x4:
         return FS;
     case 0x5:
@@ -275,526 +602,1677 @@ Word i8086::getSegmentRegister(Byte hexReg)
     }
 }
 
-bool i8086::isMemoryOperand(Byte modRM)
+template <class Policy>
+bool basic_i8086<Policy>::isMemoryOperand(Byte modRM)
 {
     Byte mod = (modRM >> 6) & 0x03;
     return mod != 0x03; // Memory operand if mod isn't 0x03
 }
 
-bool i8086::execute()
+
+/* Opcode tables generated from opcodes.def, indexed by the opcode byte */
+template <class Policy>
+const typename basic_i8086<Policy>::OpcodeHandler basic_i8086<Policy>::opcodeTable[256] = {
+#define OPCODE(op, handler, format, regCycles, memCycles) &basic_i8086::handler,
+#include "opcodes.def"
+#undef OPCODE
+};
+
+static constexpr Byte opcodeFormat[256] = {
+#define OPCODE(op, handler, format, regCycles, memCycles) FMT_##format,
+#include "opcodes.def"
+#undef OPCODE
+};
+
+/* Documented 8086 clocks, register form and memory form without the EA time */
+static constexpr Byte regCycles[256] = {
+#define OPCODE(op, handler, format, regCycles, memCycles) regCycles,
+#include "opcodes.def"
+#undef OPCODE
+};
+
+static constexpr Byte memCycles[256] = {
+#define OPCODE(op, handler, format, regCycles, memCycles) memCycles,
+#include "opcodes.def"
+#undef OPCODE
+};
+
+/* Groups where the ModR/M reg field picks the instruction, {register, memory} clocks per reg */
+static constexpr Byte group1Cycles[8][2] = {
+    {4, 17}, {4, 17}, {4, 17}, {4, 17}, {4, 17}, {4, 17}, {4, 17}, {4, 10}, // add, or, adc, sbb, and, sub, xor, cmp
+};
+static constexpr Byte group3Cycles[2][8][2] = {
+    // test, test (alias), not, neg, mul, imul, div, idiv. Multiply and divide take their fastest time
+    {{5, 11}, {5, 11}, {3, 16}, {3, 16}, {70, 76}, {80, 86}, {80, 86}, {101, 107}},      // Byte
+    {{5, 11}, {5, 11}, {3, 16}, {3, 16}, {118, 124}, {128, 134}, {144, 150}, {165, 171}}, // Word
+};
+static constexpr Byte group5Cycles[8][2] = {
+    {3, 15}, {3, 15}, {16, 21}, {37, 37}, {11, 18}, {24, 24}, {11, 16}, {11, 16}, // inc, dec, call, call far, jmp, jmp far, push
+};
+
+/* Clocks per element of a REP string instruction, on top of 9 for the instruction, from movs (0xa4) to scas (0xaf) */
+static constexpr Byte repeatCycles[12] = {17, 17, 22, 22, 0, 0, 10, 10, 13, 13, 15, 15};
+#define REP_CHUNK 1024 // Elements a REP runs before it looks at the slice budget again
+
+/* Registers an effective address adds up, in the order getAddressFromModRM() lays them out */
+enum EffectiveAddressRegister : Byte
 {
-    if (FR.TF)
+    EA_NONE, // Adds 0
+    EA_BX,
+    EA_BP,
+    EA_SI,
+    EA_DI,
+};
+
+/* What a ModR/M byte addresses, worked out once for all 256 of them */
+struct ModRMDescriptor
+{
+    Byte base;         // EA_*
+    Byte index;        // EA_*
+    Byte displacement; // Bytes following the ModR/M byte, 1 is sign extended
+    Byte segment;      // SEG_* without an override prefix
+    Byte cycles;       // Effective address clocks, 0 for a register operand
+};
+
+static constexpr ModRMDescriptor describeModRM(Byte modRM)
+{
+    // [bx+si], [bx+di], [bp+si], [bp+di], [si], [di], [bp], [bx]
+    constexpr Byte bases[8] = {EA_BX, EA_BX, EA_BP, EA_BP, EA_NONE, EA_NONE, EA_BP, EA_BX};
+    constexpr Byte indexes[8] = {EA_SI, EA_DI, EA_SI, EA_DI, EA_SI, EA_DI, EA_NONE, EA_NONE};
+    constexpr Byte baseIndexCycles[8] = {7, 8, 8, 7, 5, 5, 5, 5};
+    Byte mod = modRM >> 6;
+    Byte rm = modRM & 0x07;
+
+    if (mod == 0b11)
+        return {EA_NONE, EA_NONE, 0, SEG_DS, 0}; // Register operand
+    if (mod == 0b00 && rm == 6)
+        return {EA_NONE, EA_NONE, 2, SEG_DS, 6}; // Direct address, where [bp] would be
+
+    Byte segment = bases[rm] == EA_BP ? SEG_SS : SEG_DS;
+    Byte cycles = baseIndexCycles[rm] + (mod == 0b00 ? 0 : 4); // A displacement adds 4
+    return {bases[rm], indexes[rm], mod, segment, cycles};  // mod is also the displacement size
+}
+
+struct ModRMTable
+{
+    ModRMDescriptor entries[256];
+    constexpr ModRMTable() : entries()
     {
-        interrupt(1);
-        cycles -= 50;
+        for (int modRM = 0; modRM < 256; modRM++)
+        {
+            entries[modRM] = describeModRM(modRM);
+        }
     }
+};
+static constexpr ModRMTable modRMTable;
 
-    // TODO Implement Interrupt check once I make a PIC
-
-    handleRepe(); // Will handle REPE and override segments
-    exeOpcode();  // Will fetch and execute one opcode
+static bool isStringOpcode(Byte opcode)
+{
+    return opcode >= 0xa4 && opcode <= 0xaf && opcode != 0xa8 && opcode != 0xa9;
 }
 
-void i8086::setRegister16Value(Byte regIndex, Word value)
+// Clocks for a decoded instruction, charged in one go when it is fetched.
+// What depends on the operands or the outcome (taken jumps, REP elements) is
+// added by the handler.
+template <class Policy>
+Word basic_i8086<Policy>::instructionCycles(const Instruction &insn)
 {
-    switch (regIndex)
+    Byte opcode = insn.opcode;
+    if ((insn.prefixes & PREFIX_REPEAT) && isStringOpcode(opcode))
     {
-    case 0: // AX
-        regs.AX = value;
-        break;
-    case 1: // BX
-        regs.BX = value;
-        break;
-    case 2: // CX
-        regs.CX = value;
-        break;
-    case 3: // DX
-        regs.DX = value;
-        break;
-    default:
-        // Handle invalid register index
-        break;
+        return 9; // Plus repeatCycles per element
     }
-}
 
-u32 i8086::getAddressFromModRM(Byte modRM, Word segment)
-{
-    Byte mod = modRM >> 6; // First two bits
-    Byte rm = modRM & 0x7; // Last three bits
-    u32 address = 0;
+    bool isMemory = opcodeFormat[opcode] != FMT_NONE && opcodeFormat[opcode] != FMT_IMM8 &&
+                    opcodeFormat[opcode] != FMT_IMM16 && opcodeFormat[opcode] != FMT_IMM32 &&
+                    isMemoryOperand(insn.modRM);
+    const Byte *timing;
+    Byte form[2] = {regCycles[opcode], memCycles[opcode]};
 
-    switch (mod)
+    switch (opcode)
     {
-    case 0:               // Register addressing mode
-        address = rm * 2; // Assuming consecutive register indexes
-        break;
-    case 1: // Addressing mode with displacement byte
-        address = fetchByte();
+    case 0x80:
+    case 0x81:
+    case 0x82:
+    case 0x83:
+        timing = group1Cycles[insn.reg];
         break;
-    case 2: // Addressing mode with displacement word
-        address = fetchWord();
+    case 0xf6:
+    case 0xf7:
+        timing = group3Cycles[opcode & 0x01][insn.reg];
         break;
-    case 3: // Register addressing mode
-        // Not applicable for this function
+    case 0xff:
+        timing = group5Cycles[insn.reg];
         break;
     default:
-        // Handle invalid mod
+        timing = form; // Group 4 (0xfe) is inc/dec only, same as its table entry
         break;
     }
 
-    return address;
+    return isMemory ? timing[1] + modRMTable.entries[insn.modRM].cycles : timing[0];
 }
 
-void i8086::handleRepe()
+template <class Policy>
+bool basic_i8086<Policy>::execute()
 {
-    os = &DS; // Default segment register
-    bool hasRepPrefix = false;
-    bool repne = false; // REPNE/REPNZ prefix flag
+    if constexpr (Policy::breakpoints)
+    {
+        if (hitBreakpoint())
+            return false; // Stopped before it, the next call runs it
+    }
 
-    Byte prefix = fetchByte();
-    while (true) // Loop to handle multiple prefixes
+    events.runDue(cycles);
+    if (pendingWork)
     {
-        switch (prefix)
-        {
-        case 0x26:
-            os = &ES;
-            break; // ES segment override
-        case 0x2E:
-            os = &CS;
-            break; // CS segment override
-        case 0x36:
-            os = &SS;
-            break; // SS segment override
-        case 0x3E:
-            os = &DS;
-            break; // DS segment override
-        case 0xF2: // REPNE/REPNZ prefix
-            hasRepPrefix = true;
-            repne = true;
-            break;
-        case 0xF3: // REP or REPE/REPZ prefix
-            hasRepPrefix = true;
-            repne = false;
-            break;
-        default:
-            IP--;                 // Adjust IP to re-read the byte as an opcode
-            goto end_prefix_loop; // Exit the loop
-        }
-        prefix = fetchByte(); // Fetch the next byte to check for additional prefixes
+        serviceWork();
+    }
+    if (halt)
+    {
+        charge(1); // Waiting for an interrupt
+        return false;
     }
-end_prefix_loop:
 
-    if (hasRepPrefix)
+    bool trap = FR.TF; // Traps after the instruction that started with TF set
+    events.sliceEnd = events.nextDeadline(); // A REP stops there, or when the instruction ends the slice
+    executeInstruction();
+    if (trap)
     {
-        executeStringInstruction(repne); // Execute the string instruction with repeat logic
+        interrupt(1);
+        charge(50);
     }
+    return !halt;
 }
-void i8086::executeStringInstruction(bool repne)
-{
-    Byte opcode = fetchByte(); // Fetch the string operation opcode
 
-    // Execute the string operation in a loop
-    while (regs.CX != 0)
+template <class Policy>
+void basic_i8086<Policy>::executeInstruction()
+{
+    const Instruction &insn = fetchInstruction();
+    if (insn.prefixes & PREFIX_REPEAT)
     {
-        switch (opcode)
-        {
-        case 0xA4:
-            movsb(os);
-            break; // MOVSB
-        case 0xA5:
-            movsw(os);
-            break; // MOVSW
-        case 0xAA:
-            stosb(os);
-            break; // STOSB
-        case 0xAB:
-            stosw(os);
-            break; // STOSW
-        case 0xAC:
-            lodsb(os);
-            break; // LODSB
-        case 0xAD:
-            lodsw(os);
-            break; // LODSW
-        case 0xAE:
-            scasb(os);
-            break; // SCASB
-        case 0xAF:
-            scasw(os);
-            break; // SCASW
-        default:
-            // Handle unexpected opcode
-            break;
-        }
-
-        regs.CX--;
-
-        // For REPNE/REPE, also check the Zero Flag condition
-        if (repne && FR.ZF == 1)
-            break; // REPNE and ZF is set, exit loop
-        if (!repne && FR.ZF == 0)
-            break; // REPE and ZF is clear, exit loop
+        executeStringInstruction(insn);
+    }
+    else
+    {
+        (this->*opcodeTable[insn.opcode])(insn);
     }
 }
-void i8086::movsb(Word *segmentOverride)
+
+template <class Policy>
+Word basic_i8086<Policy>::getRegister16Value(Byte regIndex)
 {
-    Word segment = segmentOverride ? *segmentOverride : DS; // Use the override segment or DS by default
-    Byte value = readByte(SI, segment);
-    writeByte(DI, ES, value);    // Always use ES for the destination in string operations
-    SI += (FR.DF == 0) ? 1 : -1; // Update SI based on the direction flag
-    DI += (FR.DF == 0) ? 1 : -1; // Update DI similarly
+    return regs.r16[regIndex];
 }
-void i8086::movsw(Word *segmentOverride)
+
+template <class Policy>
+void basic_i8086<Policy>::setRegister16Value(Byte regIndex, Word value)
 {
-    Word segment = segmentOverride ? *segmentOverride : DS;
-    Word value = readWord(SI, segment);
-    writeWord(DI, ES, value);    // Always use ES for the destination in string operations
-    SI += (FR.DF == 0) ? 2 : -2; // Update SI based on the direction flag
-    DI += (FR.DF == 0) ? 2 : -2; // Update DI similarly
+    regs.r16[regIndex] = value;
 }
-void i8086::stosb(Word *segmentOverride)
+
+// Offset of a memory operand, wrapped to 16 bits; the segment came with the
+// decoded instruction. Only adds up what the descriptor says, no branches.
+template <class Policy>
+u32 basic_i8086<Policy>::getAddressFromModRM(const Instruction &insn)
 {
-    writeByte(DI, ES, regs.AL);  // Store AL at [ES:DI]
-    DI += (FR.DF == 0) ? 1 : -1; // Update DI based on the direction flag
+    const ModRMDescriptor &ea = modRMTable.entries[insn.modRM];
+    const Word registers[5] = {0, regs.BX, regs.BP, regs.SI, regs.DI}; // EA_* order
+    return (Word)(registers[ea.base] + registers[ea.index] + insn.displacement);
 }
-void i8086::stosw(Word *segmentOverride)
+
+template <class Policy>
+Word basic_i8086<Policy>::readOperand(const Instruction &insn, bool isWord, u32 address)
 {
-    writeWord(DI, ES, regs.AX);  // Store AX at [ES:DI]
-    DI += (FR.DF == 0) ? 2 : -2; // Update DI based on the direction flag
+    if (insn.mod == 0b11) // Register operand
+    {
+        return isWord ? getRegister16Value(insn.rm) : getRegister8Value(insn.rm);
+    }
+    return isWord ? readWord(address, *os) : readByte(address, *os);
 }
-void i8086::lodsb(Word *segmentOverride)
+
+template <class Policy>
+void basic_i8086<Policy>::writeOperand(const Instruction &insn, bool isWord, u32 address, Word value)
 {
-    Word segment = segmentOverride ? *segmentOverride : DS;
-    regs.AL = readByte(SI, segment); // Load byte at [DS:SI] into AL
-    SI += (FR.DF == 0) ? 1 : -1;     // Update SI based on the direction flag
+    if (insn.mod == 0b11) // Register operand
+    {
+        if (isWord)
+            setRegister16Value(insn.rm, value);
+        else
+            setRegister8Value(insn.rm, value);
+    }
+    else
+    {
+        if (isWord)
+            writeWord(address, *os, value);
+        else
+            writeByte(address, *os, value);
+    }
 }
-void i8086::lodsw(Word *segmentOverride)
+
+template <class Policy>
+void basic_i8086<Policy>::flushDecodeCache()
 {
-    Word segment = segmentOverride ? *segmentOverride : DS;
-    regs.AX = readWord(SI, segment); // Load word at [DS:SI] into AX
-    SI += (FR.DF == 0) ? 2 : -2;     // Update SI based on the direction flag
+    for (u32 i = 0; i < DECODE_CACHE_SIZE; i++)
+    {
+        decodeCache[i].address = 0xFFFFFFFF; // Never matches a physical address
+    }
+    for (u32 page = 0; page < MAP_PAGES; page++)
+    {
+        pageGeneration[page] = 0;
+        if (memMap.flags[page] & PAGE_CODE)
+        {
+            memMap.flags[page] &= ~PAGE_CODE;
+            memMap.untrapWrites(page);
+        }
+    }
+    if (jit)
+    {
+        jit->flush(); // Translated blocks are tagged with the generations just reset
+    }
 }
-void i8086::scasb(Word *segmentOverride)
-{
-    Byte value = readByte(DI, ES); // Always use ES for destination in SCAS operations
-    Byte result = regs.AL - value; // Perform subtraction to compare
 
-    FR.ZF = (result == 0) ? 1 : 0; // Set ZF if result is zero (values are equal)
-
-    DI += (FR.DF == 0) ? 1 : -1; // Update DI based on the direction flag
-}
-void i8086::scasw(Word *segmentOverride)
+template <class Policy>
+void basic_i8086<Policy>::markCode(u32 page)
 {
-    Word value = readWord(DI, ES); // Always use ES for destination in SCAS operations
-    Word result = regs.AX - value; // Perform subtraction to compare
-
-    // Update flags based on the result
-    FR.ZF = (result == 0) ? 1 : 0; // Set ZF if result is zero (values are equal)
+    // Only RAM can change under the decode cache, and only through writes we trap
+    if ((memMap.flags[page] & (PAGE_RAM | PAGE_CODE)) == PAGE_RAM)
+    {
+        memMap.flags[page] |= PAGE_CODE;
+        memMap.trapWrites(page);
+    }
+}
 
-    DI += (FR.DF == 0) ? 2 : -2; // Update DI based on the direction flag
+template <class Policy>
+void basic_i8086<Policy>::invalidateCode(u32 physicalAddress)
+{
+    // Entries in the page no longer match their generation and get decoded again
+    u32 page = physicalAddress >> PAGE_SHIFT;
+    pageGeneration[page]++;
+    memMap.flags[page] &= ~PAGE_CODE;
+    memMap.untrapWrites(page);
 }
 
-void i8086::exeOpcode()
+template <class Policy>
+void basic_i8086<Policy>::decodeInstruction(Instruction &insn, Word start)
 {
-    Byte opcode = fetchByte(); // Fetch the opcode
+    Word ip = start;
 
-    switch (opcode)
+    insn.prefixes = 0;
+    insn.segment = SEG_DS;
+    insn.displacement = 0;
+
+    Word prefixCycles = 0;
+    Byte opcode = readPhysical(getPhysicalAddress(ip++, CS));
+    while (true) // Loop to handle multiple prefixes
     {
-    case 0x88: // mov reg8/mem8,reg8
-    case 0x89: // mov reg16/mem16,reg16
-    case 0x8a: // mov reg8,reg8/mem8
-    case 0x8b: // mov reg16,reg16/mem16
-    {          // Decode the instruction
-        Byte modRM = fetchByte();
+        switch (opcode)
+        {
+        case 0x26:
+            insn.segment = SEG_ES;
+            insn.prefixes |= PREFIX_SEGMENT;
+            break; // ES segment override
+        case 0x2E:
+            insn.segment = SEG_CS;
+            insn.prefixes |= PREFIX_SEGMENT;
+            break; // CS segment override
+        case 0x36:
+            insn.segment = SEG_SS;
+            insn.prefixes |= PREFIX_SEGMENT;
+            break; // SS segment override
+        case 0x3E:
+            insn.segment = SEG_DS;
+            insn.prefixes |= PREFIX_SEGMENT;
+            break; // DS segment override
+        case 0xF0:
+        case 0xF1:
+            insn.prefixes |= PREFIX_LOCK;
+            break; // LOCK
+        case 0xF2: // REPNE/REPNZ prefix
+            insn.prefixes = (insn.prefixes & ~PREFIX_REP) | PREFIX_REPNE;
+            break;
+        case 0xF3: // REP or REPE/REPZ prefix
+            insn.prefixes = (insn.prefixes & ~PREFIX_REPNE) | PREFIX_REP;
+            break;
+        default:
+            goto end_prefix_loop; // Exit the loop
+        }
+        prefixCycles += regCycles[opcode];
+        opcode = readPhysical(getPhysicalAddress(ip++, CS)); // Fetch the next byte to check for additional prefixes
+    }
+end_prefix_loop:
 
-        Byte mod = modRM >> 6;         // First two bits
-        Byte reg = (modRM >> 3) & 0x7; // Middle three bits
-        Byte rm = modRM & 0x7;         // Last three bits
+    insn.opcode = opcode;
+    Byte format = opcodeFormat[opcode];
 
-        Word operand;
-        Word result;
+    if (format == FMT_MODRM || format == FMT_MODRM_IMM8 || format == FMT_MODRM_IMM16 ||
+        format == FMT_GRP3_8 || format == FMT_GRP3_16)
+    {
+        insn.modRM = readPhysical(getPhysicalAddress(ip++, CS));
+        insn.mod = insn.modRM >> 6;         // First two bits
+        insn.reg = (insn.modRM >> 3) & 0x7; // Middle three bits
+        insn.rm = insn.modRM & 0x7;         // Last three bits
 
-        if (mod == 0b11) // Register to Register
+        const ModRMDescriptor &ea = modRMTable.entries[insn.modRM];
+        if (ea.displacement == 1) // Sign extended byte
         {
-            if ((opcode == 0x88 || opcode == 0x8a) && (reg == 0b000 || reg == 0b001)) // mov reg8, reg8/mem8
-            {
-                operand = getRegister8Value(rm);
-                setRegister8Value(reg, operand);
-            }
-            else // mov reg16, reg16/mem16
-            {
-                operand = regs.AX + (reg * 2); // Assuming consecutive registers in memory
-                result = readWord(operand, DS);
-                setRegister16Value(reg, operand);
-            }
+            insn.displacement = (signed char)readPhysical(getPhysicalAddress(ip++, CS));
         }
-        else // Memory to/from Register
+        else if (ea.displacement == 2) // Word, or the direct address
         {
-            u32 address = getAddressFromModRM(modRM, DS);                             // Assuming DS segment
-            if ((opcode == 0x88 || opcode == 0x8a) && (reg == 0b000 || reg == 0b001)) // mov reg8/mem8, reg8
-            {
-                operand = readByte(address, DS);
-                setRegister8Value(reg, operand);
-            }
-            else // mov reg16/mem16, reg16
-            {
-                operand = readWord(address, DS);
-                setRegister16Value(reg, operand);
-            }
+            insn.displacement = readPhysical(getPhysicalAddress(ip++, CS));
+            insn.displacement |= readPhysical(getPhysicalAddress(ip++, CS)) << 8;
         }
+        if (!(insn.prefixes & PREFIX_SEGMENT))
+        {
+            insn.segment = ea.segment; // SS for anything based on BP
+        }
+    }
 
-        // Update cycle count
-        cycles += mod == 0b11 ? 2 : 9; // Assuming direct register addressing
+    // TEST is the only group 3 instruction with an immediate
+    if ((format == FMT_GRP3_8 || format == FMT_GRP3_16) && insn.reg < 2)
+    {
+        format = format == FMT_GRP3_8 ? FMT_IMM8 : FMT_IMM16;
+    }
+
+    switch (format)
+    {
+    case FMT_IMM8:
+    case FMT_MODRM_IMM8:
+        insn.immediate = readPhysical(getPhysicalAddress(ip++, CS));
+        break;
+    case FMT_IMM16:
+    case FMT_MODRM_IMM16:
+        insn.immediate = readPhysical(getPhysicalAddress(ip++, CS));
+        insn.immediate |= readPhysical(getPhysicalAddress(ip++, CS)) << 8;
+        break;
+    case FMT_IMM32:
+        insn.immediate = readPhysical(getPhysicalAddress(ip++, CS));
+        insn.immediate |= readPhysical(getPhysicalAddress(ip++, CS)) << 8;
+        insn.immediate2 = readPhysical(getPhysicalAddress(ip++, CS));
+        insn.immediate2 |= readPhysical(getPhysicalAddress(ip++, CS)) << 8;
+        break;
+    default:
         break;
     }
 
-    case 0xc6: // mov reg8/mem8,immed8
-    case 0xc7: // mov reg16/mem16,immed16
+    insn.length = (Word)(ip - start);
+    if constexpr (Policy::cycles)
+        insn.cycles = prefixCycles + instructionCycles(insn);
+    else
+        insn.cycles = 1; // Counts instructions instead
+}
+
+template <class Policy>
+Instruction &basic_i8086<Policy>::cacheInstruction(Instruction &slot, u32 physicalAddress)
+{
+    decodeInstruction(slot, IP);
+
+    // Only cache what lies in one page and doesn't wrap around the segment,
+    // so a write to that one page is enough to invalidate it
+    // Device pages can change without a write, so those are never cached either
+    u32 page = physicalAddress >> PAGE_SHIFT;
+    u32 last = physicalAddress + slot.length - 1;
+    if ((last >> PAGE_SHIFT) == page && (u32)IP + slot.length <= 0x10000 && !(memMap.flags[page] & PAGE_DEVICE))
     {
-        // Decode the instruction
-        Byte modRM = fetchByte();
-        Byte mod = modRM >> 6;         // First two bits
-        Byte reg = (modRM >> 3) & 0x7; // Middle three bits
-        Byte rm = modRM & 0x7;         // Last three bits
+        slot.address = physicalAddress;
+        slot.generation = pageGeneration[page];
+        markCode(page);
+        return slot;
+    }
 
-        Word address = 0;
-        Byte immByte = 0;
-        Word immWord = 0;
+    uncachedInstruction = slot;
+    slot.address = 0xFFFFFFFF;
+    return uncachedInstruction;
+}
 
-        // Determine the size of the immediate value based on the opcode
-        bool isImmediate16 = (opcode == 0xc7);
+template <class Policy>
+const Instruction &basic_i8086<Policy>::fetchInstruction()
+{
+    static Word basic_i8086::*const segmentRegisters[4] = {&basic_i8086::ES, &basic_i8086::CS, &basic_i8086::SS, &basic_i8086::DS};
+
+    u32 physicalAddress = getPhysicalAddress(IP, CS);
+    u32 page = physicalAddress >> PAGE_SHIFT;
+    Instruction *insn = &decodeCache[physicalAddress & (DECODE_CACHE_SIZE - 1)];
+
+    // The same bytes reached through another segment can run off the end of
+    // this one, where IP wraps and the instruction reads on from CS:0000
+    if (insn->address != physicalAddress || insn->generation != pageGeneration[page] ||
+        (u32)IP + insn->length > 0x10000)
+    {
+        insn = &cacheInstruction(*insn, physicalAddress); // Miss, decode from memory
+    }
+
+    if constexpr (Policy::trace)
+    {
+        if (traceHook)
+            traceHook(*insn);
+        if (recorder)
+            recordStep(*insn, physicalAddress);
+    }
 
-        if (isImmediate16) // Immediate 16-bit value
+    IP += insn->length;
+    cycles += insn->cycles; // The whole instruction, see instructionCycles(), or 1 without Policy::cycles
+    os = &(this->*segmentRegisters[insn->segment]);
+    return *insn;
+}
+
+template <class Policy>
+void basic_i8086<Policy>::recordStep(const Instruction &insn, u32 physicalAddress)
+{
+    Word registers[TRACE_REGISTERS] = {regs.AX, regs.BX, regs.CX, regs.DX, regs.SI, regs.DI, regs.BP,
+                                       regs.SP, CS,      DS,      ES,      SS,      IP,      getFlags()};
+    Byte code[TRACE_MAX_CODE];
+    u32 length = insn.length < TRACE_MAX_CODE ? insn.length : TRACE_MAX_CODE;
+    const Byte *host = memMap.readPage[physicalAddress >> PAGE_SHIFT];
+    if (host && (physicalAddress & PAGE_MASK) + length <= PAGE_SIZE)
+    {
+        memcpy(code, host + (physicalAddress & PAGE_MASK), length);
+    }
+    else
+    {
+        for (u32 i = 0; i < length; i++) // Straddles a page, or runs from a device
         {
-            immWord = fetchWord();
+            code[i] = readPhysical(getPhysicalAddress(IP + i, CS));
         }
-        else // Immediate 8-bit value
+    }
+    recorder->step(registers, code, length);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::executeStringInstruction(const Instruction &insn)
+{
+    Byte opcode = insn.opcode;
+
+    if (!isStringOpcode(opcode))
+    {
+        (this->*opcodeTable[opcode])(insn); // REP on anything else runs it once
+        return;
+    }
+
+    // Only CMPS and SCAS look at ZF, MOVS/STOS/LODS just count CX down
+    bool checksZero = (opcode & 0xF6) == 0xA6;
+    bool repne = insn.prefixes & PREFIX_REPNE;
+    Word start = IP - insn.length;
+
+    // Runs inside contiguous host memory go through the bulk kernels, anything
+    // else (page or segment boundaries, trapped pages, devices) one at a time.
+    // Either way it stops at the end of the slice like between instructions:
+    // an IRQ or a device deadline ends the slice, and IP goes back to the
+    // prefix so the rest runs after it with CX, SI and DI where they got to.
+    while (regs.CX != 0)
+    {
+        u32 limit = regs.CX < REP_CHUNK ? regs.CX : REP_CHUNK;
+        if constexpr (Policy::cycles)
         {
-            immByte = fetchByte();
+            u64 left = cycles < events.sliceEnd ? events.sliceEnd - cycles : 0;
+            u64 elements = left / repeatCycles[opcode - 0xa4] + 1; // At least one, so it always gets somewhere
+            limit = elements < limit ? (u32)elements : limit;
         }
 
-        if (mod == 0b11) // Register addressing mode
+        bool stop = false;
+        Word done = bulkString(opcode, repne, limit, stop);
+        if (done)
         {
-            if (isImmediate16)
-            {
-                setRegister16Value(reg, immWord);
-            }
-            else
+            regs.CX -= done;
+            if (stop)
+                break;
+        }
+        else
+        {
+            (this->*opcodeTable[opcode])(insn);
+            charge(repeatCycles[opcode - 0xa4]);
+
+            regs.CX--;
+
+            if (checksZero)
             {
-                setRegister8Value(reg, immByte);
+                // For REPNE/REPE, also check the Zero Flag condition
+                bool zero = getZF();
+                if (repne && zero)
+                    break; // REPNE and ZF is set, exit loop
+                if (!repne && !zero)
+                    break; // REPE and ZF is clear, exit loop
             }
         }
-        else // Memory addressing mode
+
+        if (regs.CX != 0 && cycles >= events.sliceEnd)
         {
-            // Get the memory address
-            address = getAddressFromModRM(modRM, DS); // Assuming DS segment
+            IP = start;
+            return;
+        }
+    }
+}
+
+/* Elements of the given size from offset:physicalAddress onward that stay inside one page and don't wrap the segment */
+static u32 contiguousElements(u32 physicalAddress, Word offset, u32 size, bool backward)
+{
+    u32 inPage = physicalAddress & PAGE_MASK;
+    if (inPage + size > PAGE_SIZE || (u32)offset + size > 0x10000)
+    {
+        return 0; // The first element straddles
+    }
+    if (backward)
+    {
+        return (inPage < offset ? inPage : offset) / size + 1;
+    }
+    u32 bytes = PAGE_SIZE - inPage;
+    if (0x10000 - (u32)offset < bytes)
+    {
+        bytes = 0x10000 - offset;
+    }
+    return bytes / size;
+}
+
+// Runs as many elements of a REP string instruction as sit in host memory, up
+// to limit, in one go. Returns the number done (0 if the next one has to be done the slow
+// way) and sets stop when a CMPS/SCAS hit its ZF condition. Registers, flags
+// and cycles come out the same as running the elements one by one.
+template <class Policy>
+Word basic_i8086<Policy>::bulkString(Byte opcode, bool repne, u32 limit, bool &stop)
+{
+    bool isWord = opcode & 0x01;
+    u32 size = isWord ? 2 : 1;
+    bool backward = FR.DF;
+    bool usesSource = opcode != 0xaa && opcode != 0xab && opcode != 0xae && opcode != 0xaf; // all but STOS/SCAS
+    bool usesDestination = opcode != 0xac && opcode != 0xad;                                // all but LODS
+    bool writesDestination = opcode == 0xa4 || opcode == 0xa5 || opcode == 0xaa || opcode == 0xab;
+
+    if constexpr (Policy::trace)
+    {
+        if (recorder)
+            return 0; // Element by element, so every write is recorded
+    }
+
+    u32 count = limit;
+    const Byte *source = nullptr;
+    Byte *destination = nullptr;
 
-            // Write the immediate value to memory
-            if (isImmediate16)
+    if (usesSource)
+    {
+        u32 physicalAddress = getPhysicalAddress(regs.SI, *os);
+        source = memMap.readPage[physicalAddress >> PAGE_SHIFT];
+        if (!source || (memMap.flags[physicalAddress >> PAGE_SHIFT] & PAGE_DEVICE))
+            return 0;
+        source += physicalAddress & PAGE_MASK;
+        u32 elements = contiguousElements(physicalAddress, regs.SI, size, backward);
+        count = elements < count ? elements : count;
+    }
+    if (usesDestination)
+    {
+        u32 physicalAddress = getPhysicalAddress(regs.DI, ES);
+        u32 page = physicalAddress >> PAGE_SHIFT;
+        destination = writesDestination ? memMap.writePage[page] : memMap.readPage[page];
+        if (!destination || (memMap.flags[page] & PAGE_DEVICE))
+            return 0;
+        destination += physicalAddress & PAGE_MASK;
+        u32 elements = contiguousElements(physicalAddress, regs.DI, size, backward);
+        count = elements < count ? elements : count;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    int step = backward ? -(int)size : (int)size;
+    u32 bytes = count * size;
+    u32 last = (count - 1) * size;
+    u32 done = count;
+
+    switch (opcode)
+    {
+    case 0xa4: // movsb
+    case 0xa5: // movsw
+    {
+        const Byte *sourceLow = backward ? source - last : source;
+        Byte *destinationLow = backward ? destination - last : destination;
+        uintptr_t from = (uintptr_t)sourceLow, to = (uintptr_t)destinationLow;
+        if (to + bytes <= from || from + bytes <= to)
+        {
+            memcpy(destinationLow, sourceLow, bytes);
+        }
+        else
+        {
+            // Overlapping, element by element in guest order so fills like
+            // movsb with DI = SI + 1 replicate the way they do on the chip
+            for (u32 i = 0; i < count; i++)
             {
-                writeWord(address, DS, immWord);
+                if (isWord)
+                    storeWord(destination + (int)i * step, loadWord(source + (int)i * step));
+                else
+                    destination[(int)i * step] = source[(int)i * step];
             }
-            else
+        }
+        charge(count * repeatCycles[opcode - 0xa4]);
+        break;
+    }
+
+    case 0xaa: // stosb
+    case 0xab: // stosw
+    {
+        Byte *destinationLow = backward ? destination - last : destination;
+        if (isWord)
+        {
+            // memset() only takes a byte, so the AX pattern doubles itself with memcpy()
+            storeWord(destinationLow, regs.AX);
+            for (u32 filled = 2; filled < bytes;)
             {
-                writeByte(address, DS, immByte);
+                u32 length = filled < bytes - filled ? filled : bytes - filled;
+                memcpy(destinationLow + filled, destinationLow, length);
+                filled += length;
             }
         }
-
-        // Update cycle count
-        cycles += isImmediate16 ? 4 : 10; // Assuming immediate values
+        else
+        {
+            memset(destinationLow, regs.AL, count);
+        }
+        charge(count * repeatCycles[opcode - 0xa4]);
         break;
     }
 
-    case 0xb0: // mov al,immed8
-    case 0xb1: // mov cl,immed8
-    case 0xb2: // mov dl,immed8
-    case 0xb3: // mov bl,immed8
-    case 0xb4: // mov ah,immed8
-    case 0xb5: // mov ch,immed8
-    case 0xb6: // mov dh,immed8
-    case 0xb7: // mov bh,immed8
+    case 0xac: // lodsb
+    case 0xad: // lodsw, only the last element is left in the accumulator
     {
-        // Decode the instruction
-        Byte regIndex = opcode - 0xb0; // Calculate the register index
-        Byte immByte = fetchByte();    // Fetch the immediate byte value
+        const Byte *element = backward ? source - last : source + last;
+        if (isWord)
+            regs.AX = loadWord(element);
+        else
+            regs.AL = *element;
+        charge(count * repeatCycles[opcode - 0xa4]);
+        break;
+    }
 
-        // Set the immediate byte value into the appropriate register
-        setRegister8Value(regIndex, immByte);
+    case 0xae: // scasb
+    case 0xaf: // scasw
+    {
+        u32 hit = scanElements(destination, count, isWord, backward, isWord ? regs.AX : regs.AL, repne);
+        stop = hit < count;
+        done = stop ? hit + 1 : count;
 
-        // Update cycle count
-        cycles += 4; // Assuming immediate value
+        const Byte *element = destination + (int)(done - 1) * step;
+        alu(7, isWord, isWord ? regs.AX : regs.AL, isWord ? loadWord(element) : *element);
+        charge(done * repeatCycles[opcode - 0xa4]);
         break;
     }
-    case 0xb8: // mov ax,immed16
-    case 0xb9: // mov cx,immed16
-    case 0xba: // mov dx,immed16
-    case 0xbb: // mov bx,immed16
-    case 0xbc: // mov sp,immed16
-    case 0xbd: // mov bp,immed16
-    case 0xbe: // mov si,immed16
-    case 0xbf: // mov di,immed16
+
+    case 0xa6: // cmpsb
+    case 0xa7: // cmpsw
     {
-        // Decode the instruction
-        Byte regIndex = opcode - 0xb8; // Calculate the register index
-        Word immWord = fetchWord();    // Fetch the immediate word value
+        u32 hit = compareElements(source, destination, count, isWord, backward, repne);
+        stop = hit < count;
+        done = stop ? hit + 1 : count;
+
+        int offset = (int)(done - 1) * step;
+        alu(7, isWord, isWord ? loadWord(source + offset) : source[offset],
+            isWord ? loadWord(destination + offset) : destination[offset]);
+        charge(done * repeatCycles[opcode - 0xa4]);
+        break;
+    }
+
+    default:
+        return 0;
+    }
 
-        // Set the immediate word value into the appropriate register
-        setRegister16Value(regIndex, immWord);
+    if (usesSource)
+        regs.SI += done * step;
+    if (usesDestination)
+        regs.DI += done * step;
+    return done;
+}
 
-        // Update cycle count
-        cycles += 4; // Assuming immediate value
-        break;
+template <class Policy>
+void basic_i8086<Policy>::movsb(Word *segmentOverride)
+{
+    Word segment = segmentOverride ? *segmentOverride : DS; // Use the override segment or DS by default
+    Byte value = readByte(regs.SI, segment);
+    writeByte(regs.DI, ES, value);    // Always use ES for the destination in string operations
+    regs.SI += (FR.DF == 0) ? 1 : -1; // Update SI based on the direction flag
+    regs.DI += (FR.DF == 0) ? 1 : -1; // Update DI similarly
+}
+template <class Policy>
+void basic_i8086<Policy>::movsw(Word *segmentOverride)
+{
+    Word segment = segmentOverride ? *segmentOverride : DS;
+    Word value = readWord(regs.SI, segment);
+    writeWord(regs.DI, ES, value);    // Always use ES for the destination in string operations
+    regs.SI += (FR.DF == 0) ? 2 : -2; // Update SI based on the direction flag
+    regs.DI += (FR.DF == 0) ? 2 : -2; // Update DI similarly
+}
+template <class Policy>
+void basic_i8086<Policy>::stosb(Word *segmentOverride)
+{
+    writeByte(regs.DI, ES, regs.AL);  // Store AL at [ES:DI]
+    regs.DI += (FR.DF == 0) ? 1 : -1; // Update DI based on the direction flag
+}
+template <class Policy>
+void basic_i8086<Policy>::stosw(Word *segmentOverride)
+{
+    writeWord(regs.DI, ES, regs.AX);  // Store AX at [ES:DI]
+    regs.DI += (FR.DF == 0) ? 2 : -2; // Update DI based on the direction flag
+}
+template <class Policy>
+void basic_i8086<Policy>::lodsb(Word *segmentOverride)
+{
+    Word segment = segmentOverride ? *segmentOverride : DS;
+    regs.AL = readByte(regs.SI, segment); // Load byte at [DS:SI] into AL
+    regs.SI += (FR.DF == 0) ? 1 : -1;     // Update SI based on the direction flag
+}
+template <class Policy>
+void basic_i8086<Policy>::lodsw(Word *segmentOverride)
+{
+    Word segment = segmentOverride ? *segmentOverride : DS;
+    regs.AX = readWord(regs.SI, segment); // Load word at [DS:SI] into AX
+    regs.SI += (FR.DF == 0) ? 2 : -2;     // Update SI based on the direction flag
+}
+template <class Policy>
+void basic_i8086<Policy>::scasb(Word *segmentOverride)
+{
+    Byte value = readByte(regs.DI, ES); // Always use ES for destination in SCAS operations
+    alu(7, false, regs.AL, value); // Compare, only the flags are kept
+
+    regs.DI += (FR.DF == 0) ? 1 : -1; // Update DI based on the direction flag
+}
+template <class Policy>
+void basic_i8086<Policy>::scasw(Word *segmentOverride)
+{
+    Word value = readWord(regs.DI, ES); // Always use ES for destination in SCAS operations
+    alu(7, true, regs.AX, value);  // Compare, only the flags are kept
+
+    regs.DI += (FR.DF == 0) ? 2 : -2; // Update DI based on the direction flag
+}
+template <class Policy>
+void basic_i8086<Policy>::cmpsb(Word *segmentOverride)
+{
+    Word segment = segmentOverride ? *segmentOverride : DS;
+    Byte source = readByte(regs.SI, segment);
+    Byte destination = readByte(regs.DI, ES);
+    alu(7, false, source, destination); // [DS:SI] - [ES:DI], flags only
+
+    regs.SI += (FR.DF == 0) ? 1 : -1;
+    regs.DI += (FR.DF == 0) ? 1 : -1;
+}
+template <class Policy>
+void basic_i8086<Policy>::cmpsw(Word *segmentOverride)
+{
+    Word segment = segmentOverride ? *segmentOverride : DS;
+    Word source = readWord(regs.SI, segment);
+    Word destination = readWord(regs.DI, ES);
+    alu(7, true, source, destination); // [DS:SI] - [ES:DI], flags only
+
+    regs.SI += (FR.DF == 0) ? 2 : -2;
+    regs.DI += (FR.DF == 0) ? 2 : -2;
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opUnimplemented(const Instruction &insn)
+{
+    // Handle unknown opcodes
+    if constexpr (Policy::checks)
+    {
+        fprintf(stderr, "Warning: Unimplemented opcode %02x at %04x:%04x\n", insn.opcode, CS, (Word)(IP - insn.length));
     }
+}
 
-    case 0xa0: // mov al,mem8
+template <class Policy>
+void basic_i8086<Policy>::opAluRM(const Instruction &insn) // add/or/adc/sbb/and/sub/xor/cmp rm,reg / reg,rm
+{
+    Byte operation = insn.opcode >> 3;
+    bool toReg = insn.opcode & 0x02;  // d bit, reg is the destination
+    bool isWord = insn.opcode & 0x01; // w bit
+    bool isMemory = isMemoryOperand(insn.modRM);
+
+    u32 address = isMemory ? getAddressFromModRM(insn) : 0;
+    Word rmValue = readOperand(insn, isWord, address);
+    Word regValue = isWord ? getRegister16Value(insn.reg) : getRegister8Value(insn.reg);
+
+    if (toReg)
+    {
+        Word result = alu(operation, isWord, regValue, rmValue);
+        if (operation != 7) // CMP only sets flags
+        {
+            if (isWord)
+                setRegister16Value(insn.reg, result);
+            else
+                setRegister8Value(insn.reg, result);
+        }
+    }
+    else
     {
-        // Fetch the immediate address from the instruction
-        Word address = fetchWord();
+        Word result = alu(operation, isWord, rmValue, regValue);
+        if (operation != 7)
+        {
+            writeOperand(insn, isWord, address, result);
+        }
+    }
+}
 
-        // Read the byte from memory at the specified address and store it in AL
-        regs.AL = readByte(address, DS);
+template <class Policy>
+void basic_i8086<Policy>::opAluAccImm(const Instruction &insn) // add/or/adc/sbb/and/sub/xor/cmp al,immed8 / ax,immed16
+{
+    Byte operation = insn.opcode >> 3;
+    bool isWord = insn.opcode & 0x01;
 
-        // Update cycle count
-        cycles += 10; // Assuming memory access
-        break;
+    if (isWord)
+    {
+        Word result = alu(operation, true, regs.AX, insn.immediate);
+        if (operation != 7)
+            regs.AX = result;
     }
-    case 0xa1: // mov ax,mem16
+    else
     {
-        // Fetch the immediate address from the instruction
-        Word address = fetchWord();
+        Word result = alu(operation, false, regs.AL, insn.immediate & 0xFF);
+        if (operation != 7)
+            regs.AL = result;
+    }
+}
 
-        // Read the word from memory at the specified address and store it in AX
-        regs.AX = readWord(address, DS);
+template <class Policy>
+void basic_i8086<Policy>::opGroup1(const Instruction &insn) // 0x80-0x83 alu rm,immed
+{
+    bool isWord = insn.opcode & 0x01;
+    bool isMemory = isMemoryOperand(insn.modRM);
 
-        // Update cycle count
-        cycles += 10; // Assuming memory access
-        break;
+    Word immediate = insn.immediate;
+    if (insn.opcode == 0x83)
+    {
+        immediate = (signed char)immediate; // Sign extended byte
     }
-    case 0xa2: // mov mem8,al
+    else if (!isWord)
     {
-        // Fetch the immediate address from the instruction
-        Word address = fetchWord();
+        immediate &= 0xFF;
+    }
+
+    u32 address = isMemory ? getAddressFromModRM(insn) : 0;
+    Word result = alu(insn.reg, isWord, readOperand(insn, isWord, address), immediate);
+    if (insn.reg != 7) // CMP only sets flags
+    {
+        writeOperand(insn, isWord, address, result);
+    }
+}
 
-        // Write the byte stored in AL to memory at the specified address
-        writeByte(address, DS, regs.AL);
+template <class Policy>
+void basic_i8086<Policy>::opTestRM(const Instruction &insn) // 0x84/0x85 test rm,reg
+{
+    bool isWord = insn.opcode & 0x01;
+    bool isMemory = isMemoryOperand(insn.modRM);
+
+    u32 address = isMemory ? getAddressFromModRM(insn) : 0;
+    Word regValue = isWord ? getRegister16Value(insn.reg) : getRegister8Value(insn.reg);
+    alu(4, isWord, readOperand(insn, isWord, address), regValue); // AND, flags only
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opTestAccImm(const Instruction &insn) // 0xa8 test al,immed8 / 0xa9 test ax,immed16
+{
+    if (insn.opcode & 0x01)
+        alu(4, true, regs.AX, insn.immediate);
+    else
+        alu(4, false, regs.AL, insn.immediate & 0xFF);
+}
 
-        // Update cycle count
-        cycles += 10; // Assuming memory access
+template <class Policy>
+void basic_i8086<Policy>::opIncReg16(const Instruction &insn) // 0x40-0x47 inc reg16
+{
+    Byte reg = insn.opcode & 0x7;
+    Word value = getRegister16Value(reg);
+
+    lazyFlags.carryIn = getCF(); // INC leaves CF alone
+    setLazyFlags(FLAGOP_INC, true, value, 1, (u32)value + 1);
+    setRegister16Value(reg, value + 1);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opDecReg16(const Instruction &insn) // 0x48-0x4f dec reg16
+{
+    Byte reg = insn.opcode & 0x7;
+    Word value = getRegister16Value(reg);
+
+    lazyFlags.carryIn = getCF(); // DEC leaves CF alone
+    setLazyFlags(FLAGOP_DEC, true, value, 1, (u32)value - 1);
+    setRegister16Value(reg, value - 1);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opJcc(const Instruction &insn) // 0x70-0x7f jcc short, 0x60-0x6f are aliases on the 8086
+{
+    bool condition;
+    switch ((insn.opcode >> 1) & 0x7)
+    {
+    case 0: // JO
+        condition = getOF();
+        break;
+    case 1: // JB/JC
+        condition = getCF();
+        break;
+    case 2: // JZ/JE
+        condition = getZF();
+        break;
+    case 3: // JBE
+        condition = getCF() || getZF();
+        break;
+    case 4: // JS
+        condition = getSF();
+        break;
+    case 5: // JP
+        condition = getPF();
+        break;
+    case 6: // JL
+        condition = getSF() != getOF();
+        break;
+    case 7: // JLE
+    default:
+        condition = getZF() || getSF() != getOF();
         break;
     }
-    case 0xa3: // mov mem16,ax
+
+    if (insn.opcode & 0x01) // Odd opcodes test the opposite
     {
-        // Fetch the immediate address from the instruction
-        Word address = fetchWord();
+        condition = !condition;
+    }
 
-        // Write the word stored in AX to memory at the specified address
-        writeWord(address, DS, regs.AX);
+    if (condition)
+    {
+        IP += (signed char)insn.immediate;
+        charge(12); // Taken, on top of the not-taken time
+    }
+}
 
-        // Update cycle count
-        cycles += 10; // Assuming memory access
-        break;
+template <class Policy>
+void basic_i8086<Policy>::opPushf(const Instruction &insn) // 0x9c pushf
+{
+    pushWord(getFlags());
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opPopf(const Instruction &insn) // 0x9d popf
+{
+    setFlags(popWord());
+    if (FR.TF)
+    {
+        endSlice(); // Single stepping starts, start() has to take over
     }
+    interruptsEnabled();
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opCallNear(const Instruction &insn) // 0xe8 call near
+{
+    pushWord(IP);
+    IP += insn.immediate;
+    if (profiler)
+        profiler->enter(PROFILE_CALL, CS, IP, regs.SP);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opCallFar(const Instruction &insn) // 0x9a call far
+{
+    pushWord(CS);
+    pushWord(IP);
+    CS = insn.immediate2;
+    IP = insn.immediate;
+    if (profiler)
+        profiler->enter(PROFILE_CALL, CS, IP, regs.SP);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opRet(const Instruction &insn) // 0xc2/0xc3 ret (immed16), 0xc0/0xc1 the same
+{
+    if (profiler)
+        profiler->leave(regs.SP);
+    IP = popWord();
+    if (!(insn.opcode & 0x01)) // Even opcodes drop the arguments too
+        regs.SP += insn.immediate;
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opRetf(const Instruction &insn) // 0xca/0xcb retf (immed16), 0xc8/0xc9 the same
+{
+    if (profiler)
+        profiler->leave(regs.SP);
+    IP = popWord();
+    CS = popWord();
+    if (!(insn.opcode & 0x01))
+        regs.SP += insn.immediate;
+}
 
-    case 0x8c: // mov reg16/mem16,segreg
+template <class Policy>
+void basic_i8086<Policy>::opInt(const Instruction &insn) // 0xcc int 3 / 0xcd int immed8 / 0xce into
+{
+    if (insn.opcode == 0xce)
+    {
+        if (!getOF())
+            return;
+        charge(49); // Taken
+    }
+    Byte vector = insn.opcode == 0xcc ? 3 : insn.opcode == 0xce ? 4 : insn.immediate & 0xFF;
+    if (interruptHooks[vector].hook && interruptHooks[vector].hook(interruptHooks[vector].context, vector))
     {
-        // Decode the instruction
-        Byte modRM = fetchByte();
+        return; // Done on the host, like an INT that returned straight away
+    }
+    interrupt(vector);
+}
 
-        Byte mod = modRM >> 6;         // First two bits
-        Byte reg = (modRM >> 3) & 0x7; // Middle three bits
-        Byte rm = modRM & 0x7;         // Last three bits
+template <class Policy>
+void basic_i8086<Policy>::attachProfiler(sampleProfiler *profiler, u32 interval)
+{
+    if (this->profiler)
+    {
+        this->profiler->disconnect();
+    }
+    this->profiler = profiler;
+    if (profiler)
+    {
+        profiler->connect(events, cycles, CS, IP, halt, interval);
+    }
+}
 
-        Word operand;
+template <class Policy>
+void basic_i8086<Policy>::hookInterrupt(Byte vector, InterruptHook hook, void *context)
+{
+    interruptHooks[vector].hook = hook;
+    interruptHooks[vector].context = context;
+}
 
-        if (mod == 0b11) // Register to Register
-        {
-            // Get the value of the segment register
-            operand = getSegmentRegister(reg);
+template <class Policy>
+void basic_i8086<Policy>::opIret(const Instruction &insn) // 0xcf iret
+{
+    if (profiler)
+        profiler->leave(regs.SP);
+    IP = popWord();
+    CS = popWord();
+    setFlags(popWord());
+    if (FR.TF)
+    {
+        endSlice();
+    }
+    interruptsEnabled();
+}
 
-            // Set the value to the destination register or memory
-            writeWord(getAddressFromModRM(modRM, DS), DS, operand);
+template <class Policy>
+void basic_i8086<Policy>::opHlt(const Instruction &insn) // 0xf4 hlt
+{
+    halt = true;
+    endSlice(); // start() idles until an interrupt
+}
 
-            // Update cycle count
-            cycles += mod == 0b11 ? 2 : 9; // Assuming direct register addressing
+template <class Policy>
+void basic_i8086<Policy>::opSahf(const Instruction &insn) // 0x9e sahf
+{
+    materializeFlags();
+    Word flags;
+    memcpy(&flags, &FR, sizeof(flags));
+    flags = (flags & 0xFF2A) | (regs.AH & 0xD5); // Only SF, ZF, AF, PF and CF come from AH
+    setFlags(flags);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opLahf(const Instruction &insn) // 0x9f lahf
+{
+    regs.AH = getFlags() & 0xFF;
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opFlagControl(const Instruction &insn) // cmc, clc, stc, cli, sti, cld, std
+{
+    switch (insn.opcode)
+    {
+    case 0xf5: // CMC
+        materializeFlags();
+        FR.CF = !FR.CF;
+        break;
+    case 0xf8: // CLC
+        materializeFlags();
+        FR.CF = 0;
+        break;
+    case 0xf9: // STC
+        materializeFlags();
+        FR.CF = 1;
+        break;
+    case 0xfa: // CLI
+        FR.IF = 0;
+        break;
+    case 0xfb: // STI
+        FR.IF = 1;
+        interruptsEnabled();
+        break;
+    case 0xfc: // CLD
+        FR.DF = 0;
+        break;
+    case 0xfd: // STD
+        FR.DF = 1;
+        break;
+    }
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opMovRMReg(const Instruction &insn) // 0x88-0x8b mov rm,reg / mov reg,rm
+{
+    bool toReg = insn.opcode & 0x02;  // d bit, reg is the destination
+    bool isWord = insn.opcode & 0x01; // w bit
+
+    if (insn.mod == 0b11) // Register to Register
+    {
+        if (isWord)
+        {
+            setRegister16Value(toReg ? insn.reg : insn.rm, getRegister16Value(toReg ? insn.rm : insn.reg));
+        }
+        else
+        {
+            setRegister8Value(toReg ? insn.reg : insn.rm, getRegister8Value(toReg ? insn.rm : insn.reg));
+        }
+    }
+    else // Memory to/from Register
+    {
+        u32 address = getAddressFromModRM(insn);
+        if (toReg)
+        {
+            if (isWord)
+                setRegister16Value(insn.reg, readWord(address, *os));
+            else
+                setRegister8Value(insn.reg, readByte(address, *os));
         }
-        else // Memory to Segment Register
+        else
         {
-            // Get the address from the ModRM byte
-            u32 address = getAddressFromModRM(modRM, DS); // Assuming DS segment
+            if (isWord)
+                writeWord(address, *os, getRegister16Value(insn.reg));
+            else
+                writeByte(address, *os, getRegister8Value(insn.reg));
+        }
+    }
+}
 
-            // Read the word from memory at the specified address
-            operand = readWord(address, DS);
+template <class Policy>
+void basic_i8086<Policy>::opMovRMImm(const Instruction &insn) // 0xc6 mov rm8,immed8 / 0xc7 mov rm16,immed16
+{
+    bool isImmediate16 = (insn.opcode == 0xc7);
+
+    if (insn.mod == 0b11) // Register addressing mode
+    {
+        if (isImmediate16)
+            setRegister16Value(insn.rm, insn.immediate);
+        else
+            setRegister8Value(insn.rm, insn.immediate);
+    }
+    else // Memory addressing mode
+    {
+        u32 address = getAddressFromModRM(insn);
 
-            // Set the value of the segment register
-            setSegmentRegister(reg, operand);
+        if (isImmediate16)
+            writeWord(address, *os, insn.immediate);
+        else
+            writeByte(address, *os, insn.immediate);
+    }
+}
 
-            // Update cycle count
-            cycles += mod == 0b11 ? 2 : 9; // Assuming memory access
-        }
+template <class Policy>
+void basic_i8086<Policy>::opMovReg8Imm(const Instruction &insn) // 0xb0-0xb7 mov reg8,immed8
+{
+    setRegister8Value(insn.opcode - 0xb0, insn.immediate);
+}
 
+template <class Policy>
+void basic_i8086<Policy>::opMovReg16Imm(const Instruction &insn) // 0xb8-0xbf mov reg16,immed16
+{
+    setRegister16Value(insn.opcode - 0xb8, insn.immediate);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opMovAccMem(const Instruction &insn) // 0xa0-0xa3 mov al/ax,mem / mov mem,al/ax
+{
+    Word address = insn.immediate;
+
+    switch (insn.opcode)
+    {
+    case 0xa0: // mov al,mem8
+        regs.AL = readByte(address, *os);
         break;
+    case 0xa1: // mov ax,mem16
+        regs.AX = readWord(address, *os);
+        break;
+    case 0xa2: // mov mem8,al
+        writeByte(address, *os, regs.AL);
+        break;
+    case 0xa3: // mov mem16,ax
+        writeWord(address, *os, regs.AX);
+        break;
+    }
+
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opMovRMSeg(const Instruction &insn) // 0x8c mov rm16,segreg
+{
+    Word value = getSegmentRegister(insn.reg);
+    if (insn.mod == 0b11)
+    {
+        setRegister16Value(insn.rm, value);
     }
-    case 0x8e: // mov segreg,reg16/mem16
+    else
     {
-        // Decode the instruction
-        Byte modRM = fetchByte();
+        writeWord(getAddressFromModRM(insn), *os, value);
+    }
+}
 
-        Byte mod = modRM >> 6;         // First two bits
-        Byte reg = (modRM >> 3) & 0x7; // Middle three bits
-        Byte rm = modRM & 0x7;         // Last three bits
+template <class Policy>
+void basic_i8086<Policy>::opMovSegRM(const Instruction &insn) // 0x8e mov segreg,rm16
+{
+    if (insn.mod == 0b11)
+    {
+        setSegmentRegister(insn.reg, getRegister16Value(insn.rm));
+    }
+    else
+    {
+        setSegmentRegister(insn.reg, readWord(getAddressFromModRM(insn), *os));
+    }
+}
 
-        Word operand;
+template <class Policy>
+void basic_i8086<Policy>::opJmpNear(const Instruction &insn) // 0xe9 jmp near
+{
+    IP += insn.immediate;
+}
 
-        if (mod == 0b11) // Register to Register
-        {
-            // Get the value of the source register or memory
-            operand = readWord(getAddressFromModRM(modRM, DS), DS);
+template <class Policy>
+void basic_i8086<Policy>::opJmpShort(const Instruction &insn) // 0xeb jmp short
+{
+    IP += (signed char)insn.immediate;
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opIn(const Instruction &insn) // 0xe4/0xe5 in al/ax,immed8 / 0xec/0xed in al/ax,dx
+{
+    Word port = (insn.opcode & 0x08) ? regs.DX : insn.immediate & 0xFF;
+    if (insn.opcode & 0x01)
+        regs.AX = inWordPort(port);
+    else
+        regs.AL = inBytePort(port);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opOut(const Instruction &insn) // 0xe6/0xe7 out immed8,al/ax / 0xee/0xef out dx,al/ax
+{
+    Word port = (insn.opcode & 0x08) ? regs.DX : insn.immediate & 0xFF;
+    if (insn.opcode & 0x01)
+        outWordPort(port, regs.AX);
+    else
+        outBytePort(port, regs.AL);
+}
+
+template <class Policy>
+void basic_i8086<Policy>::opMovsb(const Instruction &insn) { movsb(os); }
+template <class Policy>
+void basic_i8086<Policy>::opMovsw(const Instruction &insn) { movsw(os); }
+template <class Policy>
+void basic_i8086<Policy>::opStosb(const Instruction &insn) { stosb(os); }
+template <class Policy>
+void basic_i8086<Policy>::opStosw(const Instruction &insn) { stosw(os); }
+template <class Policy>
+void basic_i8086<Policy>::opLodsb(const Instruction &insn) { lodsb(os); }
+template <class Policy>
+void basic_i8086<Policy>::opLodsw(const Instruction &insn) { lodsw(os); }
+template <class Policy>
+void basic_i8086<Policy>::opScasb(const Instruction &insn) { scasb(os); }
+template <class Policy>
+void basic_i8086<Policy>::opScasw(const Instruction &insn) { scasw(os); }
+template <class Policy>
+void basic_i8086<Policy>::opCmpsb(const Instruction &insn) { cmpsb(os); }
+template <class Policy>
+void basic_i8086<Policy>::opCmpsw(const Instruction &insn) { cmpsw(os); }
+
+template <class Policy>
+void basic_i8086<Policy>::init()
+{
+    CS = 0xF000; // Reset vector is F000:FFF0
+    IP = 0xFFF0;
+    DS = SS = ES = FS = GS = 0;
+    regs = {}; // Undefined on the 8086, zero here so runs are repeatable
+    os = &DS;
+    halt = false;
+    cycles = 0;
+    breakpointResume = 0xFFFFFFFF;
+    setFlags(0);
+
+    memMap.mapRam(0x00000, 0xF0000, ram.data);
+    memMap.unmap(0xF0000, 0x10000); // Open bus until a BIOS is attached
+    memMap.mapRam(0x100000, HMA_SIZE, hma);
+    for (const romImage *image : roms)
+    {
+        memMap.mapRom(image->getBase(), image->getSize(), image->getData());
+    }
 
-            // Set the value to the segment register
-            setSegmentRegister(reg, operand);
+    // A20 starts disabled, FFFF:0010 and up wrap to the bottom of memory.
+    // System control port A (the "fast A20" port) bit 1 turns it on and off.
+    setA20(false);
+    systemControl.cpu = this;
+    ioMap.map(0x92, 1, &systemControl);
+
+    // Interrupt controller and timer, the timer counts from the cycle counter
+    pendingWork = 0;
+    pic.reset();
+    pic.connect(intrChanged, this);
+    ioMap.map(PIC_BASE, 2, &pic);
+    if (!pitConnected)
+    {
+        pit.connect(events, cycles, pic);
+        pitConnected = true;
+    }
+    pit.reset();
+    ioMap.map(PIT_BASE, 4, &pit);
+    ioMap.reportUnmapped = Policy::checks;
+    flushDecodeCache();
+}
 
-            // Update cycle count
-            cycles += mod == 0b11 ? 2 : 9; // Assuming direct register addressing
+/* Order of the state section, loadSnapshot() reads it back the same way */
+template <class Policy>
+bool basic_i8086<Policy>::saveSnapshot(const char *path)
+{
+    snapshotWriter out;
+    out.put(IP);
+    out.put(regs); // All eight, in encoding order
+    out.put(CS);
+    out.put(SS);
+    out.put(DS);
+    out.put(ES);
+    out.put(getFlags());
+    out.put(halt);
+    out.put(cycles);
+    out.put(getA20());
+    pic.saveState(out);
+    pit.saveState(out);
+
+    // Memory as the guest reads it: pages a fork hasn't written are still in its
+    // image, ROMs are wherever they were attached from
+    std::vector<Byte> image(MAP_PAGES << PAGE_SHIFT);
+    for (u32 page = 0; page < MAP_PAGES; page++)
+    {
+        u32 address = page << PAGE_SHIFT;
+        const Byte *contents = memMap.readPage[page];
+        if (!contents || (memMap.flags[page] & PAGE_DEVICE))
+        {
+            contents = address < 0x100000 ? ram.data + address : hma + (address - 0x100000); // Whatever is behind the device
         }
-        else // Segment Register to Memory
+        memcpy(image.data() + address, contents, PAGE_SIZE);
+    }
+    out.addSection(SECTION_RAM, image.data(), 0xF0000);
+    out.addSection(SECTION_ROM, image.data() + 0xF0000, 0x10000);
+    out.addSection(SECTION_HMA, image.data() + 0x100000, HMA_SIZE);
+    return out.write(path);
+}
+
+template <class Policy>
+bool basic_i8086<Policy>::loadSnapshot(const char *path)
+{
+    snapshotReader in;
+    if (!in.open(path))
+    {
+        return false;
+    }
+
+    if (!restoreState(in, path))
+    {
+        return false;
+    }
+
+    if (!in.loadSection(SECTION_RAM, ram.data, 0xF0000) || !in.loadSection(SECTION_HMA, hma, HMA_SIZE))
+    {
+        return false;
+    }
+
+    // Normally the same BIOS is attached again, otherwise this machine gets a copy of the one in the snapshot
+    std::vector<Byte> bios(0x10000);
+    if (!in.readSection(SECTION_ROM, bios.data(), bios.size()))
+    {
+        return false;
+    }
+    for (u32 offset = 0; offset < bios.size(); offset += PAGE_SIZE)
+    {
+        const Byte *page = memMap.readPage[(0xF0000 + offset) >> PAGE_SHIFT];
+        if (!page || memcmp(page, bios.data() + offset, PAGE_SIZE) != 0)
         {
-            // Get the address from the ModRM byte
-            u32 address = getAddressFromModRM(modRM, DS); // Assuming DS segment
+            snapshotRom = std::make_unique<romImage>();
+            snapshotRom->copy(bios.data(), bios.size(), 0xF0000);
+            memMap.mapRom(0xF0000, bios.size(), snapshotRom->getData());
+            break;
+        }
+    }
+    flushDecodeCache(); // Decoded from the memory that was there before
+    return true;
+}
 
-            // Get the value of the segment register
-            operand = getSegmentRegister(reg);
+template <class Policy>
+bool basic_i8086<Policy>::fork(const snapshotImage &image)
+{
+    if (image.sectionSize(SECTION_RAM) != 0xF0000 || image.sectionSize(SECTION_ROM) != 0x10000 ||
+        image.sectionSize(SECTION_HMA) != HMA_SIZE)
+    {
+        fprintf(stderr, "Error: Snapshot %s doesn't have this machine's memory layout\n", image.getPath());
+        return false;
+    }
+
+    snapshotReader in;
+    in.open(image);
+    if (!restoreState(in, image.getPath()))
+    {
+        return false;
+    }
 
-            // Write the word to memory at the specified address
-            writeWord(address, DS, operand);
+    // ROM is read only anyway, RAM and HMA pages are copied into ram and hma on their first write
+    memMap.mapCow(0x00000, 0xF0000, image.section(SECTION_RAM), ram.data);
+    memMap.mapRom(0xF0000, 0x10000, image.section(SECTION_ROM));
+    memMap.mapCow(0x100000, HMA_SIZE, image.section(SECTION_HMA), hma);
+    flushDecodeCache();
+    return true;
+}
 
-            // Update cycle count
-            cycles += mod == 0b11 ? 2 : 9; // Assuming memory access
+/* Everything but memory, in the order saveSnapshot() put it */
+template <class Policy>
+bool basic_i8086<Policy>::restoreState(snapshotReader &in, const char *path)
+{
+    // Before init(), so a refused snapshot leaves the machine as it was
+    for (u32 vector = 0; vector < 256; vector++)
+    {
+        if (interruptHooks[vector].hook)
+        {
+            fprintf(stderr, "Error: Snapshot %s doesn't hold the state of the devices attached to this machine\n", path);
+            return false;
         }
+    }
+    init();
+
+    Word flags = 0; // Left alone when the state section is short, in.ok() catches that below
+    bool a20 = false;
+    in.get(IP);
+    in.get(regs);
+    in.get(CS);
+    in.get(SS);
+    in.get(DS);
+    in.get(ES);
+    in.get(flags);
+    in.get(halt);
+    in.get(cycles);
+    in.get(a20);
+    setFlags(flags);
+    setA20(a20);
+    pic.loadState(in);
+    pit.loadState(in);
+    if (!in.ok())
+    {
+        fprintf(stderr, "Error: Snapshot %s state doesn't match this build\n", path);
+        return false;
+    }
+    return true;
+}
 
-        break;
+template <class Policy>
+u64 basic_i8086<Policy>::getCycles()
+{
+    return cycles;
+}
+
+template <class Policy>
+void basic_i8086<Policy>::attachRom(const romImage &image)
+{
+    roms.push_back(&image);
+    memMap.mapRom(image.getBase(), image.getSize(), image.getData());
+    flushDecodeCache();
+}
+
+template <class Policy>
+bool basic_i8086<Policy>::isHalted()
+{
+    return halt;
+}
+
+template <class Policy>
+void basic_i8086<Policy>::charge(u32 clocks)
+{
+    if constexpr (Policy::cycles)
+        cycles += clocks;
+}
+
+template <class Policy>
+bool basic_i8086<Policy>::hitBreakpoint()
+{
+    u32 physicalAddress = getPhysicalAddress(IP, CS);
+    if (physicalAddress == breakpointResume)
+    {
+        breakpointResume = 0xFFFFFFFF; // Stopped here last time, step over it
+        return false;
     }
+    breakpointResume = 0xFFFFFFFF;
 
-        //
+    if (breakpoints.count(physicalAddress))
+    {
+        breakpointResume = physicalAddress;
+        return true;
+    }
+    return false;
+}
 
-        //
+#if defined(__GNUC__)
+#define I8086_COMPUTED_GOTO
+#endif
 
-        //
+template <class Policy>
+void basic_i8086<Policy>::start(u64 cycles, ExecutionEngine engine)
+{
+    u64 end = this->cycles + cycles;
+
+    // Stops at the first instruction boundary at or past the end, so it can overshoot by one instruction
+    while (this->cycles < end)
+    {
+        events.runDue(this->cycles); // Devices first, they can raise work for the CPU
+        if (pendingWork)
+        {
+            serviceWork();
+        }
 
-        //
+        if (halt)
+        {
+            if (!FR.IF)
+                return; // Nothing can wake it up
 
-        //
+            // Idle straight to the next event, one of them has to raise the interrupt
+            u64 deadline = events.nextDeadline();
+            this->cycles = deadline < end ? deadline : end;
+            continue;
+        }
 
-    default:
-        // Handle unknown opcodes
-        break;
+        if (FR.TF || Policy::breakpoints)
+        {
+            // Checked on every instruction, so one at a time through execute()
+            if (!execute() && !halt) // Stopped at a breakpoint, HLT idles above
+                return;
+            continue;
+        }
+
+        u64 deadline = events.nextDeadline();
+        events.sliceEnd = deadline < end ? deadline : end;
+        runSlice(engine);
     }
 }
 
-void i8086::init()
+// Runs instructions until the cycle counter reaches events.sliceEnd. Nothing
+// but the counter is checked in here; anything that needs servicing sooner
+// (an event scheduled from inside the slice, POPF setting TF) pulls
+// sliceEnd in, see endSlice().
+template <class Policy>
+void basic_i8086<Policy>::runSlice(ExecutionEngine engine)
 {
-    IP = 0xFFFF0;
+    // Blocks run without going through fetchInstruction(), so no tracing or
+    // breakpoints. Between them the interpreter takes as many instructions as
+    // runBlock() says it has to; without the recompiler that count never runs out.
+    u64 interpret = ~0ull;
+    if (engine == ENGINE_JIT && !Policy::trace && !Policy::breakpoints)
+    {
+        if (!jit)
+        {
+            jit.reset(new recompiler<basic_i8086>(*this));
+        }
+        if (jit->available())
+        {
+            interpret = 0;
+        }
+    }
+
+#ifdef I8086_COMPUTED_GOTO
+    // Every handler gets its own copy of the dispatch jump, which gives the
+    // branch predictor one indirect branch per opcode instead of a shared one
+    static void *const dispatch[256] = {
+#define OPCODE(op, handler, format, regCycles, memCycles) &&op_##op,
+#include "opcodes.def"
+#undef OPCODE
+    };
+
+#define DISPATCH()                              \
+    do                                          \
+    {                                           \
+        if (cycles >= events.sliceEnd)          \
+            return;                             \
+        if (interpret-- == 0)                   \
+            goto run_block;                     \
+        insn = &fetchInstruction();             \
+        if (insn->prefixes & PREFIX_REPEAT)     \
+            goto repeat_prefix;                 \
+        goto *dispatch[insn->opcode];           \
+    } while (0)
+
+    const Instruction *insn;
+    DISPATCH();
+
+#define OPCODE(op, handler, format, regCycles, memCycles) \
+    op_##op:                                              \
+    handler(*insn);                                       \
+    DISPATCH();
+#include "opcodes.def"
+#undef OPCODE
+
+repeat_prefix:
+    executeStringInstruction(*insn);
+    DISPATCH();
+
+run_block:
+    interpret = jit->runBlock();
+    DISPATCH();
+#undef DISPATCH
+#else
+    while (cycles < events.sliceEnd)
+    {
+        if (interpret-- == 0)
+        {
+            interpret = jit->runBlock();
+            continue;
+        }
+        executeInstruction();
+    }
+#endif
 }
 
-void i8086::start(u32 cycles)
+template <class Policy>
+void basic_i8086<Policy>::endSlice()
 {
-}
\ No newline at end of file
+    events.sliceEnd = 0; // Back to start() after the current instruction
+}
+
+template class basic_i8086<FastPolicy>;
+template class basic_i8086<CycleExactPolicy>;
+template class basic_i8086<TracedPolicy>;
+template class basic_i8086<CheckedPolicy>;
@@ -1,34 +1,157 @@
 #pragma once
 #include "header.h"
+#include "ioports.h"
+#include "jit.h"
+#include "memmap.h"
+#include "pic.h"
+#include "pit.h"
+#include "policy.h"
+#include "profiler.h"
+#include "rom.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "trace.h"
 #include "ram.hpp"
 
-class i8086
+#include <memory>
+#include <unordered_set>
+
+/* Operand bytes following an opcode, one per opcode in opcodes.def */
+enum OperandFormat : Byte
+{
+    FMT_NONE,
+    FMT_MODRM,
+    FMT_IMM8,
+    FMT_IMM16,
+    FMT_IMM32, // Far pointer, offset then segment
+    FMT_MODRM_IMM8,
+    FMT_MODRM_IMM16,
+    FMT_GRP3_8,  // ModR/M, immediate byte only for TEST
+    FMT_GRP3_16, // ModR/M, immediate word only for TEST
+    FMT_PREFIX,
+};
+
+/* Prefix bits in Instruction::prefixes */
+#define PREFIX_SEGMENT 0x01
+#define PREFIX_REP 0x02   // REP/REPE/REPZ
+#define PREFIX_REPNE 0x04 // REPNE/REPNZ
+#define PREFIX_LOCK 0x08
+#define PREFIX_REPEAT (PREFIX_REP | PREFIX_REPNE)
+
+/* Segment register numbers, in ModR/M sreg encoding order */
+#define SEG_ES 0
+#define SEG_CS 1
+#define SEG_SS 2
+#define SEG_DS 3
+
+/* A decoded instruction, as kept in the decode cache */
+struct Instruction
 {
+    u32 address;    // Physical address of the first byte, cache tag
+    u32 generation; // Code page generation it was decoded in
+
+    Byte opcode;
+    Byte modRM;
+    Byte mod, reg, rm;
+    Byte prefixes; // PREFIX_* bits
+    Byte segment;  // SEG_* to use for memory operands, SEG_DS unless overridden
+    Byte length;   // Including prefixes
+    Word displacement;
+    Word immediate;
+    Word immediate2; // Segment of a far pointer
+    Word cycles;     // Clocks charged when it is fetched, see i8086::instructionCycles()
+};
+
+/* Operation that last set the arithmetic flags, see LazyFlags */
+enum FlagOp : Byte
+{
+    FLAGOP_NONE, // FR holds the flags
+    FLAGOP_ADD,  // ADD, ADC
+    FLAGOP_SUB,  // SUB, SBB, CMP, NEG
+    FLAGOP_LOGIC,
+    FLAGOP_INC, // Like ADD 1, CF kept in carryIn
+    FLAGOP_DEC, // Like SUB 1, CF kept in carryIn
+};
+
+/* Arithmetic flags are only computed from this when something reads them */
+struct LazyFlags
+{
+    Byte op;      // FlagOp
+    bool wide;    // 16-bit operation
+    Byte carryIn; // ADC/SBB carry, or the CF that INC/DEC leave alone
+    Word dst, src;
+    u32 result; // Unmasked, so the bit above the operand width is the carry
+};
+
+/* Selected per run in i8086::start() */
+enum ExecutionEngine
+{
+    ENGINE_INTERPRETER,
+    ENGINE_JIT, // Falls back to the interpreter where the host or the code isn't supported
+};
+
+#define DECODE_CACHE_SIZE 4096 // Entries, direct mapped on the physical address
+
+/* Runs a software interrupt on the host instead of through the IVT, returns false to let the guest have it */
+using InterruptHook = bool (*)(void *context, Byte vector);
+
+/* Bits in i8086::pendingWork, things to do at the next instruction boundary */
+#define WORK_IRQ 0x01 // The PIC has INTR up
+
+/* System control port A (0x92), bit 1 is the fast A20 gate */
+template <class Cpu>
+struct SystemControlPort
+{
+    Cpu *cpu;
+
+    Byte inByte(Word port) { return cpu->getA20() ? 0x02 : 0x00; }
+    void outByte(Word port, Byte value) { cpu->setA20(value & 0x02); }
+};
+
+// The CPU core, built for one of the policies in policy.h.
+// Instantiated in i8086.cpp for each of them; i8086 is the cycle exact one.
+template <class Policy>
+class basic_i8086
+{
+    template <class Cpu>
+    friend class recompiler;
+
 public:
+    using PolicyType = Policy;
+
     Word IP;
+
+    // General registers in reg/rm encoding order, so a ModR/M field indexes
+    // straight into r16. The byte registers are the halves of the first four:
+    // AL, CL, DL, BL are their low bytes and AH, CH, DH, BH their high bytes,
+    // so byte register n is r8[(n & 3) << 1 | n >> 2] on a little endian host.
     union GPReg
     {
+        Word r16[8];
+        Byte r8[16];
         struct
         {
             Word AX;
-            Word BX;
             Word CX;
             Word DX;
+            Word BX;
+            Word SP;
+            Word BP;
+            Word SI;
+            Word DI;
         };
         struct
         {
             Byte AL;
             Byte AH;
-            Byte BL;
-            Byte BH;
             Byte CL;
             Byte CH;
             Byte DL;
             Byte DH;
+            Byte BL;
+            Byte BH;
         };
     };
-    Word SI, DI;
-    Word SP, BP;
     Word CS, SS, DS, ES, FS, GS;
 
     struct Flags
@@ -49,11 +172,17 @@ public:
         Word NT : 1;        // Nested Task Flag (unused in 8086, relevant in later models), bit 14
         Word reserved4 : 1; // Reserved, bit 15
     };
-    Flags FR;
+    static_assert(sizeof(Flags) == sizeof(Word), "Flags is copied to and from a Word");
+    Flags FR; // CF, PF, AF, ZF, SF and OF are stale while lazyFlags.op isn't FLAGOP_NONE
     GPReg regs;
 
-    memory ram; // 0x00000 -> 0xCFFFF
-    memory rom; // 0x 0xF0000 -> 0xFFFFF
+    memory ram; // Mapped as RAM 0x00000 -> 0xEFFFF, the BIOS ROM sits above
+    Byte *hma = ram.data + MEM_SIZE; // 0x100000 -> 0x10FFEF, only reachable with the A20 gate enabled
+    memoryMap memMap; // Where every physical page goes, set up by init()
+
+    u32 getPhysicalAddress(u32 address, u32 segment);
+    void setA20(bool enabled);
+    bool getA20();
 
     Byte readByte(u32 address, u32 segment);
     Word readWord(u32 address, u32 segment);
@@ -62,26 +191,96 @@ public:
     Word fetchWord();
     Byte fetchByte();
 
-    bool execute();
-    void start(u32 cycles);
+    // Block transfers between host memory and guest physical memory, a page
+    // at a time instead of a byte at a time, for devices doing DMA
+    void copyToGuest(u32 physicalAddress, const Byte *source, u32 size);
+    void copyFromGuest(u32 physicalAddress, Byte *destination, u32 size);
+
+    bool execute(); // One instruction, with the device, trap and breakpoint checks start() does between slices
+    void start(u64 cycles, ExecutionEngine engine = ENGINE_INTERPRETER); // Runs for at least that many clocks
     void init();
+    u64 getCycles(); // Clocks run since power on, never wraps
+    bool isHalted(); // In HLT, start() only returns early when interrupts are off too
+    void flushDecodeCache(); // Call after changing ram behind the CPU's back
+    void attachRom(const romImage &image); // Mapped read only, shared with every other machine it is attached to
+    Word getFlags();
+    void setFlags(Word flags);
+
+    // Whole machine to and from a file: registers, memory, the PIC and PIT and
+    // the clock. Loading starts with init(), RAM is mapped from the file rather
+    // than read where the host allows it. No other device is saved, so loading
+    // fails while one that hooks interrupts (disk, video) is attached; events
+    // other devices scheduled themselves aren't saved either.
+    bool saveSnapshot(const char *path);
+    bool loadSnapshot(const char *path);
+    bool fork(const snapshotImage &image); // Like loadSnapshot(), but RAM stays shared with the image until written
 
     void interrupt(Byte vector);
+    void hookInterrupt(Byte vector, InterruptHook hook, void *context); // INT n only, not IRQs; nullptr unhooks
 
     Byte inBytePort(Word port);
     void outBytePort(Word port, Byte value);
+    Word inWordPort(Word port);
+    void outWordPort(Word port, Word value);
 
-    /* Public so the IO devices can write to it without a helper function */
-    std::unordered_map<Word, InPortFunction> inPortMap;
-    std::unordered_map<Word, OutPortFunction> outPortMap;
+    // Samples CS:IP every interval clocks and follows CALL, RET, INT and IRET
+    // for its call stacks, in every policy. nullptr detaches.
+    void attachProfiler(sampleProfiler *profiler, u32 interval);
+
+    ioPortMap ioMap; // Where every IO port goes, devices register themselves with ioMap.map()
+    scheduler events; // Device deadlines, start() runs the CPU in slices between them
+    pic8259 pic;      // IRQs 0-7, INTR goes to pendingWork
+    pit8253 pit;      // Channel 0 drives IRQ 0 from the cycle counter
+
+    std::function<void(const Instruction &insn)> traceHook; // Before every instruction, with IP still on it. Policy::trace only
+    std::unordered_set<u32> breakpoints;                     // Physical addresses. Policy::breakpoints only
+    traceRecorder *recorder = nullptr;                       // Binary trace of every instruction and write. Policy::trace only
 
 private:
-    u32 cycles;
+    u64 cycles; // Monotonic clock count
     bool halt;
+    u32 pendingWork;   // WORK_* bits, looked at between slices only
+    bool pitConnected = false; // The PIT's event is registered once, init() can run again
+    u32 addressMask; // 0xFFFFF wraps at 1 MiB like the 8086, 0x1FFFFF with A20 enabled
     Word *os;
 
-    Word
-    getFlags();
+    Instruction decodeCache[DECODE_CACHE_SIZE];
+    Instruction uncachedInstruction;       // Decoded every time, straddles a page or the segment
+    u32 pageGeneration[MAP_PAGES];         // Bumped when a page holding decoded code is written
+
+    std::unique_ptr<recompiler<basic_i8086>> jit; // Created on the first ENGINE_JIT run
+    u32 breakpointResume;                         // Breakpoint execute() last stopped at, run on the next call
+    sampleProfiler *profiler = nullptr;
+
+    LazyFlags lazyFlags;
+    SystemControlPort<basic_i8086> systemControl;
+    std::vector<const romImage *> roms;    // Attached, init() maps them again
+    struct
+    {
+        InterruptHook hook;
+        void *context;
+    } interruptHooks[256] = {};
+    std::unique_ptr<romImage> snapshotRom; // BIOS a loaded snapshot brought along that isn't attached
+
+    void charge(u32 clocks); // Adds clocks if the policy keeps them
+    void executeInstruction();
+    void runSlice(ExecutionEngine engine);
+    void endSlice();
+    void serviceWork();
+    void interruptsEnabled(); // After IF may have been set
+    static void intrChanged(void *context, bool level);
+    bool hitBreakpoint();
+    bool restoreState(snapshotReader &in, const char *path);
+
+    void materializeFlags();
+    bool getCF();
+    bool getPF();
+    bool getAF();
+    bool getZF();
+    bool getSF();
+    bool getOF();
+    void setLazyFlags(Byte op, bool wide, Word dst, Word src, u32 result);
+    Word alu(Byte operation, bool wide, Word dst, Word src);
     void pushByte(Byte value);
     void pushWord(Word value);
     Byte popByte();
@@ -90,11 +289,24 @@ private:
     Byte getRegister8Value(Byte regIndex);
     bool isMemoryOperand(Byte modRM);
     void setRegister8Value(Byte rmIndex, Byte value);
-    void handleRepe();
-    void exeOpcode();
-    void executeStringInstruction(bool repne);
+    Byte readPhysical(u32 physicalAddress);
+    void writePhysical(u32 physicalAddress, Byte value);
+    void writeSlow(u32 physicalAddress, Byte value);
+    void prepareWrite(u32 physicalAddress);
+    void markCode(u32 page);
+    void invalidateCode(u32 physicalAddress);
+    void decodeInstruction(Instruction &insn, Word start);
+    Word instructionCycles(const Instruction &insn);
+    Instruction &cacheInstruction(Instruction &slot, u32 physicalAddress);
+    const Instruction &fetchInstruction();
+    void recordStep(const Instruction &insn, u32 physicalAddress);
+    void executeStringInstruction(const Instruction &insn);
+    Word bulkString(Byte opcode, bool repne, u32 limit, bool &stop);
+    Word getRegister16Value(Byte regIndex);
     void setRegister16Value(Byte regIndex, Word value);
-    u32 getAddressFromModRM(Byte modRM, Word segment);
+    u32 getAddressFromModRM(const Instruction &insn);
+    Word readOperand(const Instruction &insn, bool isWord, u32 address);
+    void writeOperand(const Instruction &insn, bool isWord, u32 address, Word value);
     void setSegmentRegister(Byte hexReg, Word value);
     Word getSegmentRegister(Byte hexReg);
 
@@ -106,4 +318,58 @@ private:
     void lodsb(Word *segmentOverride);
     void scasb(Word *segmentOverride);
     void scasw(Word *segmentOverride);
-};
\ No newline at end of file
+    void cmpsb(Word *segmentOverride);
+    void cmpsw(Word *segmentOverride);
+
+    /* One handler per opcode, see opcodes.def for the full map */
+    using OpcodeHandler = void (basic_i8086::*)(const Instruction &insn);
+    static const OpcodeHandler opcodeTable[256];
+
+    void opUnimplemented(const Instruction &insn);
+    void opAluRM(const Instruction &insn);
+    void opAluAccImm(const Instruction &insn);
+    void opGroup1(const Instruction &insn);
+    void opTestRM(const Instruction &insn);
+    void opTestAccImm(const Instruction &insn);
+    void opIncReg16(const Instruction &insn);
+    void opDecReg16(const Instruction &insn);
+    void opJcc(const Instruction &insn);
+    void opPushf(const Instruction &insn);
+    void opPopf(const Instruction &insn);
+    void opSahf(const Instruction &insn);
+    void opLahf(const Instruction &insn);
+    void opFlagControl(const Instruction &insn);
+    void opMovRMReg(const Instruction &insn);
+    void opMovRMImm(const Instruction &insn);
+    void opMovReg8Imm(const Instruction &insn);
+    void opMovReg16Imm(const Instruction &insn);
+    void opMovAccMem(const Instruction &insn);
+    void opMovRMSeg(const Instruction &insn);
+    void opMovSegRM(const Instruction &insn);
+    void opJmpNear(const Instruction &insn);
+    void opJmpShort(const Instruction &insn);
+    void opMovsb(const Instruction &insn);
+    void opMovsw(const Instruction &insn);
+    void opStosb(const Instruction &insn);
+    void opStosw(const Instruction &insn);
+    void opLodsb(const Instruction &insn);
+    void opLodsw(const Instruction &insn);
+    void opScasb(const Instruction &insn);
+    void opScasw(const Instruction &insn);
+    void opCmpsb(const Instruction &insn);
+    void opCmpsw(const Instruction &insn);
+    void opIn(const Instruction &insn);
+    void opOut(const Instruction &insn);
+    void opCallNear(const Instruction &insn);
+    void opCallFar(const Instruction &insn);
+    void opRet(const Instruction &insn);
+    void opRetf(const Instruction &insn);
+    void opInt(const Instruction &insn);
+    void opIret(const Instruction &insn);
+    void opHlt(const Instruction &insn);
+};
+
+using i8086 = basic_i8086<CycleExactPolicy>;
+using i8086Fast = basic_i8086<FastPolicy>;
+using i8086Traced = basic_i8086<TracedPolicy>;
+using i8086Checked = basic_i8086<CheckedPolicy>;
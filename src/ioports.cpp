@@ -0,0 +1,72 @@
+#include "ioports.h"
+
+#include <string.h>
+
+ioPortMap::ioPortMap() : reportUnmapped(false), unmappedAccesses(0), handlerCount(1)
+{
+    handlers[0] = {this, unmappedIn, unmappedOut, nullptr, nullptr};
+    memset(slot, 0, sizeof(slot));
+    memset(reported, 0, sizeof(reported));
+}
+
+void ioPortMap::mapHandler(Word start, u32 count, const PortHandler &handler)
+{
+    // The same device mapped again shares its slot
+    u32 index = 1;
+    while (index < handlerCount && handlers[index].device != handler.device)
+    {
+        index++;
+    }
+    if (index == handlerCount)
+    {
+        if (handlerCount == IO_HANDLERS)
+        {
+            fprintf(stderr, "Error: Out of IO handler slots mapping port %x\n", start);
+            return;
+        }
+        handlerCount++;
+    }
+    handlers[index] = handler;
+
+    for (u32 i = 0; i < count && start + i < IO_PORTS; i++)
+    {
+        slot[start + i] = index;
+    }
+}
+
+void ioPortMap::unmap(Word start, u32 count)
+{
+    for (u32 i = 0; i < count && start + i < IO_PORTS; i++)
+    {
+        slot[start + i] = 0;
+    }
+}
+
+void ioPortMap::unmappedAccess(Word port, bool write, Byte value)
+{
+    unmappedAccesses++;
+
+    // BIOS probing loops hit the same few ports over and over, print each one once
+    Byte bit = 1 << (port & 7);
+    if (!reportUnmapped || (reported[port >> 3] & bit))
+    {
+        return;
+    }
+    reported[port >> 3] |= bit;
+
+    if (write)
+        fprintf(stderr, "Warning: Trying to write %02x to unmapped port \'%x\', not reported again\n", value, port);
+    else
+        fprintf(stderr, "Warning: Trying to read from unmapped port \'%x\', not reported again\n", port);
+}
+
+Byte ioPortMap::unmappedIn(void *map, Word port)
+{
+    ((ioPortMap *)map)->unmappedAccess(port, false, 0);
+    return 0xFF; // Nothing drives the bus
+}
+
+void ioPortMap::unmappedOut(void *map, Word port, Byte value)
+{
+    ((ioPortMap *)map)->unmappedAccess(port, true, value);
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include "header.h"
+
+#include <type_traits>
+
+// Port map of the 64K IO address space.
+// Every port holds a slot number into a small handler table, so a port access
+// is two loads and one indirect call. Handlers are thunks generated per device
+// type that call the device's own inByte/outByte directly, no virtual calls
+// and no std::function. Ports nobody registered go to slot 0, which reads 0xFF
+// like a floating bus and drops writes.
+
+#define IO_PORTS 0x10000
+#define IO_HANDLERS 256 // Slot 0 is the unmapped handler
+
+/* One registered device, called through plain function pointers */
+struct PortHandler
+{
+    void *device;
+    Byte (*inByte)(void *device, Word port);
+    void (*outByte)(void *device, Word port, Byte value);
+    Word (*inWord)(void *device, Word port); // nullptr, word accesses are two byte accesses
+    void (*outWord)(void *device, Word port, Word value);
+};
+
+/* Devices can handle 16-bit accesses themselves by having inWord/outWord */
+template <class Device, class = void>
+struct hasWordPorts : std::false_type
+{
+};
+
+template <class Device>
+struct hasWordPorts<Device, std::void_t<decltype(&Device::inWord), decltype(&Device::outWord)>> : std::true_type
+{
+};
+
+class ioPortMap
+{
+public:
+    bool reportUnmapped;    // Print the first access to each unmapped port
+    u32 unmappedAccesses;   // All of them, reported or not
+
+    ioPortMap();
+
+    // Device needs Byte inByte(Word port) and void outByte(Word port, Byte value),
+    // and can have Word inWord(Word port) and void outWord(Word port, Word value)
+    template <class Device>
+    void map(Word start, u32 count, Device *device)
+    {
+        PortHandler handler;
+        handler.device = device;
+        handler.inByte = [](void *device, Word port) -> Byte { return ((Device *)device)->inByte(port); };
+        handler.outByte = [](void *device, Word port, Byte value) { ((Device *)device)->outByte(port, value); };
+        handler.inWord = nullptr;
+        handler.outWord = nullptr;
+        if constexpr (hasWordPorts<Device>::value)
+        {
+            handler.inWord = [](void *device, Word port) -> Word { return ((Device *)device)->inWord(port); };
+            handler.outWord = [](void *device, Word port, Word value) { ((Device *)device)->outWord(port, value); };
+        }
+        mapHandler(start, count, handler);
+    }
+    void unmap(Word start, u32 count);
+
+    Byte inByte(Word port)
+    {
+        const PortHandler &handler = handlers[slot[port]];
+        return handler.inByte(handler.device, port);
+    }
+
+    void outByte(Word port, Byte value)
+    {
+        const PortHandler &handler = handlers[slot[port]];
+        handler.outByte(handler.device, port, value);
+    }
+
+    Word inWord(Word port)
+    {
+        const PortHandler &handler = handlers[slot[port]];
+        if (handler.inWord && slot[(Word)(port + 1)] == slot[port])
+        {
+            return handler.inWord(handler.device, port);
+        }
+        return inByte(port) | inByte(port + 1) << 8;
+    }
+
+    void outWord(Word port, Word value)
+    {
+        const PortHandler &handler = handlers[slot[port]];
+        if (handler.outWord && slot[(Word)(port + 1)] == slot[port])
+        {
+            handler.outWord(handler.device, port, value);
+            return;
+        }
+        outByte(port, value & 0xFF);
+        outByte(port + 1, value >> 8);
+    }
+
+private:
+    Byte slot[IO_PORTS];
+    PortHandler handlers[IO_HANDLERS];
+    u32 handlerCount;
+    Byte reported[IO_PORTS / 8]; // Bit per unmapped port that has been printed
+
+    void mapHandler(Word start, u32 count, const PortHandler &handler);
+    void unmappedAccess(Word port, bool write, Byte value);
+    static Byte unmappedIn(void *map, Word port);
+    static void unmappedOut(void *map, Word port, Byte value);
+};
@@ -0,0 +1,532 @@
+#include "jit.h"
+#include "i8086.h"
+
+#include <stddef.h>
+
+#ifdef JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+// Host register use: rdi holds the JitState, rbx the guest register file and
+// r12 the clock budget, eax is scratch. Guest word register n is word n of
+// the register file and byte register n is byte (n & 3) << 1 | n >> 2.
+#define REG16(reg) ((Byte)((reg) * 2))
+#define REG8(reg) ((Byte)(((reg) & 3) << 1 | (reg) >> 2))
+
+#define JIT_MAX_BUDGET (1ull << 62) // Slices that end at NO_EVENT still fit a signed budget
+#define JIT_NO_LINK 0xFFFFFFFF      // emitEdge() to another page
+
+/* Jcc (0x70-0x7f and their 0x60-0x6f aliases), jmp short or jmp near, what ends a block */
+static bool isJump(Byte opcode)
+{
+    return (opcode & 0xE0) == 0x60 || opcode == 0xeb || opcode == 0xe9;
+}
+
+template <class Cpu>
+recompiler<Cpu>::recompiler(Cpu &cpu) : cpu(cpu), codeBuffer(nullptr), codeUsed(0), emitPtr(nullptr)
+{
+    state.regs = cpu.regs.r16;
+
+#ifdef JIT_SUPPORTED
+    // Never writable and executable at once, compile() flips it to RW and back to RX
+    void *buffer = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer != MAP_FAILED)
+    {
+        codeBuffer = (Byte *)buffer;
+    }
+#endif
+
+    flush();
+}
+
+template <class Cpu>
+recompiler<Cpu>::~recompiler()
+{
+#ifdef JIT_SUPPORTED
+    if (codeBuffer)
+    {
+        munmap(codeBuffer, JIT_CODE_SIZE);
+    }
+#endif
+}
+
+template <class Cpu>
+bool recompiler<Cpu>::available()
+{
+    return codeBuffer != nullptr;
+}
+
+template <class Cpu>
+void recompiler<Cpu>::flush()
+{
+    codeUsed = 0;
+    for (u32 i = 0; i < JIT_BLOCKS; i++)
+    {
+        blocks[i].address = 0xFFFFFFFF; // Never matches a physical address
+    }
+    links.clear();
+}
+
+template <class Cpu>
+u32 recompiler<Cpu>::runBlock()
+{
+    u32 physicalAddress = cpu.getPhysicalAddress(cpu.IP, cpu.CS);
+    u32 page = physicalAddress >> PAGE_SHIFT;
+    if (cpu.memMap.flags[page] & PAGE_DEVICE)
+    {
+        return 1; // Can change without a write, never translated
+    }
+
+    // Blocks are shared by every CS:IP that reaches them and exit to an offset
+    // from the IP the page starts at, so the whole page has to sit in the
+    // segment without wrapping
+    u32 offset = physicalAddress & PAGE_MASK;
+    if (cpu.IP < offset || (u32)cpu.IP - offset + PAGE_SIZE > 0x10000)
+    {
+        return 1;
+    }
+
+    JitBlock &block = blocks[physicalAddress & (JIT_BLOCKS - 1)];
+    if (block.address != physicalAddress || block.generation != cpu.pageGeneration[page])
+    {
+        compile(block, physicalAddress);
+    }
+
+    if (!block.code)
+    {
+        return block.interpret;
+    }
+    u64 left = cpu.events.sliceEnd - cpu.cycles;
+    if (block.cycles > left)
+    {
+        return 1; // Would run past the slice, the interpreter takes it to the end one instruction at a time
+    }
+    left = left < JIT_MAX_BUDGET ? left : JIT_MAX_BUDGET;
+
+    Word flags = cpu.getFlags();
+    state.budget = (long long)(left - block.cycles);
+    state.flags = (flags & 0xFF) << 8 | (flags >> 11 & 1);
+    Word exit = ((u32(*)(JitState *))block.code)(&state);
+
+    cpu.setFlags((flags & ~0x08D5) | (state.flags >> 8 & 0xD5) | (state.flags & 1) << 11);
+    cpu.IP = cpu.IP - offset + exit;
+    cpu.cycles += (u64)((long long)left - state.budget);
+    return 0;
+}
+
+template <class Cpu>
+void recompiler<Cpu>::compile(JitBlock &block, u32 physicalAddress)
+{
+    if (codeUsed + JIT_MAX_BLOCK_CODE > JIT_CODE_SIZE)
+    {
+        flush(); // Out of code space, start over
+    }
+
+    u32 page = physicalAddress >> PAGE_SHIFT;
+    u32 pagePhysical = physicalAddress & ~PAGE_MASK;
+    Word pageBase = cpu.IP - (physicalAddress & PAGE_MASK); // IP of the first byte of the page
+    Byte *entry = codeBuffer + codeUsed;
+    emitPtr = entry;
+    protect(true);
+
+    block.address = physicalAddress;
+    block.generation = cpu.pageGeneration[page];
+    block.code = nullptr;
+    cpu.markCode(page);
+
+    // Prologue, the guest flags go in the host's
+    emitByte(0x53);                                                                       // push rbx
+    emitByte(0x41), emitByte(0x54);                                                       // push r12
+    emitByte(0x48), emitByte(0x8b), emitByte(0x5f), emitByte(offsetof(JitState, regs));   // mov rbx,[rdi+regs]
+    emitByte(0x4c), emitByte(0x8b), emitByte(0x67), emitByte(offsetof(JitState, budget)); // mov r12,[rdi+budget]
+    emitByte(0x66), emitByte(0x8b), emitByte(0x47), emitByte(offsetof(JitState, flags));  // mov ax,[rdi+flags]
+    emitByte(0x04), emitByte(0x7f);                                                       // add al,7fh, OF
+    emitByte(0x9e);                                                                       // sahf, the rest
+    Byte *body = emitPtr;
+
+    Word ip = cpu.IP;
+    u32 cycles = 0;
+    u32 count = 0;
+    u32 targets[2];
+    u32 targetCount = 0;
+    bool ended = false;
+
+    while (count < JIT_MAX_BLOCK)
+    {
+        Instruction insn;
+        cpu.decodeInstruction(insn, ip);
+
+        // Blocks stay inside one code page so a write to it invalidates them
+        u32 address = cpu.getPhysicalAddress(ip, cpu.CS);
+        if (((address + insn.length - 1) >> PAGE_SHIFT) != page || insn.prefixes)
+        {
+            break;
+        }
+
+        Word next = ip + insn.length;
+        if (isJump(insn.opcode))
+        {
+            Word target = next + (insn.opcode == 0xe9 ? insn.immediate : (Word)(signed char)insn.immediate);
+            if (insn.opcode < 0x80)
+            {
+                // Tests the host flags, which are the guest's
+                emitByte(0x0f), emitByte(0x80 | (insn.opcode & 0x0F)); // jcc rel32
+                Byte *taken = emitPtr;
+                emitDword(0);
+                targets[targetCount++] = emitEdge(pagePhysical, next - pageBase, 0);
+                patchDword(taken, emitPtr - (taken + 4));
+                targets[targetCount++] = emitEdge(pagePhysical, target - pageBase, Cpu::PolicyType::cycles ? 12 : 0);
+            }
+            else
+            {
+                targets[targetCount++] = emitEdge(pagePhysical, target - pageBase, 0);
+            }
+            cycles += insn.cycles;
+            count++;
+            ended = true;
+            break;
+        }
+
+        if (!translate(insn))
+        {
+            break;
+        }
+
+        ip = next;
+        cycles += insn.cycles; // Same charge as fetchInstruction()
+        count++;
+    }
+
+    if (count == 0 || (!ended && count < JIT_MIN_BLOCK))
+    {
+        // Remembered so the interpreter gets it without retranslating, along
+        // with what follows up to where a block would pay for its entry. Saves
+        // a lookup per instruction where the recompiler can't do much.
+        u32 interpret = 0;
+        u32 run = 0; // Translatable instructions since the last one that isn't
+        Word at = cpu.IP;
+        while (interpret + run < JIT_MAX_BLOCK)
+        {
+            Instruction insn;
+            cpu.decodeInstruction(insn, at);
+            u32 address = cpu.getPhysicalAddress(at, cpu.CS);
+            if (((address + insn.length - 1) >> PAGE_SHIFT) != page)
+            {
+                break;
+            }
+            if (!insn.prefixes && isJump(insn.opcode))
+            {
+                break; // A block from the start of the run can chain
+            }
+            if (!insn.prefixes && translate(insn))
+            {
+                if (++run == JIT_MIN_BLOCK)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                interpret += run + 1;
+                run = 0;
+            }
+            at += insn.length;
+        }
+        block.interpret = interpret ? interpret : 1;
+        emitPtr = entry; // translate() only had to say whether it could
+        protect(false);
+        return;
+    }
+    if (!ended)
+    {
+        targets[targetCount++] = emitEdge(pagePhysical, ip - pageBase, 0); // On to what couldn't be translated
+    }
+
+    block.code = entry;
+    block.body = body;
+    block.cycles = cycles;
+    codeUsed += emitPtr - entry;
+
+    // Link edges already waiting for this block, its own loops among them, and
+    // its edges to blocks that are already translated
+    resolve(physicalAddress);
+    for (u32 i = 0; i < targetCount; i++)
+    {
+        if (targets[i] == JIT_NO_LINK)
+        {
+            continue;
+        }
+        const JitBlock &target = blocks[targets[i] & (JIT_BLOCKS - 1)];
+        if (target.address == targets[i] && target.generation == block.generation && target.code)
+        {
+            resolve(targets[i]);
+        }
+    }
+    protect(false);
+}
+
+// An exit from the block to IP pageBase + offset, costing extra clocks on top
+// of whatever runs next. Returns to runBlock() until resolve() links it to a
+// translated block at the target, then jumps straight into that block for as
+// long as the budget covers it. Returns the target's physical address, or
+// JIT_NO_LINK when it is in another page.
+template <class Cpu>
+u32 recompiler<Cpu>::emitEdge(u32 pagePhysical, Word offset, u32 extra)
+{
+    emitByte(0x9f);                                 // lahf
+    emitByte(0x0f), emitByte(0x90), emitByte(0xc0); // seto al, the guest flags are in ax from here on
+    emitByte(0x49), emitByte(0x81), emitByte(0xec); // sub r12,imm32
+    Byte *charge = emitPtr;
+    emitDword(extra);
+    emitByte(0x0f), emitByte(0x8c); // jl rel32, over budget
+    Byte *overBudget = emitPtr;
+    emitDword(0);
+    emitByte(0x04), emitByte(0x7f); // add al,7fh
+    emitByte(0x9e);                 // sahf
+    emitByte(0xe9);                 // jmp rel32, to the exit until linked
+    Byte *jump = emitPtr;
+    emitDword(0);
+
+    patchDword(overBudget, emitPtr - (overBudget + 4));
+    emitByte(0x49), emitByte(0x81), emitByte(0xc4); // add r12,imm32, gives back the target's clocks
+    Byte *refund = emitPtr;
+    emitDword(0);
+    emitByte(0x04), emitByte(0x7f); // add al,7fh, undone right below
+    patchDword(jump, emitPtr - (jump + 4));
+    emitByte(0x2c), emitByte(0x7f); // sub al,7fh, OF back to 0 or 1
+
+    emitByte(0x66), emitByte(0x89), emitByte(0x47), emitByte(offsetof(JitState, flags));  // mov [rdi+flags],ax
+    emitByte(0x4c), emitByte(0x89), emitByte(0x67), emitByte(offsetof(JitState, budget)); // mov [rdi+budget],r12
+    emitByte(0xb8), emitDword(offset);                                                    // mov eax,offset
+    emitByte(0x41), emitByte(0x5c);                                                       // pop r12
+    emitByte(0x5b);                                                                       // pop rbx
+    emitByte(0xc3);                                                                       // ret
+
+    if (offset >= PAGE_SIZE)
+    {
+        return JIT_NO_LINK; // Always through runBlock(), which checks the other page
+    }
+    u32 target = pagePhysical + offset;
+    links.insert({target, {cpu.pageGeneration[pagePhysical >> PAGE_SHIFT], extra, charge, refund, jump}});
+    return target;
+}
+
+template <class Cpu>
+void recompiler<Cpu>::resolve(u32 physicalAddress)
+{
+    const JitBlock &block = blocks[physicalAddress & (JIT_BLOCKS - 1)];
+    auto waiting = links.equal_range(physicalAddress);
+    for (auto it = waiting.first; it != waiting.second; ++it)
+    {
+        const JitLink &link = it->second;
+        if (link.generation != block.generation)
+        {
+            continue; // From before the page was written, that block never runs again
+        }
+        patchDword(link.charge, link.extra + block.cycles);
+        patchDword(link.refund, block.cycles);
+        patchDword(link.jump, block.body - (link.jump + 4));
+    }
+    links.erase(waiting.first, waiting.second);
+}
+
+/* The whole buffer RW for emitting, or RX for running it */
+template <class Cpu>
+void recompiler<Cpu>::protect(bool writable)
+{
+#ifdef JIT_SUPPORTED
+    mprotect(codeBuffer, JIT_CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+#endif
+}
+
+// Each translation leaves the host flags as the guest instruction leaves the
+// guest's, and the glue around it only moves data
+template <class Cpu>
+bool recompiler<Cpu>::translate(const Instruction &insn)
+{
+    Byte opcode = insn.opcode;
+    bool wide = opcode & 0x01;
+    bool registers = insn.mod == 0b11;
+
+    if (opcode < 0x40 && (opcode & 0x04) == 0) // add, or, adc, sbb, and, sub, xor, cmp rm,reg / reg,rm
+    {
+        if (!registers)
+        {
+            return false;
+        }
+        bool toReg = opcode & 0x02;
+        Byte source = toReg ? insn.rm : insn.reg;
+        Byte destination = toReg ? insn.reg : insn.rm;
+        emitGuest(0x8a | wide, 0, wide ? REG16(source) : REG8(source), wide);                     // mov al/ax,source
+        emitGuest((opcode & 0x38) | wide, 0, wide ? REG16(destination) : REG8(destination), wide); // op destination,al/ax
+        return true;
+    }
+    if (opcode < 0x40 && (opcode & 0x06) == 0x04) // add, or, adc, sbb, and, sub, xor, cmp al/ax,immed
+    {
+        emitGuest(wide ? 0x81 : 0x80, (opcode >> 3) & 7, 0, wide); // AL and AX are at offset 0
+        wide ? emitWord(insn.immediate) : emitByte(insn.immediate & 0xFF);
+        return true;
+    }
+
+    switch (opcode)
+    {
+    case 0x40: // inc reg16
+    case 0x41:
+    case 0x42:
+    case 0x43:
+    case 0x44:
+    case 0x45:
+    case 0x46:
+    case 0x47:
+    case 0x48: // dec reg16
+    case 0x49:
+    case 0x4a:
+    case 0x4b:
+    case 0x4c:
+    case 0x4d:
+    case 0x4e:
+    case 0x4f:
+        emitGuest(0xff, (opcode >> 3) & 1, REG16(opcode & 7), true);
+        return true;
+
+    case 0x80: // grp1 rm,immed, register forms only
+    case 0x81:
+    case 0x82:
+    case 0x83:
+        if (!registers)
+        {
+            return false;
+        }
+        if (opcode == 0x83)
+        {
+            emitGuest(0x83, insn.reg, REG16(insn.rm), true); // The host sign extends it the same way
+            emitByte(insn.immediate & 0xFF);
+        }
+        else if (wide)
+        {
+            emitGuest(0x81, insn.reg, REG16(insn.rm), true);
+            emitWord(insn.immediate);
+        }
+        else
+        {
+            emitGuest(0x80, insn.reg, REG8(insn.rm), false);
+            emitByte(insn.immediate & 0xFF);
+        }
+        return true;
+
+    case 0x84: // test rm,reg, register forms only
+    case 0x85:
+    case 0x88: // mov rm,reg / mov reg,rm, register forms only
+    case 0x89:
+    case 0x8a:
+    case 0x8b:
+    {
+        if (!registers)
+        {
+            return false;
+        }
+        bool toReg = opcode & 0x02;
+        Byte source = toReg ? insn.rm : insn.reg;
+        Byte destination = toReg ? insn.reg : insn.rm;
+        emitGuest(0x8a | wide, 0, wide ? REG16(source) : REG8(source), wide); // mov al/ax,source
+        emitGuest(opcode & 0xFD, 0, wide ? REG16(destination) : REG8(destination), wide); // test/mov destination,al/ax
+        return true;
+    }
+
+    case 0xa8: // test al,immed8 / test ax,immed16
+    case 0xa9:
+        emitGuest(0xf6 | wide, 0, 0, wide);
+        wide ? emitWord(insn.immediate) : emitByte(insn.immediate & 0xFF);
+        return true;
+
+    case 0xb0: // mov reg8,immed8
+    case 0xb1:
+    case 0xb2:
+    case 0xb3:
+    case 0xb4:
+    case 0xb5:
+    case 0xb6:
+    case 0xb7:
+        emitGuest(0xc6, 0, REG8(opcode & 7), false);
+        emitByte(insn.immediate & 0xFF);
+        return true;
+
+    case 0xb8: // mov reg16,immed16
+    case 0xb9:
+    case 0xba:
+    case 0xbb:
+    case 0xbc:
+    case 0xbd:
+    case 0xbe:
+    case 0xbf:
+        emitGuest(0xc7, 0, REG16(opcode & 7), true);
+        emitWord(insn.immediate);
+        return true;
+
+    case 0xc6: // mov rm8,immed8 / mov rm16,immed16, register forms only
+    case 0xc7:
+        if (!registers)
+        {
+            return false;
+        }
+        emitGuest(opcode, 0, wide ? REG16(insn.rm) : REG8(insn.rm), wide);
+        wide ? emitWord(insn.immediate) : emitByte(insn.immediate & 0xFF);
+        return true;
+
+    case 0xf5: // cmc
+    case 0xf8: // clc
+    case 0xf9: // stc
+        emitByte(opcode); // Same encoding on the host
+        return true;
+
+    default:
+        return false; // Left to the interpreter
+    }
+}
+
+template <class Cpu>
+void recompiler<Cpu>::emitByte(Byte value)
+{
+    *emitPtr++ = value;
+}
+
+template <class Cpu>
+void recompiler<Cpu>::emitWord(Word value)
+{
+    emitByte(value & 0xFF);
+    emitByte(value >> 8);
+}
+
+template <class Cpu>
+void recompiler<Cpu>::emitDword(u32 value)
+{
+    emitWord(value & 0xFFFF);
+    emitWord(value >> 16);
+}
+
+template <class Cpu>
+void recompiler<Cpu>::patchDword(Byte *at, u32 value)
+{
+    Byte *saved = emitPtr;
+    emitPtr = at;
+    emitDword(value);
+    emitPtr = saved;
+}
+
+/* opcode on [rbx+offset], the guest register at offset, with field in the reg bits of the ModR/M */
+template <class Cpu>
+void recompiler<Cpu>::emitGuest(Byte opcode, Byte field, Byte offset, bool wide)
+{
+    if (wide)
+    {
+        emitByte(0x66); // Operand size prefix, 16 bits
+    }
+    emitByte(opcode);
+    emitByte(0x43 | field << 3); // mod 01, rm rbx, disp8
+    emitByte(offset);
+}
+
+template class recompiler<i8086Fast>;
+template class recompiler<i8086>;
+template class recompiler<i8086Traced>;
+template class recompiler<i8086Checked>;
@@ -0,0 +1,89 @@
+#pragma once
+#include "header.h"
+
+// Basic-block recompiler to x86-64 host code.
+// Translates runs of guest instructions that only touch registers (MOV, the
+// ALU group, TEST, INC/DEC, CMC/CLC/STC) into native code in an mmap'd buffer
+// that is only ever writable or executable, never both. Guest registers stay
+// in memory and are operated on in place, and the guest arithmetic flags live
+// in the host flags for as long as native code runs, since the host computes
+// them the same way. Blocks end at a JMP or Jcc, whose edges chain straight
+// into other blocks of the same code page while the slice has clocks left for
+// them. What can't be translated, and runs too short to pay for entering a
+// block, is left to the interpreter, which runBlock() tells how far to go
+// before looking for a block again.
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_SUPPORTED
+#endif
+
+struct Instruction;
+
+#define JIT_CODE_SIZE (1024 * 1024) // Host code buffer, flushed when full
+#define JIT_BLOCKS 4096             // Entries, direct mapped on the physical address
+#define JIT_MAX_BLOCK 64            // Guest instructions per block
+#define JIT_MIN_BLOCK 3             // Fewer are interpreted, unless the block ends in a jump and can chain
+#define JIT_MAX_BLOCK_CODE 4096     // Upper bound on host code for one block
+
+/* Handed to a block in rdi */
+struct JitState
+{
+    Word *regs;       // The guest register file, basic_i8086::regs
+    long long budget; // Clocks the slice has left after the entry block, chained blocks take theirs from it
+    Word flags;       // Arithmetic flags in and out: AH as LAHF has them, OF in AL
+};
+
+struct JitBlock
+{
+    u32 address;    // Physical address of the first instruction, cache tag
+    u32 generation; // Code page generation it was translated in
+    Byte *code;     // Host entry point, nullptr if left to the interpreter
+    Byte *body;     // Past the prologue, where blocks of the same page chain in
+    u32 cycles;     // Taken from the budget before the block runs
+    u32 interpret;  // Without code, instructions from here up to one that can start a block
+};
+
+/* An edge from one block to another in its page, patched once the target is translated */
+struct JitLink
+{
+    u32 generation; // Of the page, both ends are stale once it changes
+    u32 extra;      // Clocks of the edge itself, a taken Jcc
+    Byte *charge;   // imm32 of sub r12, extra clocks plus the target's
+    Byte *refund;   // imm32 of add r12, the target's clocks, when the budget can't cover them
+    Byte *jump;     // rel32 of jmp, to the target's body
+};
+
+/* Cpu is the basic_i8086 instantiation it translates for */
+template <class Cpu>
+class recompiler
+{
+public:
+    recompiler(Cpu &cpu);
+    ~recompiler();
+
+    bool available();
+    u32 runBlock(); // 0 after running a block, else how many instructions the interpreter has to take first
+    void flush();
+
+private:
+    Cpu &cpu;
+    JitState state;
+
+    Byte *codeBuffer;
+    u32 codeUsed;
+    Byte *emitPtr;
+    JitBlock blocks[JIT_BLOCKS];
+    std::unordered_multimap<u32, JitLink> links; // Target physical address to edges waiting for it
+
+    void compile(JitBlock &block, u32 physicalAddress);
+    void protect(bool writable);
+    bool translate(const Instruction &insn); // False if unsupported
+    u32 emitEdge(u32 pagePhysical, Word offset, u32 extra);
+    void resolve(u32 physicalAddress);
+
+    void emitByte(Byte value);
+    void emitWord(Word value);
+    void emitDword(u32 value);
+    void patchDword(Byte *at, u32 value);
+    void emitGuest(Byte opcode, Byte field, Byte offset, bool wide);
+};
@@ -1,4 +1,110 @@
+#include "batch.h"
 #include "i8086.h"
 #include "ram.hpp"
 
-int main() { return 0; }
\ No newline at end of file
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage()
+{
+    fprintf(stderr, "Usage: x86 --batch <manifest> [--snapshot <file>] [--rom <file>] [--threads <n>] [--cycles <n>]\n"
+                    "           [--jit] [--trace] [--profile <clocks>]\n"
+                    "\n"
+                    "Runs every job of the manifest in a machine of its own, on all cores unless\n"
+                    "--threads says otherwise. One job per line, a file to load followed by options:\n"
+                    "  at=SEG:OFF   where the file is loaded, 1000:0000 if not given\n"
+                    "  cycles=N     clock limit, --cycles (10000000) if not given\n"
+                    "  enter        start running at the file instead of where the snapshot was taken\n"
+                    "Without --snapshot every job starts at the file, with its own segment in\n"
+                    "CS, DS, ES and SS. Lines starting with # are comments. --rom maps a BIOS image\n"
+                    "below 1 MiB, loaded once and shared by every machine.\n"
+                    "\n"
+                    "Prints a line per job: exit (halt, limit or error), cycles, registers and\n"
+                    "whatever the guest wrote to port E9.\n"
+                    "\n"
+                    "--trace records every instruction and memory write of a job to the job's file\n"
+                    "with .trace appended, tracedump prints it. Turns --jit off.\n"
+                    "\n"
+                    "--profile samples CS:IP every that many clocks. Hot spots go to the job's file\n"
+                    "with .profile appended, call stacks folded for flamegraph.pl to .folded.\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *manifest = nullptr;
+    const char *snapshot = nullptr;
+    const char *rom = nullptr;
+    u32 threads = 0;
+    u64 cycles = 10000000;
+    ExecutionEngine engine = ENGINE_INTERPRETER;
+    bool trace = false;
+    u32 profile = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--batch") && hasValue)
+            manifest = argv[++i];
+        else if (!strcmp(argv[i], "--snapshot") && hasValue)
+            snapshot = argv[++i];
+        else if (!strcmp(argv[i], "--rom") && hasValue)
+            rom = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && hasValue)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--cycles") && hasValue)
+            cycles = strtoull(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "--jit"))
+            engine = ENGINE_JIT;
+        else if (!strcmp(argv[i], "--trace"))
+            trace = true;
+        else if (!strcmp(argv[i], "--profile") && hasValue)
+            profile = strtoul(argv[++i], nullptr, 0);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (!manifest)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<BatchJob> jobs;
+    if (!readManifest(manifest, cycles, jobs))
+    {
+        return 1;
+    }
+
+    snapshotImage image;
+    if (snapshot && !image.open(snapshot))
+    {
+        return 1;
+    }
+
+    romImage bios;
+    if (rom && !bios.load(rom))
+    {
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<BatchResult> results = runBatch(jobs, snapshot ? &image : nullptr, rom ? &bios : nullptr, threads, engine, trace,
+                                                profile);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printResults(stdout, jobs, results);
+
+    u64 totalCycles = 0;
+    int failed = 0;
+    for (const BatchResult &result : results)
+    {
+        totalCycles += result.cycles;
+        failed += !result.loaded;
+    }
+    fprintf(stderr, "%zu jobs, %d failed, %.3f s, %.1f M clocks/s\n", jobs.size(), failed, seconds,
+            totalCycles / seconds / 1e6);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+#include "memmap.h"
+
+/* What an unmapped page reads as, filled before main() so machines on other threads never write it */
+static struct OpenBus
+{
+    Byte data[PAGE_SIZE];
+    OpenBus() { memset(data, 0xFF, sizeof(data)); }
+} openBus;
+
+memoryMap::memoryMap()
+{
+    unmap(0, MAP_PAGES << PAGE_SHIFT);
+}
+
+void memoryMap::mapRam(u32 start, u32 size, Byte *host)
+{
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        u32 page = (start + offset) >> PAGE_SHIFT;
+        readPage[page] = host + offset;
+        writePage[page] = host + offset;
+        hostPage[page] = host + offset;
+        device[page] = nullptr;
+        flags[page] = PAGE_RAM;
+    }
+}
+
+void memoryMap::mapRom(u32 start, u32 size, const Byte *host)
+{
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        u32 page = (start + offset) >> PAGE_SHIFT;
+        readPage[page] = (Byte *)host + offset; // Never written through, writePage stays null
+        writePage[page] = nullptr;
+        hostPage[page] = (Byte *)host + offset;
+        device[page] = nullptr;
+        flags[page] = PAGE_ROM;
+    }
+}
+
+void memoryMap::mapCow(u32 start, u32 size, const Byte *shared, Byte *host)
+{
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        u32 page = (start + offset) >> PAGE_SHIFT;
+        readPage[page] = (Byte *)shared + offset; // Never written through, the copy is made first
+        writePage[page] = nullptr;
+        hostPage[page] = host + offset;
+        device[page] = nullptr;
+        flags[page] = PAGE_RAM | PAGE_COW;
+    }
+}
+
+void memoryMap::mapDevice(u32 start, u32 size, MemoryDevice *handler)
+{
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        u32 page = (start + offset) >> PAGE_SHIFT;
+        readPage[page] = nullptr;
+        writePage[page] = nullptr;
+        hostPage[page] = nullptr;
+        device[page] = handler;
+        flags[page] = PAGE_DEVICE;
+    }
+}
+
+void memoryMap::unmap(u32 start, u32 size)
+{
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        u32 page = (start + offset) >> PAGE_SHIFT;
+        readPage[page] = openBus.data;
+        writePage[page] = nullptr;
+        hostPage[page] = nullptr;
+        device[page] = nullptr;
+        flags[page] = 0;
+    }
+}
+
+void memoryMap::trapWrites(u32 page)
+{
+    writePage[page] = nullptr;
+}
+
+void memoryMap::untrapWrites(u32 page)
+{
+    // Only plain RAM, or RAM that is watched but already dirty
+    bool fast = (flags[page] & (PAGE_RAM | PAGE_COW | PAGE_CODE)) == PAGE_RAM &&
+                (flags[page] & (PAGE_WATCH | PAGE_DIRTY)) != PAGE_WATCH;
+    writePage[page] = fast ? hostPage[page] : nullptr;
+}
+
+void memoryMap::copyOnWrite(u32 page)
+{
+    memcpy(hostPage[page], readPage[page], PAGE_SIZE);
+    readPage[page] = hostPage[page];
+    flags[page] &= ~PAGE_COW;
+    untrapWrites(page);
+}
+
+void memoryMap::watchWrites(u32 start, u32 size)
+{
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        u32 page = (start + offset) >> PAGE_SHIFT;
+        flags[page] |= PAGE_WATCH | PAGE_DIRTY;
+        untrapWrites(page);
+    }
+}
+
+void memoryMap::markDirty(u32 page)
+{
+    flags[page] |= PAGE_DIRTY;
+    untrapWrites(page);
+}
+
+bool memoryMap::takeDirty(u32 page)
+{
+    if (!(flags[page] & PAGE_DIRTY))
+    {
+        return false;
+    }
+    flags[page] &= ~PAGE_DIRTY;
+    untrapWrites(page);
+    return true;
+}
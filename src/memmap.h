@@ -0,0 +1,77 @@
+#pragma once
+#include "header.h"
+
+#include <string.h>
+
+// Page map of the physical address space.
+// Every 4 KiB page either points at host memory (RAM, or ROM that is only
+// readable) or at a device handler for memory mapped IO. Reads and writes to
+// host memory are a single indexed load, everything else takes the slow path.
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define MAP_PAGES (0x110000 >> PAGE_SHIFT) // 1 MiB, plus the 64 KiB reachable above it from FFFF:xxxx
+
+/* Page flags */
+#define PAGE_RAM 0x01    // Host memory, readable and writable
+#define PAGE_ROM 0x02    // Host memory, writes are dropped
+#define PAGE_DEVICE 0x04 // Memory mapped IO, every access goes to the device
+#define PAGE_CODE 0x08   // Holds decoded or translated code, writes are trapped to invalidate it
+#define PAGE_COW 0x10    // RAM still reading from a shared image, the first write copies it to hostPage
+#define PAGE_WATCH 0x20  // RAM a device scans for changes, like video memory; writes are trapped until one sets PAGE_DIRTY
+#define PAGE_DIRTY 0x40  // Written since the device last took it with takeDirty()
+
+/* Unaligned little endian word access to host memory, compiles to a single load/store */
+inline Word loadWord(const Byte *host)
+{
+    Word value;
+    memcpy(&value, host, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = (value >> 8) | (value << 8);
+#endif
+    return value;
+}
+
+inline void storeWord(Byte *host, Word value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = (value >> 8) | (value << 8);
+#endif
+    memcpy(host, &value, sizeof(value));
+}
+
+/* Memory mapped IO, called for every access to the pages it is mapped at */
+class MemoryDevice
+{
+public:
+    virtual ~MemoryDevice() {}
+    virtual Byte readByte(u32 physicalAddress) = 0;
+    virtual void writeByte(u32 physicalAddress, Byte value) = 0;
+};
+
+class memoryMap
+{
+public:
+    Byte *readPage[MAP_PAGES];  // nullptr sends reads to the device
+    Byte *writePage[MAP_PAGES]; // nullptr sends writes to the slow path
+    Byte *hostPage[MAP_PAGES];  // Backing memory, kept while writes are trapped; the private copy for PAGE_COW
+    MemoryDevice *device[MAP_PAGES];
+    Byte flags[MAP_PAGES];
+
+    memoryMap();
+
+    void mapRam(u32 start, u32 size, Byte *host);
+    void mapRom(u32 start, u32 size, const Byte *host);
+    void mapCow(u32 start, u32 size, const Byte *shared, Byte *host); // RAM reading shared until written
+    void mapDevice(u32 start, u32 size, MemoryDevice *handler);
+    void unmap(u32 start, u32 size); // Open bus, reads 0xFF and drops writes
+
+    void trapWrites(u32 page);   // Send writes to the slow path even for RAM
+    void untrapWrites(u32 page); // Back to the fast path if the page is RAM
+    void copyOnWrite(u32 page);  // Makes a PAGE_COW page private, writes are still trapped if it holds code
+
+    void watchWrites(u32 start, u32 size); // Starts out dirty; mapping the pages again ends the watch
+    void markDirty(u32 page);              // Then writes go back to the fast path until the next takeDirty()
+    bool takeDirty(u32 page);              // Whether it was written, and watches it again
+};
@@ -0,0 +1,166 @@
+#include "pic.h"
+
+pic8259::pic8259() : intrChanged(nullptr), context(nullptr)
+{
+    reset();
+}
+
+void pic8259::connect(IntrCallback callback, void *context)
+{
+    intrChanged = callback;
+    this->context = context;
+}
+
+void pic8259::reset()
+{
+    irr = 0;
+    isr = 0;
+    imr = 0xFF; // Everything masked until the BIOS sets it up
+    vectorBase = 0x08;
+    initStep = 0;
+    needIcw4 = false;
+    single = true;
+    autoEoi = false;
+    readIsr = false;
+}
+
+/* Lowest set bit, which is the highest priority */
+static Byte highestPriority(Byte bits)
+{
+    return bits & -bits;
+}
+
+bool pic8259::getIntr()
+{
+    Byte request = highestPriority(irr & ~imr);
+    Byte inService = highestPriority(isr);
+    return request && (!inService || request < inService);
+}
+
+void pic8259::update()
+{
+    if (intrChanged)
+    {
+        intrChanged(context, getIntr());
+    }
+}
+
+void pic8259::raiseIrq(Byte irq)
+{
+    irr |= 1 << irq;
+    update();
+}
+
+Byte pic8259::acknowledge()
+{
+    Byte request = highestPriority(irr & ~imr);
+    if (!request)
+    {
+        return vectorBase + 7; // Spurious, the request went away before INTA
+    }
+
+    Byte irq = __builtin_ctz(request);
+    irr &= ~request;
+    if (!autoEoi)
+    {
+        isr |= request;
+    }
+    update();
+    return vectorBase + irq;
+}
+
+Byte pic8259::inByte(Word port)
+{
+    if (port & 0x01)
+    {
+        return imr;
+    }
+    return readIsr ? isr : irr;
+}
+
+void pic8259::outByte(Word port, Byte value)
+{
+    if (!(port & 0x01))
+    {
+        if (value & 0x10) // ICW1, starts initialisation
+        {
+            needIcw4 = value & 0x01;
+            single = value & 0x02;
+            irr = 0;
+            isr = 0;
+            imr = 0;
+            autoEoi = false;
+            readIsr = false;
+            initStep = 2;
+        }
+        else if (value & 0x08) // OCW3
+        {
+            if (value & 0x02)
+            {
+                readIsr = value & 0x01;
+            }
+        }
+        else // OCW2
+        {
+            switch (value & 0xE0)
+            {
+            case 0x20: // Non-specific EOI
+                isr &= ~highestPriority(isr);
+                break;
+            case 0x60: // Specific EOI
+                isr &= ~(1 << (value & 0x07));
+                break;
+            default: // Rotation isn't modelled, priority stays fixed
+                break;
+            }
+        }
+        update();
+        return;
+    }
+
+    switch (initStep)
+    {
+    case 2: // ICW2
+        vectorBase = value & 0xF8;
+        initStep = !single ? 3 : needIcw4 ? 4 : 0;
+        break;
+    case 3: // ICW3, there is nothing cascaded to us
+        initStep = needIcw4 ? 4 : 0;
+        break;
+    case 4: // ICW4
+        autoEoi = value & 0x02;
+        initStep = 0;
+        break;
+    default: // OCW1
+        imr = value;
+        break;
+    }
+    update();
+}
+
+void pic8259::saveState(snapshotWriter &out)
+{
+    out.put(irr);
+    out.put(isr);
+    out.put(imr);
+    out.put(vectorBase);
+    out.put(initStep);
+    out.put(needIcw4);
+    out.put(single);
+    out.put(autoEoi);
+    out.put(readIsr);
+}
+
+void pic8259::loadState(snapshotReader &in)
+{
+    in.get(irr);
+    in.get(isr);
+    in.get(imr);
+    in.get(vectorBase);
+    in.get(initStep);
+    in.get(needIcw4);
+    in.get(single);
+    in.get(autoEoi);
+    in.get(readIsr);
+    update();
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "header.h"
+#include "snapshot.h"
+
+// 8259A programmable interrupt controller, a single one as in the PC/XT.
+// Ports 0x20 (ICW1, OCW2, OCW3, IRR/ISR) and 0x21 (ICW2-4, IMR). Fixed
+// priority with IRQ 0 highest, edge triggered, normal or automatic EOI.
+// The CPU is told through intrChanged whenever the INTR line may have
+// changed, so it never has to poll.
+
+#define PIC_BASE 0x20
+
+using IntrCallback = void (*)(void *context, bool level);
+
+class pic8259
+{
+public:
+    pic8259();
+
+    void connect(IntrCallback callback, void *context);
+    void reset();
+
+    void raiseIrq(Byte irq); // Rising edge on an IRQ line
+    bool getIntr();          // An unmasked request beats everything in service
+    Byte acknowledge();      // INTA, the vector to call; moves the request into service
+
+    Byte inByte(Word port);
+    void outByte(Word port, Byte value);
+
+    void saveState(snapshotWriter &out);
+    void loadState(snapshotReader &in); // Tells the CPU about INTR again
+
+private:
+    Byte irr; // Requests
+    Byte isr; // In service
+    Byte imr; // Masked
+    Byte vectorBase;
+    Byte initStep;  // Next ICW expected on the data port, 0 when initialised
+    bool needIcw4;
+    bool single;    // No ICW3, no cascade
+    bool autoEoi;
+    bool readIsr;   // OCW3 picks what the command port reads
+
+    IntrCallback intrChanged;
+    void *context;
+
+    void update();
+};
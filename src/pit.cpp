@@ -0,0 +1,202 @@
+#include "pit.h"
+
+pit8253::pit8253() : channels(), events(nullptr), clock(nullptr), pic(nullptr)
+{
+    reset();
+}
+
+void pit8253::connect(scheduler &events, const u64 &clock, pic8259 &pic)
+{
+    this->events = &events;
+    this->clock = &clock;
+    this->pic = &pic;
+    channels[0].event = events.addEvent(outputEdge, this);
+}
+
+void pit8253::reset()
+{
+    for (int i = 0; i < 3; i++)
+    {
+        Channel &channel = channels[i];
+        u32 event = channel.event;
+        channel = {};
+        channel.event = event;
+        channel.access = 3;
+    }
+    if (events)
+    {
+        events->cancel(channels[0].event);
+    }
+}
+
+u32 pit8253::period(const Channel &channel)
+{
+    return channel.reload ? channel.reload : 0x10000;
+}
+
+Word pit8253::count(const Channel &channel)
+{
+    if (!channel.counting)
+    {
+        return channel.reload;
+    }
+
+    u64 ticks = (*clock - channel.start) / PIT_DIVIDER;
+    u32 length = period(channel);
+    switch (channel.mode)
+    {
+    case 2:
+        return length - ticks % length;
+    case 3: // Counts down by two, twice per period
+        return (length - (ticks * 2) % length) & 0xFFFE;
+    default: // Keeps counting down past terminal count
+        return (length - ticks) & 0xFFFF;
+    }
+}
+
+void pit8253::load(int index)
+{
+    Channel &channel = channels[index];
+    channel.counting = true;
+    channel.start = *clock;
+
+    if (index == 0)
+    {
+        events->schedule(channel.event, channel.start + (u64)period(channel) * PIT_DIVIDER);
+    }
+}
+
+void pit8253::outputEdge(void *context, u64 when)
+{
+    pit8253 *pit = (pit8253 *)context;
+    Channel &channel = pit->channels[0];
+
+    pit->pic->raiseIrq(0);
+
+    // Modes 2 and 3 keep going, one edge per period; 0 goes high once and stays there
+    if (channel.mode == 2 || channel.mode == 3)
+    {
+        pit->events->schedule(channel.event, when + (u64)pit->period(channel) * PIT_DIVIDER);
+    }
+}
+
+Byte pit8253::inByte(Word port)
+{
+    int index = port & 0x03;
+    if (index == 3)
+    {
+        return 0xFF; // The control word can't be read back on the 8253
+    }
+
+    Channel &channel = channels[index];
+    Word value = channel.latched ? channel.latch : count(channel);
+
+    Byte result;
+    if (channel.access == 1)
+        result = value & 0xFF;
+    else if (channel.access == 2)
+        result = value >> 8;
+    else
+    {
+        result = channel.readHigh ? value >> 8 : value & 0xFF;
+        channel.readHigh = !channel.readHigh;
+    }
+
+    if (channel.latched && (channel.access != 3 || !channel.readHigh))
+    {
+        channel.latched = false; // Whole latch has been read
+    }
+    return result;
+}
+
+void pit8253::outByte(Word port, Byte value)
+{
+    int index = port & 0x03;
+    if (index == 3) // Control word
+    {
+        int selected = value >> 6;
+        if (selected == 3)
+        {
+            return; // Read-back is 8254 only
+        }
+
+        Channel &channel = channels[selected];
+        Byte access = (value >> 4) & 0x03;
+        if (access == 0) // Counter latch command
+        {
+            if (!channel.latched)
+            {
+                channel.latch = count(channel);
+                channel.latched = true;
+                channel.readHigh = false;
+            }
+            return;
+        }
+
+        channel.access = access;
+        channel.mode = (value >> 1) & 0x07;
+        if (channel.mode > 5)
+        {
+            channel.mode -= 4; // 6 and 7 are 2 and 3
+        }
+        if (channel.mode == 1 || channel.mode == 4 || channel.mode == 5)
+        {
+            channel.mode = 0; // One shots, all triggered by loading the count
+        }
+        channel.writeHigh = false;
+        channel.readHigh = false;
+        channel.latched = false;
+        channel.counting = false; // Stops until a new count is written
+        if (selected == 0)
+        {
+            events->cancel(channel.event);
+        }
+        return;
+    }
+
+    Channel &channel = channels[index];
+    if (channel.access == 1)
+    {
+        channel.reload = (channel.reload & 0xFF00) | value;
+    }
+    else if (channel.access == 2)
+    {
+        channel.reload = (channel.reload & 0x00FF) | value << 8;
+    }
+    else
+    {
+        if (!channel.writeHigh)
+        {
+            channel.reload = (channel.reload & 0xFF00) | value;
+            channel.writeHigh = true;
+            return; // Counting starts once both bytes are in
+        }
+        channel.reload = (channel.reload & 0x00FF) | value << 8;
+        channel.writeHigh = false;
+    }
+    load(index);
+}
+
+void pit8253::saveState(snapshotWriter &out)
+{
+    out.put(channels);
+    out.put(events->deadline(channels[0].event));
+}
+
+void pit8253::loadState(snapshotReader &in)
+{
+    u32 event = channels[0].event; // Ours, not the one of the machine that saved it
+    in.get(channels);
+    channels[0].event = event;
+
+    u64 edge = NO_EVENT;
+    in.get(edge);
+    if (in.ok() && edge != NO_EVENT) // A short state section fails the load, nothing gets scheduled from it
+    {
+        events->schedule(event, edge);
+    }
+    else
+    {
+        events->cancel(event);
+    }
+}
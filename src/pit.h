@@ -0,0 +1,55 @@
+#pragma once
+#include "header.h"
+#include "pic.h"
+#include "scheduler.h"
+#include "snapshot.h"
+
+// 8253/8254 programmable interval timer at ports 0x40-0x43.
+// Counters are not stepped, they are worked out from the CPU's cycle counter
+// when read. Channel 0 schedules an event for each rising edge of its output
+// and raises IRQ 0 from it, so nothing polls the timer between edges.
+// Modes 0, 2 and 3 are modelled; the other one shots (1, 4 and 5) behave as
+// mode 0 since there is no gate input, and BCD counting isn't supported.
+
+#define PIT_BASE 0x40
+#define PIT_DIVIDER 4 // CPU clocks per PIT clock, 4.77 MHz / 1.193 MHz
+
+class pit8253
+{
+public:
+    pit8253();
+
+    void connect(scheduler &events, const u64 &clock, pic8259 &pic);
+    void reset();
+
+    Byte inByte(Word port);
+    void outByte(Word port, Byte value);
+
+    void saveState(snapshotWriter &out);
+    void loadState(snapshotReader &in); // After the clock it counts from has been restored
+
+private:
+    struct Channel
+    {
+        Byte mode;
+        Byte access;     // 1 low byte, 2 high byte, 3 low then high
+        bool writeHigh;  // Next write of a low/high pair is the high byte
+        bool readHigh;   // Next read of a low/high pair is the high byte
+        bool latched;
+        bool counting;   // A count has been loaded
+        Word reload;     // 0 counts 65536
+        Word latch;
+        u64 start;       // Clock the count was loaded at
+        u32 event;       // Rising edge of the output, channel 0 only
+    };
+
+    Channel channels[3];
+    scheduler *events;
+    const u64 *clock;
+    pic8259 *pic;
+
+    u32 period(const Channel &channel);
+    Word count(const Channel &channel);
+    void load(int index);
+    static void outputEdge(void *context, u64 when);
+};
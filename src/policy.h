@@ -0,0 +1,47 @@
+#pragma once
+
+// Execution policies for basic_i8086.
+// Each flag decides at compile time whether a feature is built into the core.
+// What a policy leaves out is compiled away with if constexpr, so the fast
+// build pays nothing for instrumentation it doesn't have.
+//
+//   cycles       Clock accounting from the timing tables. Without it the
+//                counter counts instructions, so start() still has a budget.
+//   trace        traceHook is called before every instruction, and recorder
+//                gets every instruction, memory write and interrupt.
+//   checks       Warnings for unimplemented opcodes, dropped writes and
+//                unmapped ports.
+//   breakpoints  execute() stops before an instruction whose physical address
+//                is in breakpoints. Turns the recompiler off.
+
+struct FastPolicy
+{
+    static constexpr bool cycles = false;
+    static constexpr bool trace = false;
+    static constexpr bool checks = false;
+    static constexpr bool breakpoints = false;
+};
+
+struct CycleExactPolicy
+{
+    static constexpr bool cycles = true;
+    static constexpr bool trace = false;
+    static constexpr bool checks = false;
+    static constexpr bool breakpoints = false;
+};
+
+struct TracedPolicy
+{
+    static constexpr bool cycles = true;
+    static constexpr bool trace = true;
+    static constexpr bool checks = false;
+    static constexpr bool breakpoints = false;
+};
+
+struct CheckedPolicy // Everything, for debugging
+{
+    static constexpr bool cycles = true;
+    static constexpr bool trace = true;
+    static constexpr bool checks = true;
+    static constexpr bool breakpoints = true;
+};
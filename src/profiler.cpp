@@ -0,0 +1,128 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+#define LEAF_HALTED (1ull << 32)
+
+sampleProfiler::sampleProfiler()
+    : events(nullptr), clock(nullptr), cs(nullptr), ip(nullptr), halted(nullptr), interval(0), event(0), samples(0)
+{
+}
+
+void sampleProfiler::connect(scheduler &events, const u64 &clock, const Word &cs, const Word &ip, const bool &halted,
+                             u32 interval)
+{
+    if (this->events != &events)
+    {
+        event = events.addEvent(tick, this); // Once per scheduler, events can't be removed
+    }
+    this->events = &events;
+    this->clock = &clock;
+    this->cs = &cs;
+    this->ip = &ip;
+    this->halted = &halted;
+    this->interval = interval ? interval : 1;
+    stack.clear(); // Whatever was running before isn't known
+    events.schedule(event, clock + this->interval);
+}
+
+void sampleProfiler::disconnect()
+{
+    if (events)
+    {
+        events->cancel(event);
+    }
+}
+
+u64 sampleProfiler::getSamples()
+{
+    return samples;
+}
+
+u64 sampleProfiler::leaf()
+{
+    return (*halted ? LEAF_HALTED : 0) | (u32)*cs << 16 | *ip;
+}
+
+void sampleProfiler::take(u64 count)
+{
+    u64 where = leaf();
+    hotspots[where] += count;
+
+    std::vector<u64> key;
+    key.reserve(stack.size() + 1);
+    for (const Frame &frame : stack)
+    {
+        key.push_back(frame.target);
+    }
+    key.push_back(where);
+    stackCounts[key] += count;
+    samples += count;
+}
+
+void sampleProfiler::tick(void *context, u64 when)
+{
+    sampleProfiler *profiler = (sampleProfiler *)context;
+
+    // A long instruction or HLT idling can run past several intervals, the sample stands for all of them
+    u64 count = 1 + (*profiler->clock - when) / profiler->interval;
+    profiler->take(count);
+    profiler->events->schedule(profiler->event, when + count * profiler->interval);
+}
+
+static void printLeaf(FILE *file, u64 leaf)
+{
+    fprintf(file, "%04x:%04x%s", (u32)(leaf >> 16) & 0xFFFF, (u32)leaf & 0xFFFF, leaf & LEAF_HALTED ? "(hlt)" : "");
+}
+
+bool sampleProfiler::writeHotspots(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Can't create profile %s\n", path);
+        return false;
+    }
+
+    std::vector<std::pair<u64, u64>> sorted(hotspots.begin(), hotspots.end());
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<u64, u64> &a, const std::pair<u64, u64> &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+
+    fprintf(file, "# %llu samples, one per %u clocks\n", samples, interval);
+    for (const std::pair<u64, u64> &spot : sorted)
+    {
+        fprintf(file, "%10llu %6.2f%%  ", spot.second, spot.second * 100.0 / samples);
+        printLeaf(file, spot.first);
+        fputc('\n', file);
+    }
+    return fclose(file) == 0;
+}
+
+bool sampleProfiler::writeFolded(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Can't create profile %s\n", path);
+        return false;
+    }
+
+    for (const auto &entry : stackCounts)
+    {
+        const std::vector<u64> &key = entry.first;
+        for (size_t i = 0; i + 1 < key.size(); i++)
+        {
+            u32 vector = key[i] >> 32;
+            if (vector != PROFILE_CALL)
+            {
+                fprintf(file, "int%02x:", vector);
+            }
+            fprintf(file, "%04x:%04x;", (u32)(key[i] >> 16) & 0xFFFF, (u32)key[i] & 0xFFFF);
+        }
+        printLeaf(file, key.back());
+        fprintf(file, " %llu\n", entry.second);
+    }
+    return fclose(file) == 0;
+}
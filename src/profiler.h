@@ -0,0 +1,79 @@
+#pragma once
+#include "header.h"
+#include "scheduler.h"
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+// Sampling profiler for guest code.
+// A scheduler event takes a sample of CS:IP every interval clocks, so the
+// CPU does no work per instruction for it; the sample lands on the
+// instruction boundary the clock had reached. A shadow call stack follows
+// CALL, RET, INT and IRET and is kept with every sample, for folded stacks
+// that flamegraph.pl and similar tools read. Returns pop frames by stack
+// pointer rather than one at a time, so guests that unwind their stack by
+// hand or switch stacks don't leave stale frames behind for long.
+
+#define PROFILE_MAX_DEPTH 256 // Calls deeper than this aren't followed
+#define PROFILE_CALL 0x100    // Frame::vector of a CALL, interrupts have theirs
+
+class sampleProfiler
+{
+public:
+    sampleProfiler();
+
+    void connect(scheduler &events, const u64 &clock, const Word &cs, const Word &ip, const bool &halted, u32 interval);
+    void disconnect(); // Stops sampling, what was taken stays
+
+    /* Called by the CPU with CS:IP at the target and SP below the return address */
+    void enter(u32 vector, Word cs, Word ip, Word sp)
+    {
+        if (stack.size() < PROFILE_MAX_DEPTH)
+        {
+            stack.push_back({(u64)vector << 32 | (u32)cs << 16 | ip, sp});
+        }
+    }
+
+    /* RET and IRET, before the return address comes off the stack */
+    void leave(Word sp)
+    {
+        while (!stack.empty() && stack.back().sp <= sp)
+        {
+            stack.pop_back();
+        }
+    }
+
+    u64 getSamples(); // Taken so far, a sample that stood for several intervals counts for each
+
+    // Text reports, false if the file couldn't be written.
+    // Hot spots are one line per CS:IP with its share of the samples, busiest
+    // first. Folded stacks are one line per distinct stack, frames outermost
+    // first separated by ';', then the sample count.
+    bool writeHotspots(const char *path);
+    bool writeFolded(const char *path);
+
+private:
+    struct Frame
+    {
+        u64 target; // Vector, then CS:IP it went to
+        Word sp;    // With the return address on it
+    };
+
+    scheduler *events;
+    const u64 *clock;
+    const Word *cs;
+    const Word *ip;
+    const bool *halted;
+    u32 interval;
+    u32 event;
+    u64 samples;
+
+    std::vector<Frame> stack;
+    std::unordered_map<u64, u64> hotspots;      // Leaf, see leaf(), to samples
+    std::map<std::vector<u64>, u64> stackCounts; // Frame targets then the leaf, to samples
+
+    u64 leaf(); // CS:IP, with bit 32 set when the CPU is in HLT
+    void take(u64 count);
+    static void tick(void *context, u64 when);
+};
@@ -1,31 +1,50 @@
+#pragma once
 #include "header.h"
 
-// 1 MiB RAM
-#define MEM_SIZE 1024 * 1024
+#include <new>
+#include <sys/mman.h>
+
+// 1 MiB RAM, the 8086's 20-bit address space
+#define ADDRESS_BITS 20
+#define MEM_SIZE (1 << ADDRESS_BITS)
+#define ADDRESS_MASK (MEM_SIZE - 1)
+#define HMA_SIZE 0x10000 // Past the end of RAM, in the same mapping
 
 class memory
 {
 public:
-    Byte data[MEM_SIZE]; // Memory array
+    // Its own anonymous mapping rather than part of the machine, so a snapshot
+    // can be mapped over it with MAP_FIXED. Pages start out zero and only take
+    // host memory once touched.
+    Byte *data; // MEM_SIZE bytes of RAM, then HMA_SIZE for the HMA
 
-    Byte &operator[](Byte index)
+    memory()
     {
-        if (index >= MEM_SIZE)
+        void *mapped = mmap(nullptr, MEM_SIZE + HMA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
         {
-            printf("Memory access error: address %x out of range\n", index);
-            return data[0];
+            throw std::bad_alloc();
         }
-        return data[index];
+        data = (Byte *)mapped;
+    }
+
+    ~memory()
+    {
+        munmap(data, MEM_SIZE + HMA_SIZE);
+    }
+
+    memory(const memory &) = delete;
+    memory &operator=(const memory &) = delete;
+
+    // Addresses wrap at 1 MiB like they do on the bus
+    Byte &operator[](u32 index)
+    {
+        return data[index & ADDRESS_MASK];
     }
 
     // Const version of operator[] for read-only access
-    const Byte &operator[](Byte index) const
+    const Byte &operator[](u32 index) const
     {
-        if (index >= MEM_SIZE)
-        {
-            printf("Constant memory access error: address %x out of range\n", index);
-            return data[0];
-        }
-        return data[index];
+        return data[index & ADDRESS_MASK];
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,122 @@
+#include "rom.h"
+#include "memmap.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+romImage::romImage() : data(nullptr), size(0), base(0), mapping(nullptr)
+{
+}
+
+romImage::~romImage()
+{
+    release();
+}
+
+void romImage::release()
+{
+    if (mapping)
+    {
+        munmap(mapping, size);
+        mapping = nullptr;
+    }
+    buffer.clear();
+    data = nullptr;
+    size = 0;
+}
+
+/* Rounds size up to whole pages and works out where it goes, false if that isn't somewhere a ROM can be */
+bool romImage::place(u32 size, u32 base, const char *name)
+{
+    u32 pages = (size + PAGE_MASK) & ~PAGE_MASK;
+    if (!base && pages <= BIOS_TOP)
+    {
+        base = BIOS_TOP - pages;
+    }
+    if (!size || (base & PAGE_MASK) || base + pages > BIOS_TOP)
+    {
+        fprintf(stderr, "Error: ROM %s of %u bytes doesn't fit at %05x\n", name, size, base);
+        return false;
+    }
+    this->size = pages;
+    this->base = base;
+    return true;
+}
+
+bool romImage::load(const char *path, u32 base)
+{
+    release();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Can't open ROM %s\n", path);
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !place(info.st_size, base, path))
+    {
+        close(fd);
+        return false;
+    }
+
+    // The tail of the last page past the end of the file reads as 0
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Can't map ROM %s\n", path);
+        size = 0;
+        return false;
+    }
+    mapping = mapped;
+    data = (const Byte *)mapped;
+    return true;
+}
+
+bool romImage::set(const Byte *data, u32 size, u32 base)
+{
+    release();
+    if (size & PAGE_MASK)
+    {
+        fprintf(stderr, "Error: ROM at %p isn't whole pages, copy() it instead\n", data);
+        return false;
+    }
+    if (!place(size, base, "in memory"))
+    {
+        return false;
+    }
+    this->data = data;
+    return true;
+}
+
+bool romImage::copy(const Byte *data, u32 size, u32 base)
+{
+    release();
+    if (!place(size, base, "in memory"))
+    {
+        return false;
+    }
+    buffer.assign(this->size, 0);
+    memcpy(buffer.data(), data, size);
+    this->data = buffer.data();
+    return true;
+}
+
+const Byte *romImage::getData() const
+{
+    return data;
+}
+
+u32 romImage::getSize() const
+{
+    return size;
+}
+
+u32 romImage::getBase() const
+{
+    return base;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "header.h"
+
+#include <vector>
+
+// A BIOS or option ROM, loaded once and mapped read only into any number of
+// machines with i8086::attachRom(). Machines map its pages directly, nothing
+// is copied per machine, so it has to outlive every machine it is attached to.
+// Images are padded up to whole pages, which read as 0 past the end.
+
+#define BIOS_TOP 0x100000 // A BIOS ends here, its last 16 bytes hold the reset vector
+
+class romImage
+{
+public:
+    romImage();
+    ~romImage();
+
+    bool load(const char *path, u32 base = 0);      // mmap'd from the file; base 0 puts it right below BIOS_TOP
+    bool set(const Byte *data, u32 size, u32 base); // Memory that outlives it, such as an array compiled in
+    bool copy(const Byte *data, u32 size, u32 base); // Its own copy
+
+    const Byte *getData() const;
+    u32 getSize() const; // Whole pages
+    u32 getBase() const;
+
+private:
+    const Byte *data;
+    u32 size;
+    u32 base;
+    void *mapping;            // From load()
+    std::vector<Byte> buffer; // From copy()
+
+    void release();
+    bool place(u32 size, u32 base, const char *name);
+};
@@ -0,0 +1,121 @@
+#include "scheduler.h"
+
+scheduler::scheduler() : sliceEnd(NO_EVENT)
+{
+}
+
+u32 scheduler::addEvent(EventCallback callback, void *context)
+{
+    events.push_back({callback, context, 0, false, NO_EVENT});
+    return events.size() - 1;
+}
+
+void scheduler::schedule(u32 event, u64 when)
+{
+    EventSlot &slot = events[event];
+    slot.version++;
+    slot.pending = true;
+    slot.when = when;
+    push({when, event, slot.version});
+
+    if (when < sliceEnd)
+    {
+        sliceEnd = when; // Due before the CPU would come back, cut the slice short
+    }
+}
+
+void scheduler::cancel(u32 event)
+{
+    events[event].version++;
+    events[event].pending = false;
+}
+
+bool scheduler::isPending(u32 event)
+{
+    return events[event].pending;
+}
+
+u64 scheduler::deadline(u32 event)
+{
+    return events[event].pending ? events[event].when : NO_EVENT;
+}
+
+u64 scheduler::nextDeadline()
+{
+    while (!heap.empty() && isStale(heap[0]))
+    {
+        pop();
+    }
+    return heap.empty() ? NO_EVENT : heap[0].when;
+}
+
+void scheduler::runDue(u64 now)
+{
+    while (nextDeadline() <= now)
+    {
+        HeapEntry entry = heap[0];
+        pop();
+
+        EventSlot &slot = events[entry.event];
+        slot.pending = false;
+        slot.callback(slot.context, entry.when); // Can schedule again, even for a clock that is already due
+    }
+}
+
+bool scheduler::isStale(const HeapEntry &entry)
+{
+    return entry.version != events[entry.event].version;
+}
+
+/* Ordered on when, ties go to the event registered first so the order is deterministic */
+static bool earlier(u64 aWhen, u32 aEvent, u64 bWhen, u32 bEvent)
+{
+    return aWhen < bWhen || (aWhen == bWhen && aEvent < bEvent);
+}
+
+void scheduler::push(const HeapEntry &entry)
+{
+    heap.push_back(entry);
+    size_t i = heap.size() - 1;
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (!earlier(heap[i].when, heap[i].event, heap[parent].when, heap[parent].event))
+        {
+            break;
+        }
+        HeapEntry swap = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = swap;
+        i = parent;
+    }
+}
+
+void scheduler::pop()
+{
+    heap[0] = heap.back();
+    heap.pop_back();
+
+    size_t i = 0;
+    while (true)
+    {
+        size_t smallest = i;
+        size_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < heap.size() && earlier(heap[left].when, heap[left].event, heap[smallest].when, heap[smallest].event))
+        {
+            smallest = left;
+        }
+        if (right < heap.size() && earlier(heap[right].when, heap[right].event, heap[smallest].when, heap[smallest].event))
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            break;
+        }
+        HeapEntry swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "header.h"
+
+#include <vector>
+
+// Device events keyed by absolute cycle count.
+// Devices register an event once and (re)schedule it for the clock they next
+// need attention at. The CPU runs uninterrupted up to sliceEnd, which is the
+// earliest pending event, and services whatever came due between slices, so
+// nothing polls devices per instruction. Pending events sit in a binary
+// min-heap; rescheduling or cancelling leaves the old heap entry behind,
+// stale entries are recognised by their version and skipped.
+
+#define NO_EVENT 0xFFFFFFFFFFFFFFFFull // nextDeadline() when nothing is pending
+
+using EventCallback = void (*)(void *context, u64 when); // when is the clock it was scheduled for
+
+class scheduler
+{
+public:
+    u64 sliceEnd; // The CPU returns to the scheduler once the cycle counter reaches this
+
+    scheduler();
+
+    u32 addEvent(EventCallback callback, void *context);
+    void schedule(u32 event, u64 when); // Replaces the pending one, if any
+    void cancel(u32 event);
+    bool isPending(u32 event);
+    u64 deadline(u32 event); // When it is due, NO_EVENT if it isn't pending
+
+    u64 nextDeadline();
+    void runDue(u64 now); // Calls everything due at or before now, earliest first
+
+private:
+    struct EventSlot
+    {
+        EventCallback callback;
+        void *context;
+        u32 version; // Bumped on every schedule() and cancel()
+        bool pending;
+        u64 when;
+    };
+
+    struct HeapEntry
+    {
+        u64 when;
+        u32 event;
+        u32 version;
+    };
+
+    std::vector<EventSlot> events;
+    std::vector<HeapEntry> heap;
+
+    void push(const HeapEntry &entry);
+    void pop();
+    bool isStale(const HeapEntry &entry);
+};
@@ -0,0 +1,268 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static u64 alignSection(u64 offset)
+{
+    return (offset + SNAPSHOT_ALIGN - 1) & ~(u64)(SNAPSHOT_ALIGN - 1);
+}
+
+snapshotWriter::snapshotWriter() : data(), size()
+{
+}
+
+void snapshotWriter::addSection(SnapshotSection section, const Byte *data, u64 size)
+{
+    this->data[section] = data;
+    this->size[section] = size;
+}
+
+bool snapshotWriter::write(const char *path)
+{
+    data[SECTION_STATE] = state.data();
+    size[SECTION_STATE] = state.size();
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    u64 offset = alignSection(sizeof(header));
+    for (int i = 0; i < SECTION_COUNT; i++)
+    {
+        header.sections[i].offset = offset;
+        header.sections[i].size = size[i];
+        offset = alignSection(offset + size[i]);
+    }
+
+    // Written next to it and renamed over it, machines running from a mapping of the old file keep seeing the old one
+    std::string temporary = std::string(path) + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Can't create snapshot %s\n", temporary.c_str());
+        return false;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; i < SECTION_COUNT && written; i++)
+    {
+        written = fseek(file, header.sections[i].offset, SEEK_SET) == 0 &&
+                  fwrite(data[i], 1, size[i], file) == size[i];
+    }
+    written = fclose(file) == 0 && written;
+
+    if (!written || rename(temporary.c_str(), path) != 0)
+    {
+        fprintf(stderr, "Error: Failed writing snapshot %s\n", path);
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+snapshotReader::snapshotReader() : fd(-1), path(nullptr), header(), state(nullptr), stateSize(0), position(0), failed(false)
+{
+}
+
+snapshotReader::~snapshotReader()
+{
+    if (fd >= 0)
+    {
+        close(fd); // Mappings made by loadSection() stay valid
+    }
+}
+
+/* pread() until everything is in, it can come back short */
+static bool readAt(int fd, Byte *buffer, u64 size, u64 offset)
+{
+    while (size)
+    {
+        ssize_t done = pread(fd, buffer, size, offset);
+        if (done <= 0)
+        {
+            return false;
+        }
+        buffer += done;
+        offset += done;
+        size -= done;
+    }
+    return true;
+}
+
+static bool checkHeader(const SnapshotHeader &header, const char *path)
+{
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "Error: %s is not a snapshot\n", path);
+        return false;
+    }
+    if (header.version != SNAPSHOT_VERSION || header.byteOrder != SNAPSHOT_BYTE_ORDER)
+    {
+        fprintf(stderr, "Error: Snapshot %s is version %u/%08x, this build reads %u/%08x\n", path, header.version,
+                header.byteOrder, SNAPSHOT_VERSION, SNAPSHOT_BYTE_ORDER);
+        return false;
+    }
+    return true;
+}
+
+bool snapshotReader::open(const char *path)
+{
+    this->path = path;
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Can't open snapshot %s\n", path);
+        return false;
+    }
+
+    if (!readAt(fd, (Byte *)&header, sizeof(header), 0))
+    {
+        fprintf(stderr, "Error: %s is not a snapshot\n", path);
+        return false;
+    }
+    if (!checkHeader(header, path))
+    {
+        return false;
+    }
+
+    buffer.resize(header.sections[SECTION_STATE].size);
+    if (!readAt(fd, buffer.data(), buffer.size(), header.sections[SECTION_STATE].offset))
+    {
+        fprintf(stderr, "Error: Snapshot %s is truncated\n", path);
+        return false;
+    }
+    state = buffer.data();
+    stateSize = buffer.size();
+    position = 0;
+    failed = false;
+    return true;
+}
+
+void snapshotReader::open(const snapshotImage &image)
+{
+    path = image.getPath();
+    state = image.section(SECTION_STATE);
+    stateSize = image.sectionSize(SECTION_STATE);
+    position = 0;
+    failed = false;
+}
+
+bool snapshotReader::checkSize(SnapshotSection section, u64 size)
+{
+    if (header.sections[section].size != size)
+    {
+        fprintf(stderr, "Error: Snapshot %s section %d is %llu bytes, expected %llu\n", path, section,
+                header.sections[section].size, size);
+        return false;
+    }
+    return true;
+}
+
+bool snapshotReader::loadSection(SnapshotSection section, Byte *host, u64 size)
+{
+    if (!checkSize(section, size))
+    {
+        return false;
+    }
+
+    // Private mapping over the existing memory, pages fault in from the file as they are touched
+    u64 offset = header.sections[section].offset;
+    u64 pageMask = sysconf(_SC_PAGESIZE) - 1;
+    if (((uintptr_t)host & pageMask) == 0 && (offset & pageMask) == 0 && (size & pageMask) == 0)
+    {
+        void *mapped = mmap(host, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+        if (mapped != MAP_FAILED)
+        {
+            return true;
+        }
+    }
+    return readSection(section, host, size);
+}
+
+bool snapshotReader::readSection(SnapshotSection section, Byte *host, u64 size)
+{
+    if (!checkSize(section, size))
+    {
+        return false;
+    }
+
+    if (!readAt(fd, host, size, header.sections[section].offset))
+    {
+        fprintf(stderr, "Error: Snapshot %s is truncated\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool snapshotReader::ok()
+{
+    return !failed && position == stateSize;
+}
+
+snapshotImage::snapshotImage() : path(nullptr), mapping(nullptr), mappingSize(0)
+{
+}
+
+snapshotImage::~snapshotImage()
+{
+    if (mapping)
+    {
+        munmap(mapping, mappingSize);
+    }
+}
+
+bool snapshotImage::open(const char *path)
+{
+    this->path = path;
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Can't open snapshot %s\n", path);
+        return false;
+    }
+
+    off_t size = lseek(fd, 0, SEEK_END);
+    void *mapped = size >= (off_t)sizeof(SnapshotHeader) ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd); // The mapping keeps the file
+    if (mapped == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Can't map snapshot %s\n", path);
+        return false;
+    }
+    mapping = (Byte *)mapped;
+    mappingSize = size;
+
+    const SnapshotHeader &header = *(const SnapshotHeader *)mapping;
+    if (!checkHeader(header, path))
+    {
+        return false;
+    }
+    for (int i = 0; i < SECTION_COUNT; i++)
+    {
+        if (header.sections[i].offset + header.sections[i].size > mappingSize)
+        {
+            fprintf(stderr, "Error: Snapshot %s is truncated\n", path);
+            return false;
+        }
+    }
+    return true;
+}
+
+const Byte *snapshotImage::section(SnapshotSection section) const
+{
+    return mapping + ((const SnapshotHeader *)mapping)->sections[section].offset;
+}
+
+u64 snapshotImage::sectionSize(SnapshotSection section) const
+{
+    return ((const SnapshotHeader *)mapping)->sections[section].size;
+}
+
+const char *snapshotImage::getPath() const
+{
+    return path;
+}
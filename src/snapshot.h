@@ -0,0 +1,123 @@
+#pragma once
+#include "header.h"
+
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+// Machine snapshot files, see i8086::saveSnapshot().
+// A fixed header, then one section per part of the machine. Every section
+// starts at a SNAPSHOT_ALIGN boundary of the file so the memory sections can
+// be mmap'd privately straight over guest memory when loading: pages are only
+// read from the file when the guest touches them, and copied when it writes.
+// Values are in host byte order, byteOrder tells a foreign snapshot apart.
+
+#define SNAPSHOT_MAGIC "X86SNAP" // Plus the terminating 0, 8 bytes
+#define SNAPSHOT_VERSION 2       // Bump whenever the layout of any section changes
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_ALIGN 0x10000 // Covers host pages up to 64 KiB
+
+/* Sections, in file order */
+enum SnapshotSection
+{
+    SECTION_STATE, // Registers, clocks and device state, written with snapshotWriter::put()
+    SECTION_RAM,
+    SECTION_ROM,
+    SECTION_HMA,
+    SECTION_COUNT,
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    u32 version;
+    u32 byteOrder;
+    struct
+    {
+        u64 offset;
+        u64 size;
+    } sections[SECTION_COUNT];
+};
+
+class snapshotWriter
+{
+public:
+    snapshotWriter();
+
+    template <class T>
+    void put(const T &value) // Appended to the state section
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot values are copied as bytes");
+        const Byte *bytes = (const Byte *)&value;
+        state.insert(state.end(), bytes, bytes + sizeof(T));
+    }
+
+    void addSection(SnapshotSection section, const Byte *data, u64 size); // Written as is by write()
+    bool write(const char *path);
+
+private:
+    std::vector<Byte> state;
+    const Byte *data[SECTION_COUNT];
+    u64 size[SECTION_COUNT];
+};
+
+// A snapshot mapped read-only once, for any number of machines to fork from,
+// see i8086::fork(). The mapping is shared, so forks don't copy anything until
+// they write. It has to outlive every machine forked from it.
+class snapshotImage
+{
+public:
+    snapshotImage();
+    ~snapshotImage();
+
+    bool open(const char *path);
+    const Byte *section(SnapshotSection section) const;
+    u64 sectionSize(SnapshotSection section) const;
+    const char *getPath() const;
+
+private:
+    const char *path;
+    Byte *mapping;
+    u64 mappingSize;
+};
+
+class snapshotReader
+{
+public:
+    snapshotReader();
+    ~snapshotReader();
+
+    bool open(const char *path);           // Checks the header and reads the state section
+    void open(const snapshotImage &image); // State section of an image, nothing is read
+
+    template <class T>
+    void get(T &value) // Next value of the state section, in the order they were put()
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot values are copied as bytes");
+        if (position + sizeof(T) > stateSize)
+        {
+            failed = true;
+            return;
+        }
+        memcpy(&value, state + position, sizeof(T));
+        position += sizeof(T);
+    }
+
+    // Maps the section over host when it can, reads it otherwise. host must be
+    // inside an mmap'd region the caller owns, like memory::data, never the heap
+    bool loadSection(SnapshotSection section, Byte *host, u64 size);
+    bool readSection(SnapshotSection section, Byte *host, u64 size); // Always reads it
+    bool ok();                                                       // Nothing ran past the end of the state section
+
+private:
+    int fd;
+    const char *path;
+    SnapshotHeader header;
+    std::vector<Byte> buffer; // State section read from the file
+    const Byte *state;
+    size_t stateSize;
+    size_t position;
+    bool failed;
+
+    bool checkSize(SnapshotSection section, u64 size);
+};
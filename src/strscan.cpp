@@ -0,0 +1,109 @@
+#include "strscan.h"
+#include "memmap.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Lane mask of the elements that stop the scan, 1 bit per byte as movemask gives it */
+static inline u32 stopLanes(u32 equalLanes, u32 allLanes, bool stopOnEqual)
+{
+    return stopOnEqual ? equalLanes : ~equalLanes & allLanes;
+}
+
+u32 scanElements(const Byte *p, u32 n, bool isWord, bool backward, Word value, bool stopOnEqual)
+{
+    u32 size = isWord ? 2 : 1;
+    u32 i = 0;
+
+    if (!backward)
+    {
+#ifdef __AVX2__
+        __m256i needle = isWord ? _mm256_set1_epi16((short)value) : _mm256_set1_epi8((char)value);
+        for (; i + 32 / size <= n; i += 32 / size)
+        {
+            __m256i data = _mm256_loadu_si256((const __m256i *)(p + i * size));
+            __m256i equal = isWord ? _mm256_cmpeq_epi16(data, needle) : _mm256_cmpeq_epi8(data, needle);
+            u32 lanes = stopLanes(_mm256_movemask_epi8(equal), 0xFFFFFFFF, stopOnEqual);
+            if (lanes)
+            {
+                return i + __builtin_ctz(lanes) / size;
+            }
+        }
+#endif
+#ifdef __SSE2__
+        __m128i needle16 = isWord ? _mm_set1_epi16((short)value) : _mm_set1_epi8((char)value);
+        for (; i + 16 / size <= n; i += 16 / size)
+        {
+            __m128i data = _mm_loadu_si128((const __m128i *)(p + i * size));
+            __m128i equal = isWord ? _mm_cmpeq_epi16(data, needle16) : _mm_cmpeq_epi8(data, needle16);
+            u32 lanes = stopLanes(_mm_movemask_epi8(equal), 0xFFFF, stopOnEqual);
+            if (lanes)
+            {
+                return i + __builtin_ctz(lanes) / size;
+            }
+        }
+#endif
+    }
+
+    // What's left, and everything going backward
+    for (; i < n; i++)
+    {
+        const Byte *element = backward ? p - i * size : p + i * size;
+        Word data = isWord ? loadWord(element) : *element;
+        if ((data == value) == stopOnEqual)
+        {
+            return i;
+        }
+    }
+    return n;
+}
+
+u32 compareElements(const Byte *a, const Byte *b, u32 n, bool isWord, bool backward, bool stopOnEqual)
+{
+    u32 size = isWord ? 2 : 1;
+    u32 i = 0;
+
+    if (!backward)
+    {
+#ifdef __AVX2__
+        for (; i + 32 / size <= n; i += 32 / size)
+        {
+            __m256i left = _mm256_loadu_si256((const __m256i *)(a + i * size));
+            __m256i right = _mm256_loadu_si256((const __m256i *)(b + i * size));
+            __m256i equal = isWord ? _mm256_cmpeq_epi16(left, right) : _mm256_cmpeq_epi8(left, right);
+            u32 lanes = stopLanes(_mm256_movemask_epi8(equal), 0xFFFFFFFF, stopOnEqual);
+            if (lanes)
+            {
+                return i + __builtin_ctz(lanes) / size;
+            }
+        }
+#endif
+#ifdef __SSE2__
+        for (; i + 16 / size <= n; i += 16 / size)
+        {
+            __m128i left = _mm_loadu_si128((const __m128i *)(a + i * size));
+            __m128i right = _mm_loadu_si128((const __m128i *)(b + i * size));
+            __m128i equal = isWord ? _mm_cmpeq_epi16(left, right) : _mm_cmpeq_epi8(left, right);
+            u32 lanes = stopLanes(_mm_movemask_epi8(equal), 0xFFFF, stopOnEqual);
+            if (lanes)
+            {
+                return i + __builtin_ctz(lanes) / size;
+            }
+        }
+#endif
+    }
+
+    for (; i < n; i++)
+    {
+        u32 offset = i * size;
+        const Byte *left = backward ? a - offset : a + offset;
+        const Byte *right = backward ? b - offset : b + offset;
+        bool equal = isWord ? loadWord(left) == loadWord(right) : *left == *right;
+        if (equal == stopOnEqual)
+        {
+            return i;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "header.h"
+
+// Search kernels for REP SCAS/CMPS over host memory.
+// Elements are bytes or little endian words, packed back to back. Going
+// backward, element i is at p - i * size. Both return the index of the first
+// element where the compare came out equal == stopOnEqual, or n if none did.
+// Forward scans use SSE2/AVX2 when the compiler has them enabled.
+
+u32 scanElements(const Byte *p, u32 n, bool isWord, bool backward, Word value, bool stopOnEqual);
+u32 compareElements(const Byte *a, const Byte *b, u32 n, bool isWord, bool backward, bool stopOnEqual);
@@ -0,0 +1,271 @@
+#include "trace.h"
+
+#include <chrono>
+
+const char *const traceRegisterNames[TRACE_REGISTERS] = {"AX", "BX", "CX", "DX", "SI", "DI", "BP",
+                                                         "SP", "CS", "DS", "ES", "SS", "IP", "FL"};
+
+traceRecorder::traceRecorder()
+    : ring(nullptr), head(0), knownRead(0), written(0), read(0), stopping(false), file(nullptr), failed(false), last(),
+      lastLength(0), lastWrite(0), full(true)
+{
+}
+
+traceRecorder::~traceRecorder()
+{
+    close();
+}
+
+bool traceRecorder::open(const char *path)
+{
+    close();
+    file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Can't create trace %s\n", path);
+        return false;
+    }
+    u32 version = TRACE_VERSION;
+    fwrite(TRACE_MAGIC, 1, 8, file);
+    fwrite(&version, sizeof(version), 1, file);
+
+    ring = new Byte[TRACE_RING_SIZE + TRACE_MAX_RECORD];
+    head = knownRead = 0;
+    written = 0;
+    read = 0;
+    stopping = false;
+    failed = false;
+    lastLength = 0;
+    lastWrite = 0;
+    full = true;
+    writer = std::thread(&traceRecorder::drain, this);
+    return true;
+}
+
+bool traceRecorder::close()
+{
+    if (!file)
+    {
+        return true;
+    }
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+    bool ok = !failed && fclose(file) == 0;
+    if (!ok)
+    {
+        fprintf(stderr, "Error: Trace couldn't be written completely\n");
+    }
+    file = nullptr;
+    delete[] ring;
+    ring = nullptr;
+    return ok;
+}
+
+void traceRecorder::waitForRoom(u32 size)
+{
+    // The writer is behind, nothing to do but let it catch up
+    while (head + size - (knownRead = read.load(std::memory_order_acquire)) > TRACE_RING_SIZE)
+    {
+        std::this_thread::yield();
+    }
+}
+
+void traceRecorder::block(u32 physicalAddress, const Byte *data, u32 size)
+{
+    while (size)
+    {
+        u32 chunk = size < TRACE_BLOCK_CHUNK ? size : TRACE_BLOCK_CHUNK;
+        Byte *start = reserve(TRACE_MAX_RECORD);
+        start[0] = TRACE_BLOCK;
+        Byte *out = putAddress(start + 1, physicalAddress, chunk);
+        *out++ = chunk & 0xFF;
+        *out++ = chunk >> 8;
+        memcpy(out, data, chunk);
+        commit(out + chunk - start);
+        physicalAddress += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+/* Writer thread, streams whatever the CPU published to the file */
+void traceRecorder::drain()
+{
+    u64 position = 0;
+    while (true)
+    {
+        bool finishing = stopping.load(std::memory_order_acquire); // Looked at first, so nothing published before it is missed
+        u64 end = written.load(std::memory_order_acquire);
+        if (end == position)
+        {
+            if (finishing)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+
+        // Up to the end of the ring, the rest goes on the next round
+        u32 offset = position & (TRACE_RING_SIZE - 1);
+        u64 size = end - position;
+        if (offset + size > TRACE_RING_SIZE)
+        {
+            size = TRACE_RING_SIZE - offset;
+        }
+        if (fwrite(ring + offset, 1, size, file) != size)
+        {
+            failed = true; // Keep consuming so the CPU never waits on a dead writer
+        }
+        position += size;
+        read.store(position, std::memory_order_release);
+    }
+    if (fflush(file) != 0)
+    {
+        failed = true;
+    }
+}
+
+traceReader::traceReader() : file(nullptr), registers(), lastLength(0), lastWrite(0)
+{
+}
+
+traceReader::~traceReader()
+{
+    if (file)
+    {
+        fclose(file);
+    }
+}
+
+bool traceReader::open(const char *path)
+{
+    file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Can't open trace %s\n", path);
+        return false;
+    }
+    char magic[8];
+    u32 version = 0;
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 || fread(&version, sizeof(version), 1, file) != 1)
+    {
+        fprintf(stderr, "Error: %s is no trace file\n", path);
+        return false;
+    }
+    if (version != TRACE_VERSION)
+    {
+        fprintf(stderr, "Error: %s is trace version %u, expected %u\n", path, version, TRACE_VERSION);
+        return false;
+    }
+    return true;
+}
+
+bool traceReader::getAddress(u32 size, u32 &address)
+{
+    u32 value = 0;
+    for (u32 shift = 0; shift < 35; shift += 7)
+    {
+        int c = getc(file);
+        if (c == EOF)
+        {
+            return false;
+        }
+        value |= (u32)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+        {
+            int delta = (int)(value >> 1) ^ -(int)(value & 1);
+            address = lastWrite + delta;
+            lastWrite = address + size;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool traceReader::next(TraceEvent &event)
+{
+    int type = file ? getc(file) : EOF;
+    if (type == EOF)
+    {
+        return false;
+    }
+    event.type = type;
+
+    Byte bytes[2];
+    switch (type)
+    {
+    case TRACE_STEP:
+    {
+        if (fread(bytes, 1, 2, file) != 2)
+        {
+            return false;
+        }
+        event.changed = bytes[0] | bytes[1] << 8;
+        registers[TRACE_IP] += lastLength;
+        for (u32 i = 0; i < TRACE_REGISTERS; i++)
+        {
+            if (event.changed & (1 << i))
+            {
+                if (fread(bytes, 1, 2, file) != 2)
+                {
+                    return false;
+                }
+                registers[i] = bytes[0] | bytes[1] << 8;
+            }
+        }
+        int length = getc(file);
+        if (length == EOF || length > TRACE_MAX_CODE || fread(event.code, 1, length, file) != (size_t)length)
+        {
+            return false;
+        }
+        event.length = lastLength = length;
+        break;
+    }
+    case TRACE_WRITE8:
+        event.length = 1;
+        if (!getAddress(1, event.address) || fread(event.data, 1, 1, file) != 1)
+        {
+            return false;
+        }
+        break;
+    case TRACE_WRITE16:
+        event.length = 2;
+        if (!getAddress(2, event.address) || fread(event.data, 1, 2, file) != 2)
+        {
+            return false;
+        }
+        break;
+    case TRACE_BLOCK:
+    {
+        u32 address; // Comes before the length, which moves lastWrite on afterwards
+        if (!getAddress(0, address) || fread(bytes, 1, 2, file) != 2)
+        {
+            return false;
+        }
+        event.address = address;
+        event.length = bytes[0] | bytes[1] << 8;
+        if (event.length > TRACE_BLOCK_CHUNK || fread(event.data, 1, event.length, file) != event.length)
+        {
+            return false;
+        }
+        lastWrite = address + event.length;
+        break;
+    }
+    case TRACE_INTERRUPT:
+    {
+        int vector = getc(file);
+        if (vector == EOF)
+        {
+            return false;
+        }
+        event.vector = vector;
+        break;
+    }
+    default:
+        fprintf(stderr, "Error: Unknown trace record %02x\n", type);
+        return false;
+    }
+    memcpy(event.registers, registers, sizeof(registers));
+    return true;
+}
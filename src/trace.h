@@ -0,0 +1,210 @@
+#pragma once
+#include "header.h"
+
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+// Binary instruction trace, for cores built with Policy::trace.
+// Every instruction adds a record to a ring buffer in memory: the registers
+// that differ from the last record, CS:IP only when it isn't the next
+// instruction, and the opcode bytes. Memory writes and interrupts in between
+// get records of their own, with addresses as deltas from the last write.
+// The CPU thread is the only producer and a writer thread the only consumer,
+// so the ring needs no locks, just the two positions. When the writer falls
+// behind the CPU waits for it rather than dropping records. tracedump turns a
+// trace file back into text.
+
+#define TRACE_MAGIC "X86TRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE (1 << 22) // Bytes, a power of 2
+#define TRACE_MAX_CODE 15         // Opcode bytes kept, longer runs of prefixes are cut
+#define TRACE_BLOCK_CHUNK 256     // Bytes per TRACE_BLOCK record
+#define TRACE_MAX_RECORD (TRACE_BLOCK_CHUNK + 16)
+
+/* Record types, the first byte of every record */
+#define TRACE_STEP 0x01      // u16 register mask, the registers in it, length, opcode bytes
+#define TRACE_WRITE8 0x02    // Address delta, value
+#define TRACE_WRITE16 0x03   // Address delta, value low then high
+#define TRACE_BLOCK 0x04     // Address delta, length, the bytes; DMA from a device
+#define TRACE_INTERRUPT 0x05 // Vector
+
+/* Registers in TRACE_STEP order, bit n of the mask is register n */
+enum TraceRegister : Byte
+{
+    TRACE_AX,
+    TRACE_BX,
+    TRACE_CX,
+    TRACE_DX,
+    TRACE_SI,
+    TRACE_DI,
+    TRACE_BP,
+    TRACE_SP,
+    TRACE_CS,
+    TRACE_DS,
+    TRACE_ES,
+    TRACE_SS,
+    TRACE_IP,
+    TRACE_FLAGS,
+    TRACE_REGISTERS
+};
+
+extern const char *const traceRegisterNames[TRACE_REGISTERS];
+
+class traceRecorder
+{
+public:
+    traceRecorder();
+    ~traceRecorder();
+
+    bool open(const char *path); // Starts the writer thread
+    bool close();                // Waits for the ring to drain; false if the file couldn't be written
+
+    /* Called by the CPU, see i8086::fetchInstruction() */
+    void step(const Word *registers, const Byte *code, u32 length)
+    {
+        Byte *start = reserve(TRACE_MAX_RECORD);
+        Byte *out = start + 3;
+        u32 mask = 0;
+        Word nextIP = last[TRACE_IP] + lastLength;
+        for (u32 i = 0; i < TRACE_REGISTERS; i++)
+        {
+            // IP is only there when the previous instruction didn't fall through to this one
+            bool changed = i == TRACE_IP ? registers[i] != nextIP : registers[i] != last[i];
+            if (changed || full)
+            {
+                mask |= 1 << i;
+                out[0] = registers[i] & 0xFF;
+                out[1] = registers[i] >> 8;
+                out += 2;
+            }
+            last[i] = registers[i];
+        }
+        length = length < TRACE_MAX_CODE ? length : TRACE_MAX_CODE;
+        *out++ = length;
+        memcpy(out, code, length);
+        out += length;
+
+        start[0] = TRACE_STEP;
+        start[1] = mask & 0xFF;
+        start[2] = mask >> 8;
+        lastLength = length;
+        full = false;
+        commit(out - start);
+    }
+
+    void write8(u32 physicalAddress, Byte value)
+    {
+        Byte *start = reserve(TRACE_MAX_RECORD);
+        start[0] = TRACE_WRITE8;
+        Byte *out = putAddress(start + 1, physicalAddress, 1);
+        *out++ = value;
+        commit(out - start);
+    }
+
+    void write16(u32 physicalAddress, Word value)
+    {
+        Byte *start = reserve(TRACE_MAX_RECORD);
+        start[0] = TRACE_WRITE16;
+        Byte *out = putAddress(start + 1, physicalAddress, 2);
+        *out++ = value & 0xFF;
+        *out++ = value >> 8;
+        commit(out - start);
+    }
+
+    void interrupt(Byte vector)
+    {
+        Byte *start = reserve(TRACE_MAX_RECORD);
+        start[0] = TRACE_INTERRUPT;
+        start[1] = vector;
+        commit(2);
+    }
+
+    void block(u32 physicalAddress, const Byte *data, u32 size); // Written to guest memory by a device
+
+private:
+    Byte *ring; // TRACE_RING_SIZE, then TRACE_MAX_RECORD for records running past the end
+    u64 head;   // Producer's own position, published to written after each record
+    u64 knownRead; // Producer's last look at read, refreshed only when the ring seems full
+    alignas(64) std::atomic<u64> written;
+    alignas(64) std::atomic<u64> read;
+    std::atomic<bool> stopping;
+    std::thread writer;
+    FILE *file;
+    bool failed;
+
+    Word last[TRACE_REGISTERS];
+    u32 lastLength; // Of the last instruction, where IP goes if nothing jumps
+    u32 lastWrite;  // Address after the last write, writes are mostly sequential
+    bool full;      // Next step has every register, the decoder starts from nothing
+
+    Byte *reserve(u32 size)
+    {
+        if (head + size - knownRead > TRACE_RING_SIZE)
+        {
+            waitForRoom(size);
+        }
+        return ring + (head & (TRACE_RING_SIZE - 1));
+    }
+
+    void commit(u32 size)
+    {
+        u32 position = head & (TRACE_RING_SIZE - 1);
+        if (position + size > TRACE_RING_SIZE)
+        {
+            memcpy(ring, ring + TRACE_RING_SIZE, position + size - TRACE_RING_SIZE); // Wrap what ran into the slack
+        }
+        head += size;
+        written.store(head, std::memory_order_release);
+    }
+
+    /* Zigzag varint of the distance from the last write */
+    Byte *putAddress(Byte *out, u32 physicalAddress, u32 size)
+    {
+        int delta = (int)(physicalAddress - lastWrite);
+        u32 value = ((u32)delta << 1) ^ (u32)(delta >> 31);
+        while (value >= 0x80)
+        {
+            *out++ = value | 0x80;
+            value >>= 7;
+        }
+        *out++ = value;
+        lastWrite = physicalAddress + size;
+        return out;
+    }
+
+    void waitForRoom(u32 size);
+    void drain();
+};
+
+/* One record of a trace file, with the registers as of the last step */
+struct TraceEvent
+{
+    Byte type;                       // TRACE_*
+    Word registers[TRACE_REGISTERS]; // Every register, not only the ones in the record
+    u32 changed;                     // Registers in the record, TRACE_STEP only
+    Byte code[TRACE_MAX_CODE];
+    u32 length;  // Of code or data
+    u32 address; // Physical, for writes and blocks
+    Byte data[TRACE_BLOCK_CHUNK];
+    Byte vector;
+};
+
+class traceReader
+{
+public:
+    traceReader();
+    ~traceReader();
+
+    bool open(const char *path);
+    bool next(TraceEvent &event); // false at the end of the file or on a broken record
+
+private:
+    FILE *file;
+    Word registers[TRACE_REGISTERS];
+    u32 lastLength;
+    u32 lastWrite;
+
+    bool getAddress(u32 size, u32 &address);
+};
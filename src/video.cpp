@@ -0,0 +1,530 @@
+#include "video.h"
+#include "i8086.h"
+
+#define TEXT_COLUMNS 80
+#define TEXT_ROWS 25
+#define GRAPHICS_WIDTH 320
+#define GRAPHICS_HEIGHT 200
+
+/* 5x7 glyphs for 20h-7Eh, everything else draws as a blank cell */
+static const Byte asciiFont[0x5F][FONT_HEIGHT] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // space
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x00, 0x10, 0x00}, // !
+    {0x28, 0x28, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00}, // "
+    {0x28, 0x28, 0x7c, 0x28, 0x7c, 0x28, 0x28, 0x00}, // #
+    {0x10, 0x3c, 0x50, 0x38, 0x14, 0x78, 0x10, 0x00}, // $
+    {0x60, 0x64, 0x08, 0x10, 0x20, 0x4c, 0x0c, 0x00}, // %
+    {0x30, 0x48, 0x50, 0x20, 0x54, 0x48, 0x34, 0x00}, // &
+    {0x10, 0x10, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00}, // '
+    {0x08, 0x10, 0x20, 0x20, 0x20, 0x10, 0x08, 0x00}, // (
+    {0x20, 0x10, 0x08, 0x08, 0x08, 0x10, 0x20, 0x00}, // )
+    {0x00, 0x10, 0x54, 0x38, 0x54, 0x10, 0x00, 0x00}, // *
+    {0x00, 0x10, 0x10, 0x7c, 0x10, 0x10, 0x00, 0x00}, // +
+    {0x00, 0x00, 0x00, 0x00, 0x30, 0x10, 0x20, 0x00}, // ,
+    {0x00, 0x00, 0x00, 0x7c, 0x00, 0x00, 0x00, 0x00}, // -
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x30, 0x00}, // .
+    {0x00, 0x04, 0x08, 0x10, 0x20, 0x40, 0x00, 0x00}, // /
+    {0x38, 0x44, 0x4c, 0x54, 0x64, 0x44, 0x38, 0x00}, // 0
+    {0x10, 0x30, 0x10, 0x10, 0x10, 0x10, 0x38, 0x00}, // 1
+    {0x38, 0x44, 0x04, 0x08, 0x10, 0x20, 0x7c, 0x00}, // 2
+    {0x7c, 0x08, 0x10, 0x08, 0x04, 0x44, 0x38, 0x00}, // 3
+    {0x08, 0x18, 0x28, 0x48, 0x7c, 0x08, 0x08, 0x00}, // 4
+    {0x7c, 0x40, 0x78, 0x04, 0x04, 0x44, 0x38, 0x00}, // 5
+    {0x18, 0x20, 0x40, 0x78, 0x44, 0x44, 0x38, 0x00}, // 6
+    {0x7c, 0x04, 0x08, 0x10, 0x20, 0x20, 0x20, 0x00}, // 7
+    {0x38, 0x44, 0x44, 0x38, 0x44, 0x44, 0x38, 0x00}, // 8
+    {0x38, 0x44, 0x44, 0x3c, 0x04, 0x08, 0x30, 0x00}, // 9
+    {0x00, 0x30, 0x30, 0x00, 0x30, 0x30, 0x00, 0x00}, // :
+    {0x00, 0x30, 0x30, 0x00, 0x30, 0x10, 0x20, 0x00}, // ;
+    {0x08, 0x10, 0x20, 0x40, 0x20, 0x10, 0x08, 0x00}, // <
+    {0x00, 0x00, 0x7c, 0x00, 0x7c, 0x00, 0x00, 0x00}, // =
+    {0x20, 0x10, 0x08, 0x04, 0x08, 0x10, 0x20, 0x00}, // >
+    {0x38, 0x44, 0x04, 0x08, 0x10, 0x00, 0x10, 0x00}, // ?
+    {0x38, 0x44, 0x04, 0x34, 0x54, 0x54, 0x38, 0x00}, // @
+    {0x38, 0x44, 0x44, 0x7c, 0x44, 0x44, 0x44, 0x00}, // A
+    {0x78, 0x44, 0x44, 0x78, 0x44, 0x44, 0x78, 0x00}, // B
+    {0x38, 0x44, 0x40, 0x40, 0x40, 0x44, 0x38, 0x00}, // C
+    {0x70, 0x48, 0x44, 0x44, 0x44, 0x48, 0x70, 0x00}, // D
+    {0x7c, 0x40, 0x40, 0x78, 0x40, 0x40, 0x7c, 0x00}, // E
+    {0x7c, 0x40, 0x40, 0x78, 0x40, 0x40, 0x40, 0x00}, // F
+    {0x38, 0x44, 0x40, 0x5c, 0x44, 0x44, 0x3c, 0x00}, // G
+    {0x44, 0x44, 0x44, 0x7c, 0x44, 0x44, 0x44, 0x00}, // H
+    {0x38, 0x10, 0x10, 0x10, 0x10, 0x10, 0x38, 0x00}, // I
+    {0x1c, 0x08, 0x08, 0x08, 0x08, 0x48, 0x30, 0x00}, // J
+    {0x44, 0x48, 0x50, 0x60, 0x50, 0x48, 0x44, 0x00}, // K
+    {0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x7c, 0x00}, // L
+    {0x44, 0x6c, 0x54, 0x54, 0x44, 0x44, 0x44, 0x00}, // M
+    {0x44, 0x44, 0x64, 0x54, 0x4c, 0x44, 0x44, 0x00}, // N
+    {0x38, 0x44, 0x44, 0x44, 0x44, 0x44, 0x38, 0x00}, // O
+    {0x78, 0x44, 0x44, 0x78, 0x40, 0x40, 0x40, 0x00}, // P
+    {0x38, 0x44, 0x44, 0x44, 0x54, 0x48, 0x34, 0x00}, // Q
+    {0x78, 0x44, 0x44, 0x78, 0x50, 0x48, 0x44, 0x00}, // R
+    {0x3c, 0x40, 0x40, 0x38, 0x04, 0x04, 0x78, 0x00}, // S
+    {0x7c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00}, // T
+    {0x44, 0x44, 0x44, 0x44, 0x44, 0x44, 0x38, 0x00}, // U
+    {0x44, 0x44, 0x44, 0x44, 0x44, 0x28, 0x10, 0x00}, // V
+    {0x44, 0x44, 0x44, 0x54, 0x54, 0x54, 0x28, 0x00}, // W
+    {0x44, 0x44, 0x28, 0x10, 0x28, 0x44, 0x44, 0x00}, // X
+    {0x44, 0x44, 0x44, 0x28, 0x10, 0x10, 0x10, 0x00}, // Y
+    {0x7c, 0x04, 0x08, 0x10, 0x20, 0x40, 0x7c, 0x00}, // Z
+    {0x38, 0x20, 0x20, 0x20, 0x20, 0x20, 0x38, 0x00}, // [
+    {0x00, 0x40, 0x20, 0x10, 0x08, 0x04, 0x00, 0x00}, // backslash
+    {0x38, 0x08, 0x08, 0x08, 0x08, 0x08, 0x38, 0x00}, // ]
+    {0x10, 0x28, 0x44, 0x00, 0x00, 0x00, 0x00, 0x00}, // ^
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7c, 0x00}, // _
+    {0x20, 0x10, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00}, // `
+    {0x00, 0x00, 0x38, 0x04, 0x3c, 0x44, 0x3c, 0x00}, // a
+    {0x40, 0x40, 0x58, 0x64, 0x44, 0x44, 0x78, 0x00}, // b
+    {0x00, 0x00, 0x38, 0x40, 0x40, 0x44, 0x38, 0x00}, // c
+    {0x04, 0x04, 0x34, 0x4c, 0x44, 0x44, 0x3c, 0x00}, // d
+    {0x00, 0x00, 0x38, 0x44, 0x7c, 0x40, 0x38, 0x00}, // e
+    {0x18, 0x24, 0x20, 0x70, 0x20, 0x20, 0x20, 0x00}, // f
+    {0x00, 0x3c, 0x44, 0x44, 0x3c, 0x04, 0x38, 0x00}, // g
+    {0x40, 0x40, 0x58, 0x64, 0x44, 0x44, 0x44, 0x00}, // h
+    {0x10, 0x00, 0x30, 0x10, 0x10, 0x10, 0x38, 0x00}, // i
+    {0x08, 0x00, 0x18, 0x08, 0x08, 0x48, 0x30, 0x00}, // j
+    {0x40, 0x40, 0x48, 0x50, 0x60, 0x50, 0x48, 0x00}, // k
+    {0x30, 0x10, 0x10, 0x10, 0x10, 0x10, 0x38, 0x00}, // l
+    {0x00, 0x00, 0x68, 0x54, 0x54, 0x44, 0x44, 0x00}, // m
+    {0x00, 0x00, 0x58, 0x64, 0x44, 0x44, 0x44, 0x00}, // n
+    {0x00, 0x00, 0x38, 0x44, 0x44, 0x44, 0x38, 0x00}, // o
+    {0x00, 0x00, 0x78, 0x44, 0x78, 0x40, 0x40, 0x00}, // p
+    {0x00, 0x00, 0x3c, 0x44, 0x3c, 0x04, 0x04, 0x00}, // q
+    {0x00, 0x00, 0x58, 0x64, 0x40, 0x40, 0x40, 0x00}, // r
+    {0x00, 0x00, 0x38, 0x40, 0x38, 0x04, 0x78, 0x00}, // s
+    {0x20, 0x20, 0x70, 0x20, 0x20, 0x24, 0x18, 0x00}, // t
+    {0x00, 0x00, 0x44, 0x44, 0x44, 0x4c, 0x34, 0x00}, // u
+    {0x00, 0x00, 0x44, 0x44, 0x44, 0x28, 0x10, 0x00}, // v
+    {0x00, 0x00, 0x44, 0x44, 0x54, 0x54, 0x28, 0x00}, // w
+    {0x00, 0x00, 0x44, 0x28, 0x10, 0x28, 0x44, 0x00}, // x
+    {0x00, 0x00, 0x44, 0x44, 0x3c, 0x04, 0x38, 0x00}, // y
+    {0x00, 0x00, 0x7c, 0x08, 0x10, 0x20, 0x7c, 0x00}, // z
+    {0x08, 0x10, 0x10, 0x20, 0x10, 0x10, 0x08, 0x00}, // {
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00}, // |
+    {0x20, 0x10, 0x10, 0x08, 0x10, 0x10, 0x20, 0x00}, // }
+    {0x00, 0x00, 0x20, 0x54, 0x08, 0x00, 0x00, 0x00}, // ~
+};
+
+/* The 16 CGA colours as 6-bit DAC values, also what text attributes index */
+static const Byte cgaPalette[16][3] = {
+    {0x00, 0x00, 0x00}, {0x00, 0x00, 0x2A}, {0x00, 0x2A, 0x00}, {0x00, 0x2A, 0x2A},
+    {0x2A, 0x00, 0x00}, {0x2A, 0x00, 0x2A}, {0x2A, 0x15, 0x00}, {0x2A, 0x2A, 0x2A},
+    {0x15, 0x15, 0x15}, {0x15, 0x15, 0x3F}, {0x15, 0x3F, 0x15}, {0x15, 0x3F, 0x3F},
+    {0x3F, 0x15, 0x15}, {0x3F, 0x15, 0x3F}, {0x3F, 0x3F, 0x15}, {0x3F, 0x3F, 0x3F},
+};
+
+videoCard::videoCard()
+    : memory(nullptr), mode(VIDEO_MODE_TEXT), font(nullptr), redraw(true), dacRead(0), dacWrite(0), dacComponent(0),
+      status(0)
+{
+    // Near enough to the VGA power on palette: CGA colours, a grey ramp, then a 6x6x6 colour cube
+    for (u32 i = 0; i < 256; i++)
+    {
+        Byte value[3] = {0, 0, 0};
+        if (i < 16)
+        {
+            memcpy(value, cgaPalette[i], 3);
+        }
+        else if (i < 32)
+        {
+            value[0] = value[1] = value[2] = (i - 16) * 0x3F / 15;
+        }
+        else if (i < 32 + 216)
+        {
+            value[0] = (i - 32) / 36 * 0x3F / 5;
+            value[1] = (i - 32) / 6 % 6 * 0x3F / 5;
+            value[2] = (i - 32) % 6 * 0x3F / 5;
+        }
+        setColor(i, value);
+    }
+    setMode(VIDEO_MODE_TEXT);
+}
+
+void videoCard::attach(memoryMap &memory, ioPortMap &ports)
+{
+    this->memory = &memory;
+    memory.watchWrites(VIDEO_GRAPHICS_BASE, VIDEO_GRAPHICS_SIZE);
+    memory.watchWrites(VIDEO_TEXT_BASE, VIDEO_TEXT_SIZE);
+    ports.map(0x3C7, 3, this);
+    ports.map(0x3DA, 1, this);
+    redraw = true;
+}
+
+void videoCard::setMode(Byte mode)
+{
+    this->mode = mode == VIDEO_MODE_GRAPHICS ? VIDEO_MODE_GRAPHICS : VIDEO_MODE_TEXT;
+    if (this->mode == VIDEO_MODE_GRAPHICS)
+    {
+        frame.assign(GRAPHICS_WIDTH * GRAPHICS_HEIGHT * 3, 0);
+        vram.assign(GRAPHICS_WIDTH * GRAPHICS_HEIGHT, 0);
+    }
+    else
+    {
+        frame.assign(TEXT_COLUMNS * 8 * TEXT_ROWS * FONT_HEIGHT * 3, 0);
+        vram.assign(TEXT_COLUMNS * TEXT_ROWS * 2, 0);
+    }
+    drawn = vram;
+    redraw = true;
+}
+
+Byte videoCard::getMode()
+{
+    return mode;
+}
+
+void videoCard::setFont(const Byte *font)
+{
+    this->font = font;
+    redraw = true;
+}
+
+u32 videoCard::getWidth()
+{
+    return mode == VIDEO_MODE_GRAPHICS ? GRAPHICS_WIDTH : TEXT_COLUMNS * 8;
+}
+
+u32 videoCard::getHeight()
+{
+    return mode == VIDEO_MODE_GRAPHICS ? GRAPHICS_HEIGHT : TEXT_ROWS * FONT_HEIGHT;
+}
+
+const Byte *videoCard::getFrame()
+{
+    return frame.data();
+}
+
+void videoCard::setColor(Byte index, const Byte *value)
+{
+    for (u32 i = 0; i < 3; i++)
+    {
+        palette[index][i] = value[i] & 0x3F;
+        rgb[index][i] = palette[index][i] << 2 | palette[index][i] >> 4;
+    }
+}
+
+bool videoCard::update()
+{
+    if (!memory)
+    {
+        return false;
+    }
+    bool graphics = mode == VIDEO_MODE_GRAPHICS;
+    u32 base = graphics ? VIDEO_GRAPHICS_BASE : VIDEO_TEXT_BASE;
+    u32 unit = graphics ? GRAPHICS_WIDTH : 2; // Bytes per pixel row or text cell
+    u32 size = vram.size();
+
+    // Only pages written since the last update are copied and compared, the rest of vram is still current
+    bool changed = false;
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        u32 page = (base + offset) >> PAGE_SHIFT;
+        if (!memory->takeDirty(page) && !redraw)
+        {
+            continue;
+        }
+        u32 end = offset + PAGE_SIZE < size ? offset + PAGE_SIZE : size;
+        if (memory->readPage[page])
+        {
+            memcpy(&vram[offset], memory->readPage[page], end - offset);
+        }
+
+        // Units straddling the page edges are checked from both pages
+        for (u32 first = offset / unit; first * unit < end; first++)
+        {
+            const Byte *now = &vram[first * unit];
+            Byte *before = &drawn[first * unit];
+            if (redraw || memcmp(now, before, unit) != 0)
+            {
+                memcpy(before, now, unit);
+                if (graphics)
+                {
+                    renderRow(first);
+                }
+                else
+                {
+                    renderCell(first);
+                }
+                changed = true;
+            }
+        }
+    }
+    redraw = false;
+    return changed;
+}
+
+void videoCard::renderCell(u32 cell)
+{
+    Byte code = vram[cell * 2];
+    Byte attribute = vram[cell * 2 + 1];
+    const Byte *foreground = rgb[attribute & 0x0F];
+    const Byte *background = rgb[attribute >> 4 & 0x07]; // Bit 7 blinks, drawn steady
+
+    const Byte *glyph = nullptr;
+    if (font)
+    {
+        glyph = font + code * FONT_HEIGHT;
+    }
+    else if (code >= 0x20 && code < 0x7F)
+    {
+        glyph = asciiFont[code - 0x20];
+    }
+
+    u32 stride = TEXT_COLUMNS * 8 * 3;
+    Byte *pixel = &frame[(cell / TEXT_COLUMNS * FONT_HEIGHT * stride) + cell % TEXT_COLUMNS * 8 * 3];
+    for (u32 y = 0; y < FONT_HEIGHT; y++, pixel += stride)
+    {
+        Byte bits = glyph ? glyph[y] : 0;
+        for (u32 x = 0; x < 8; x++)
+        {
+            memcpy(pixel + x * 3, (bits << x & 0x80) ? foreground : background, 3);
+        }
+    }
+}
+
+void videoCard::renderRow(u32 row)
+{
+    const Byte *source = &vram[row * GRAPHICS_WIDTH];
+    Byte *pixel = &frame[row * GRAPHICS_WIDTH * 3];
+    for (u32 x = 0; x < GRAPHICS_WIDTH; x++, pixel += 3)
+    {
+        memcpy(pixel, rgb[source[x]], 3);
+    }
+}
+
+Byte videoCard::inByte(Word port)
+{
+    switch (port)
+    {
+    case 0x3C8:
+        return dacWrite;
+    case 0x3C9:
+    {
+        Byte value = palette[dacRead][dacComponent];
+        if (++dacComponent == 3)
+        {
+            dacComponent = 0;
+            dacRead++;
+        }
+        return value;
+    }
+    case 0x3DA:
+        status ^= 0x09; // Display enable and vertical retrace, alternating for wait loops
+        return status;
+    default:
+        return 0x00; // 3C7h, DAC state
+    }
+}
+
+void videoCard::outByte(Word port, Byte value)
+{
+    switch (port)
+    {
+    case 0x3C7:
+        dacRead = value;
+        dacComponent = 0;
+        break;
+    case 0x3C8:
+        dacWrite = value;
+        dacComponent = 0;
+        break;
+    case 0x3C9:
+    {
+        Byte color[3];
+        memcpy(color, palette[dacWrite], 3);
+        color[dacComponent] = value;
+        setColor(dacWrite, color);
+        if (++dacComponent == 3)
+        {
+            dacComponent = 0;
+            dacWrite++;
+        }
+        redraw = true;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+bool videoCard::writePpm(const char *path)
+{
+    update();
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Can't create %s\n", path);
+        return false;
+    }
+    fprintf(file, "P6\n%u %u\n255\n", getWidth(), getHeight());
+    bool ok = fwrite(frame.data(), 1, frame.size(), file) == frame.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+    {
+        fprintf(stderr, "Error: Can't write %s\n", path);
+    }
+    return ok;
+}
+
+/* PNG is written uncompressed, stored deflate blocks need no zlib */
+static u32 crc32(u32 crc, const Byte *data, size_t size)
+{
+    static u32 table[256];
+    if (!table[1])
+    {
+        for (u32 i = 0; i < 256; i++)
+        {
+            u32 value = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                value = (value & 1) ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+            }
+            table[i] = value;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void putBigEndian(std::vector<Byte> &out, u32 value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        out.push_back(value >> shift & 0xFF);
+    }
+}
+
+static void pngChunk(std::vector<Byte> &out, const char *type, const std::vector<Byte> &data)
+{
+    putBigEndian(out, data.size());
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    putBigEndian(out, crc32(0, &out[start], out.size() - start));
+}
+
+bool videoCard::writePng(const char *path)
+{
+    update();
+    u32 width = getWidth();
+    u32 height = getHeight();
+
+    std::vector<Byte> header;
+    putBigEndian(header, width);
+    putBigEndian(header, height);
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8-bit RGB, no interlace
+
+    // Every row behind filter type 0, then zlib around stored blocks of up to 64 KiB
+    std::vector<Byte> raw;
+    raw.reserve((width * 3 + 1) * height);
+    for (u32 y = 0; y < height; y++)
+    {
+        raw.push_back(0);
+        raw.insert(raw.end(), &frame[y * width * 3], &frame[(y + 1) * width * 3]);
+    }
+    std::vector<Byte> compressed = {0x78, 0x01};
+    for (size_t offset = 0; offset < raw.size(); offset += 0xFFFF)
+    {
+        u32 length = raw.size() - offset < 0xFFFF ? raw.size() - offset : 0xFFFF;
+        compressed.push_back(offset + length == raw.size());
+        compressed.insert(compressed.end(), {(Byte)length, (Byte)(length >> 8), (Byte)~length, (Byte)(~length >> 8)});
+        compressed.insert(compressed.end(), raw.begin() + offset, raw.begin() + offset + length);
+    }
+    u32 a = 1, b = 0; // Adler-32
+    for (Byte value : raw)
+    {
+        a = (a + value) % 65521;
+        b = (b + a) % 65521;
+    }
+    putBigEndian(compressed, b << 16 | a);
+
+    std::vector<Byte> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    pngChunk(png, "IHDR", header);
+    pngChunk(png, "IDAT", compressed);
+    pngChunk(png, "IEND", {});
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Can't create %s\n", path);
+        return false;
+    }
+    bool ok = fwrite(png.data(), 1, png.size(), file) == png.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+    {
+        fprintf(stderr, "Error: Can't write %s\n", path);
+    }
+    return ok;
+}
+
+template <class Cpu>
+videoBios<Cpu>::videoBios() : cpu(nullptr), card(nullptr)
+{
+}
+
+template <class Cpu>
+void videoBios<Cpu>::attach(Cpu &cpu, videoCard &card)
+{
+    this->cpu = &cpu;
+    this->card = &card;
+    cpu.hookInterrupt(0x10, int10, this);
+}
+
+template <class Cpu>
+bool videoBios<Cpu>::int10(void *context, Byte vector)
+{
+    videoBios *bios = (videoBios *)context;
+    Cpu *cpu = bios->cpu;
+    videoCard *card = bios->card;
+
+    switch (cpu->regs.AH)
+    {
+    case 0x00: // Set mode, AL bit 7 keeps video memory as it is
+    {
+        Byte mode = cpu->regs.AL & 0x7F;
+        if (mode != 0x02 && mode != VIDEO_MODE_TEXT && mode != VIDEO_MODE_GRAPHICS)
+        {
+            return false; // Not drawn by the card, the guest's BIOS can have it
+        }
+        card->setMode(mode);
+        if (!(cpu->regs.AL & 0x80))
+        {
+            if (card->getMode() == VIDEO_MODE_GRAPHICS)
+            {
+                std::vector<Byte> blank(GRAPHICS_WIDTH * GRAPHICS_HEIGHT, 0);
+                cpu->copyToGuest(VIDEO_GRAPHICS_BASE, blank.data(), blank.size());
+            }
+            else
+            {
+                std::vector<Byte> blank(TEXT_COLUMNS * TEXT_ROWS * 2, 0x07); // Spaces, light grey on black
+                for (size_t i = 0; i < blank.size(); i += 2)
+                {
+                    blank[i] = ' ';
+                }
+                cpu->copyToGuest(VIDEO_TEXT_BASE, blank.data(), blank.size());
+            }
+        }
+        // Mode, columns and cursor in the BIOS data area
+        cpu->writeByte(0x449, 0, mode);
+        cpu->writeWord(0x44A, 0, mode == VIDEO_MODE_GRAPHICS ? 40 : 80);
+        cpu->writeWord(0x450, 0, 0);
+        return true;
+    }
+    case 0x0F: // Current mode
+        cpu->regs.AL = cpu->readByte(0x449, 0);
+        cpu->regs.AH = card->getMode() == VIDEO_MODE_GRAPHICS ? 40 : 80;
+        cpu->regs.BH = 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+template class videoBios<i8086>;
+template class videoBios<i8086Fast>;
+template class videoBios<i8086Traced>;
+template class videoBios<i8086Checked>;
@@ -0,0 +1,87 @@
+#pragma once
+#include "header.h"
+#include "ioports.h"
+#include "memmap.h"
+
+#include <vector>
+
+// A VGA adapter for headless machines: 80x25 colour text and mode 13h.
+// Video memory is plain RAM watched by the memory map. The first write to a
+// page since the last frame sets PAGE_DIRTY and puts the page back on the
+// fast path, so a frame only looks at pages that were written, and within
+// those only re-converts the text cells or pixel rows that really changed
+// against a copy of what was drawn last time. The frame is 24-bit RGB and
+// can be written out as PPM or PNG.
+
+#define VIDEO_GRAPHICS_BASE 0xA0000
+#define VIDEO_GRAPHICS_SIZE 0x10000
+#define VIDEO_TEXT_BASE 0xB8000
+#define VIDEO_TEXT_SIZE 0x8000
+
+/* BIOS mode numbers */
+#define VIDEO_MODE_TEXT 0x03     // 80x25, 16 colours, 8x8 cells to a 640x200 frame
+#define VIDEO_MODE_GRAPHICS 0x13 // 320x200, 256 colours from the DAC
+
+#define FONT_HEIGHT 8 // Bytes per character, bit 7 is the leftmost pixel
+
+class videoCard
+{
+public:
+    videoCard();
+
+    // After the machine's init() or fork(), mapping RAM again ends the watch
+    void attach(memoryMap &memory, ioPortMap &ports);
+    void setMode(Byte mode); // Text or graphics, anything else is text
+    Byte getMode();
+    void setFont(const Byte *font); // 256 characters of FONT_HEIGHT bytes that outlive the card; nullptr for the built-in one
+
+    bool update(); // Brings the frame up to date, whether anything in it changed
+    const Byte *getFrame(); // RGB, getWidth() * 3 bytes per row
+    u32 getWidth();
+    u32 getHeight();
+    bool writePpm(const char *path);
+    bool writePng(const char *path);
+
+    /* DAC at 3C7h-3C9h, status at 3DAh */
+    Byte inByte(Word port);
+    void outByte(Word port, Byte value);
+
+private:
+    memoryMap *memory;
+    Byte mode;
+    const Byte *font;
+    bool redraw; // Mode, font or palette changed, every cell or row is converted again
+
+    Byte palette[256][3]; // 6-bit DAC values
+    Byte rgb[256][3];     // The same scaled to 8 bits
+    Byte dacRead;
+    Byte dacWrite;
+    Byte dacComponent; // Of the entry being read or written
+    Byte status;       // Toggles retrace for guests polling 3DAh
+
+    std::vector<Byte> frame;
+    std::vector<Byte> vram;  // Copy of the window being shown, refreshed from the pages taken dirty
+    std::vector<Byte> drawn; // What the frame shows, compared against vram cell by cell or row by row
+
+    void setColor(Byte index, const Byte *value);
+    void renderCell(u32 cell);
+    void renderRow(u32 row);
+};
+
+// The INT 10h mode set (AH=00h) and mode query (AH=0Fh) done on the host, so
+// the card knows what to draw without modelling the CRTC registers. Other
+// functions are left to the guest's BIOS.
+template <class Cpu>
+class videoBios
+{
+public:
+    videoBios();
+
+    void attach(Cpu &cpu, videoCard &card); // Hooks INT 10h
+
+private:
+    Cpu *cpu;
+    videoCard *card;
+
+    static bool int10(void *context, Byte vector);
+};
@@ -0,0 +1,77 @@
+#include "workpool.h"
+
+#include <thread>
+
+workPool::workPool(u32 threads) : threads(threads)
+{
+    if (!this->threads)
+    {
+        this->threads = std::thread::hardware_concurrency();
+    }
+    if (!this->threads)
+    {
+        this->threads = 1; // Unknown core count
+    }
+}
+
+u32 workPool::getThreads()
+{
+    return threads;
+}
+
+void workPool::run(size_t tasks, const std::function<void(size_t task)> &work)
+{
+    queues = std::vector<Queue>(threads);
+    for (size_t task = 0; task < tasks; task++)
+    {
+        queues[task % threads].tasks.push_back(task);
+    }
+
+    std::vector<std::thread> pool;
+    for (u32 thread = 1; thread < threads; thread++)
+    {
+        pool.emplace_back(&workPool::worker, this, thread, std::cref(work));
+    }
+    worker(0, work); // The calling thread is one of them
+    for (std::thread &thread : pool)
+    {
+        thread.join();
+    }
+}
+
+void workPool::worker(u32 thread, const std::function<void(size_t task)> &work)
+{
+    size_t task;
+    while (next(thread, task))
+    {
+        work(task);
+    }
+}
+
+bool workPool::next(u32 thread, size_t &task)
+{
+    Queue &own = queues[thread];
+    {
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // Steal the oldest task of the next thread that has any, it is the furthest from what that thread is on
+    for (u32 i = 1; i < threads; i++)
+    {
+        Queue &victim = queues[(thread + i) % threads];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
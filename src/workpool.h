@@ -0,0 +1,34 @@
+#pragma once
+#include "header.h"
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Runs a fixed set of independent tasks on a pool of threads.
+// Tasks are dealt out round robin up front, one deque per thread. A thread
+// works from the back of its own deque and, once that is empty, steals from
+// the front of the others', so long jobs on one thread don't leave the rest
+// idle. No task starts others, so a thread is done when every deque is empty.
+
+class workPool
+{
+public:
+    workPool(u32 threads); // 0 for one per host core
+
+    void run(size_t tasks, const std::function<void(size_t task)> &work);
+    u32 getThreads();
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    u32 threads;
+    std::vector<Queue> queues;
+
+    bool next(u32 thread, size_t &task);
+    void worker(u32 thread, const std::function<void(size_t task)> &work);
+};
@@ -0,0 +1,575 @@
+#include <algorithm>
+#include <chrono>
+#include <dirent.h>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../src/i8086.h"
+#include "../src/workpool.h"
+
+// Runs single-step test vectors through i8086::execute().
+// Takes the JSON files of the published 8086/8088 single-step tests, one
+// file per opcode (or per opcode and ModR/M reg for the groups), gzipped or
+// not, or directories of them. Each vector gives the registers and memory
+// before one instruction and what they are after it; only what changed is
+// listed for after. Prefetch queue contents and bus cycles aren't checked.
+//
+// Files run in parallel, each on a machine of its own with RAM all the way
+// up to 1 MiB and no devices. Prints a line per file with how many vectors
+// passed, how fast they ran and the first one that failed.
+//
+// The metadata file that comes with the tests gives the flags each opcode
+// leaves defined; with --metadata the others aren't compared, and opcodes it
+// calls undefined are skipped.
+
+static void usage()
+{
+    fprintf(stderr, "Usage: conformance [--threads <n>] [--metadata <file>] <test file or directory>...\n");
+}
+
+/* Register names in the test files, in the order kept in TestState */
+static const char *const registerNames[] = {"ax", "bx", "cx", "dx", "sp", "bp", "si", "di",
+                                            "cs", "ds", "es", "ss", "ip", "flags"};
+#define TEST_REGISTERS 14
+#define TEST_FLAGS 13
+
+struct TestState
+{
+    Word registers[TEST_REGISTERS];
+    u32 present; // Bit per register the file gave
+    std::vector<std::pair<u32, Byte>> ram;
+};
+
+struct TestVector
+{
+    std::string name;
+    u32 index;
+    TestState initial;
+    TestState final;
+};
+
+struct FileResult
+{
+    std::string path;
+    bool loaded;
+    bool skipped;
+    u32 total;
+    u32 passed;
+    double seconds; // Running the vectors, not reading them
+    std::string failure; // First one
+};
+
+/* Just enough JSON for the test files, values nobody asked for are skipped over */
+class jsonCursor
+{
+public:
+    jsonCursor(const char *text, size_t size) : p(text), end(text + size), ok(true) {}
+
+    bool good() { return ok; }
+
+    void space()
+    {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+            p++;
+    }
+
+    bool peek(char c)
+    {
+        space();
+        return p < end && *p == c;
+    }
+
+    void expect(char c)
+    {
+        space();
+        if (p < end && *p == c)
+            p++;
+        else
+            ok = false;
+    }
+
+    /* Separator between items, false at the closing bracket */
+    bool more(char close)
+    {
+        space();
+        if (p < end && *p == ',')
+        {
+            p++;
+            return true;
+        }
+        if (p < end && *p == close)
+        {
+            p++;
+            return false;
+        }
+        ok = false;
+        return false;
+    }
+
+    std::string string()
+    {
+        std::string text;
+        expect('"');
+        while (ok && p < end && *p != '"')
+        {
+            if (*p == '\\' && p + 1 < end)
+            {
+                p++;
+                text += *p == 'n' ? '\n' : *p == 't' ? '\t' : *p; // \u escapes aren't in the tests
+            }
+            else
+            {
+                text += *p;
+            }
+            p++;
+        }
+        expect('"');
+        return text;
+    }
+
+    long long number()
+    {
+        space();
+        char *after;
+        long long value = strtoll(p, &after, 10);
+        if (after == p)
+            ok = false;
+        p = after;
+        return value;
+    }
+
+    void skip()
+    {
+        space();
+        if (p >= end)
+        {
+            ok = false;
+            return;
+        }
+        if (*p == '"')
+        {
+            string();
+        }
+        else if (*p == '[' || *p == '{')
+        {
+            char close = *p == '[' ? ']' : '}';
+            p++;
+            if (peek(close))
+            {
+                p++;
+                return;
+            }
+            do
+            {
+                if (close == '}')
+                {
+                    string();
+                    expect(':');
+                }
+                skip();
+            } while (ok && more(close));
+        }
+        else
+        {
+            while (p < end && *p != ',' && *p != ']' && *p != '}' && *p != ' ' && *p != '\n')
+                p++; // Number, true, false or null
+        }
+    }
+
+    /* Calls member(key) for each member, which reads the value or skips it */
+    template <class Member>
+    void object(Member member)
+    {
+        expect('{');
+        if (peek('}'))
+        {
+            p++;
+            return;
+        }
+        do
+        {
+            std::string key = string();
+            expect(':');
+            member(key);
+        } while (ok && more('}'));
+    }
+
+    template <class Item>
+    void array(Item item)
+    {
+        expect('[');
+        if (peek(']'))
+        {
+            p++;
+            return;
+        }
+        do
+        {
+            item();
+        } while (ok && more(']'));
+    }
+
+private:
+    const char *p;
+    const char *end;
+    bool ok;
+};
+
+static void readState(jsonCursor &json, TestState &state)
+{
+    state.present = 0;
+    json.object([&](const std::string &key) {
+        if (key == "regs")
+        {
+            json.object([&](const std::string &name) {
+                for (u32 i = 0; i < TEST_REGISTERS; i++)
+                {
+                    if (name == registerNames[i])
+                    {
+                        state.registers[i] = json.number();
+                        state.present |= 1 << i;
+                        return;
+                    }
+                }
+                json.skip();
+            });
+        }
+        else if (key == "ram")
+        {
+            json.array([&]() {
+                u32 address = 0;
+                Byte value = 0;
+                u32 field = 0;
+                json.array([&]() {
+                    long long number = json.number();
+                    if (field++ == 0)
+                        address = number;
+                    else
+                        value = number;
+                });
+                state.ram.push_back({address & ADDRESS_MASK, value});
+            });
+        }
+        else
+        {
+            json.skip(); // queue
+        }
+    });
+}
+
+static bool readFile(const std::string &path, std::string &text)
+{
+    bool gzipped = path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0;
+    FILE *file = gzipped ? popen(("gzip -dc '" + path + "'").c_str(), "r") : fopen(path.c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+    char buffer[1 << 16];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        text.append(buffer, size);
+    }
+    return gzipped ? pclose(file) == 0 : fclose(file) == 0;
+}
+
+static bool readVectors(const std::string &path, std::vector<TestVector> &vectors)
+{
+    std::string text;
+    if (!readFile(path, text))
+    {
+        return false;
+    }
+
+    jsonCursor json(text.data(), text.size());
+    json.array([&]() {
+        TestVector vector;
+        vector.index = vectors.size();
+        json.object([&](const std::string &key) {
+            if (key == "name")
+                vector.name = json.string();
+            else if (key == "idx")
+                vector.index = json.number();
+            else if (key == "initial")
+                readState(json, vector.initial);
+            else if (key == "final")
+                readState(json, vector.final);
+            else
+                json.skip(); // bytes are in initial ram too; cycles, hash
+        });
+        vectors.push_back(std::move(vector));
+    });
+    return json.good();
+}
+
+/* Metadata for one test file, its name is the opcode and for groups the reg field: 80.json, F6.7.json.gz */
+struct OpcodeInfo
+{
+    Word flagsMask;
+    bool undefined;
+};
+
+static OpcodeInfo lookupOpcode(const std::string &metadata, const std::string &path)
+{
+    OpcodeInfo info = {0xFFFF, false};
+    if (metadata.empty())
+    {
+        return info;
+    }
+
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    std::string opcode = name.substr(0, 2);
+    std::string reg = name.size() > 4 && name[2] == '.' && name[3] >= '0' && name[3] <= '7' && name[4] == '.'
+                          ? name.substr(3, 1)
+                          : "";
+    std::transform(opcode.begin(), opcode.end(), opcode.begin(), ::toupper);
+
+    auto entry = [&](jsonCursor &json) {
+        json.object([&](const std::string &key) {
+            if (key == "flags-mask")
+                info.flagsMask = json.number();
+            else if (key == "status")
+                info.undefined = json.string() == "undefined";
+            else if (key == "reg" && !reg.empty())
+            {
+                json.object([&](const std::string &field) {
+                    if (field != reg)
+                    {
+                        json.skip();
+                        return;
+                    }
+                    json.object([&](const std::string &key) {
+                        if (key == "flags-mask")
+                            info.flagsMask = json.number();
+                        else if (key == "status")
+                            info.undefined = json.string() == "undefined";
+                        else
+                            json.skip();
+                    });
+                });
+            }
+            else
+                json.skip();
+        });
+    };
+
+    jsonCursor json(metadata.data(), metadata.size());
+    json.object([&](const std::string &key) {
+        if (key != "opcodes")
+        {
+            json.skip();
+            return;
+        }
+        json.object([&](const std::string &code) {
+            std::string upper = code;
+            std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+            if (upper == opcode)
+                entry(json);
+            else
+                json.skip();
+        });
+    });
+    return info;
+}
+
+/* All RAM, no devices; again after HLT, which only init() takes back */
+static void prepare(i8086 &cpu)
+{
+    cpu.init();
+    cpu.memMap.mapRam(0xF0000, 0x10000, cpu.ram.data + 0xF0000);
+    cpu.ioMap.unmap(0x0000, IO_PORTS);
+}
+
+static void setRegisters(i8086 &cpu, const Word *r)
+{
+    cpu.regs.AX = r[0], cpu.regs.BX = r[1], cpu.regs.CX = r[2], cpu.regs.DX = r[3];
+    cpu.regs.SP = r[4], cpu.regs.BP = r[5], cpu.regs.SI = r[6], cpu.regs.DI = r[7];
+    cpu.CS = r[8], cpu.DS = r[9], cpu.ES = r[10], cpu.SS = r[11];
+    cpu.IP = r[12];
+    cpu.setFlags(r[13]);
+}
+
+static void getRegisters(i8086 &cpu, Word *r)
+{
+    r[0] = cpu.regs.AX, r[1] = cpu.regs.BX, r[2] = cpu.regs.CX, r[3] = cpu.regs.DX;
+    r[4] = cpu.regs.SP, r[5] = cpu.regs.BP, r[6] = cpu.regs.SI, r[7] = cpu.regs.DI;
+    r[8] = cpu.CS, r[9] = cpu.DS, r[10] = cpu.ES, r[11] = cpu.SS;
+    r[12] = cpu.IP;
+    r[13] = cpu.getFlags();
+}
+
+/* Empty when it passed, otherwise what differed first */
+static std::string runVector(i8086 &cpu, const TestVector &vector, Word flagsMask)
+{
+    for (const auto &byte : vector.initial.ram)
+    {
+        cpu.copyToGuest(byte.first, &byte.second, 1); // Through the CPU, so decoded code is thrown away
+    }
+    setRegisters(cpu, vector.initial.registers);
+    cpu.execute();
+
+    char text[96] = "";
+    Word after[TEST_REGISTERS];
+    getRegisters(cpu, after);
+    for (u32 i = 0; i < TEST_REGISTERS && !text[0]; i++)
+    {
+        Word expected = vector.final.present & (1 << i) ? vector.final.registers[i] : vector.initial.registers[i];
+        Word mask = i == TEST_FLAGS ? flagsMask : 0xFFFF;
+        if ((after[i] & mask) != (expected & mask))
+            snprintf(text, sizeof(text), "%s=%04x, expected %04x", registerNames[i], after[i], expected);
+    }
+    for (const auto &byte : vector.final.ram)
+    {
+        Byte value;
+        cpu.copyFromGuest(byte.first, &value, 1);
+        if (!text[0] && value != byte.second)
+            snprintf(text, sizeof(text), "[%05x]=%02x, expected %02x", byte.first, value, byte.second);
+    }
+
+    // Clean up after it for the next one
+    Byte zero = 0;
+    for (const auto &byte : vector.initial.ram)
+        cpu.copyToGuest(byte.first, &zero, 1);
+    for (const auto &byte : vector.final.ram)
+        cpu.copyToGuest(byte.first, &zero, 1);
+    if (cpu.isHalted())
+        prepare(cpu);
+
+    return text;
+}
+
+static FileResult runFile(const std::string &path, const std::string &metadata)
+{
+    FileResult result = {path, false, false, 0, 0, 0.0, ""};
+    OpcodeInfo info = lookupOpcode(metadata, path);
+    if (info.undefined)
+    {
+        result.loaded = result.skipped = true;
+        return result;
+    }
+
+    std::vector<TestVector> vectors;
+    if (!readVectors(path, vectors))
+    {
+        return result;
+    }
+    result.loaded = true;
+    result.total = vectors.size();
+
+    std::unique_ptr<i8086> cpu(new i8086);
+    prepare(*cpu);
+    auto start = std::chrono::steady_clock::now();
+    for (const TestVector &vector : vectors)
+    {
+        std::string failure = runVector(*cpu, vector, info.flagsMask);
+        if (failure.empty())
+            result.passed++;
+        else if (result.failure.empty())
+            result.failure = "#" + std::to_string(vector.index) + " " + vector.name + ": " + failure;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+static bool isTestFile(const std::string &name)
+{
+    auto endsWith = [&](const char *suffix) {
+        size_t length = strlen(suffix);
+        return name.size() > length && name.compare(name.size() - length, length, suffix) == 0;
+    };
+    return (endsWith(".json") || endsWith(".json.gz")) && name.compare(0, 8, "metadata") != 0;
+}
+
+static void addPath(const char *path, std::vector<std::string> &files)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        files.push_back(path); // A file, or an error when it is read
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent *entry = readdir(dir))
+    {
+        if (isTestFile(entry->d_name))
+            names.push_back(std::string(path) + "/" + entry->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    files.insert(files.end(), names.begin(), names.end());
+}
+
+int main(int argc, char **argv)
+{
+    u32 threads = 0;
+    const char *metadataPath = nullptr;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--threads") && hasValue)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--metadata") && hasValue)
+            metadataPath = argv[++i];
+        else if (argv[i][0] != '-')
+            addPath(argv[i], files);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (files.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    std::string metadata;
+    if (metadataPath && !readFile(metadataPath, metadata))
+    {
+        fprintf(stderr, "Error: Can't read metadata %s\n", metadataPath);
+        return 1;
+    }
+
+    std::vector<FileResult> results(files.size());
+    workPool pool(threads);
+    auto start = std::chrono::steady_clock::now();
+    pool.run(files.size(), [&](size_t task) { results[task] = runFile(files[task], metadata); });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    u64 total = 0, passed = 0;
+    int failedFiles = 0;
+    for (const FileResult &r : results)
+    {
+        std::string name = r.path.substr(r.path.find_last_of('/') + 1);
+        if (!r.loaded)
+        {
+            printf("%-14s error, can't read it\n", name.c_str());
+            failedFiles++;
+            continue;
+        }
+        if (r.skipped)
+        {
+            printf("%-14s skipped, undefined opcode\n", name.c_str());
+            continue;
+        }
+        bool ok = r.passed == r.total;
+        printf("%-14s %6u/%-6u %s %9.0f tests/s", name.c_str(), r.passed, r.total, ok ? "pass" : "FAIL",
+               r.seconds > 0 ? r.total / r.seconds : 0.0);
+        if (!ok)
+            printf("  %s", r.failure.c_str());
+        printf("\n");
+        total += r.total;
+        passed += r.passed;
+        failedFiles += !ok;
+    }
+    fprintf(stderr, "%llu/%llu passed, %d of %zu files failed, %.3f s on %u threads, %.0f tests/s\n", passed, total,
+            failedFiles, files.size(), seconds, pool.getThreads(), total / seconds);
+    return failedFiles ? 1 : 0;
+}
@@ -0,0 +1,394 @@
+#include <memory>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../src/i8086.h"
+
+// Randomized comparison of the recompiler against the interpreter.
+// Generates programs out of what the recompiler translates (the ALU group,
+// TEST, INC/DEC and MOV on registers, CMC/CLC/STC, forward Jcc and JMP) mixed
+// with memory operands, LAHF and SAHF that stay with the interpreter, and
+// wraps them in a loop so the blocks chain. Each one runs on two machines
+// from the same random registers and flags, one through the interpreter and
+// one with ENGINE_JIT, for the same series of random slice lengths; after
+// every slice the registers, flags, IP, clock count and data the program
+// wrote have to be the same. Programs land anywhere in RAM at any IP,
+// wrapping around the segment included, and both the cycle exact and the
+// fast machine are checked.
+//
+// The interpreter keeps its flags lazily and the recompiler leaves them to
+// the host, so this also holds the lazy flags against ones computed eagerly.
+// With --alu every program is a single instruction of the ALU group, TEST or
+// INC/DEC on random operands and incoming flags, which makes it a check of
+// the lazy flags alone: the interpreter's getFlags() against what the host
+// CPU computed for the same instruction.
+
+static void usage()
+{
+    fprintf(stderr, "Usage: jitcheck [--seed <n>] [--programs <n>] [--length <instructions> | --alu]\n");
+}
+
+#define DATA_SEGMENT 0x8000 // Memory operands go to 8000:0000, away from the code
+#define DATA_SIZE 0x100
+#define LOOP_REG 5        // BP counts the laps, nothing else writes it
+#define MAX_SLICES 100000 // A program that runs longer than this is a failure in itself
+
+/* One instruction, and the instruction it jumps forward to if it is a jump */
+struct Item
+{
+    std::vector<Byte> bytes;
+    int target; // Index, -1 if it isn't a jump
+};
+
+struct Program
+{
+    std::vector<Byte> code;
+    Word cs, ip;
+    u32 end; // Offset of the jmp $, where it is done
+    Word registers[8];
+    Word flags;
+    u32 sliceSeed; // Slice lengths, drawn as they're needed
+};
+
+/* A 16-bit register number the program may write */
+static Byte writable(std::mt19937 &rng)
+{
+    Byte reg = rng() % 7;
+    return reg >= LOOP_REG ? reg + 1 : reg;
+}
+
+/* Random, or close to where the flags change: zero, the sign boundaries, all ones */
+static Word operand(std::mt19937 &rng)
+{
+    static const Word edges[] = {0x0000, 0x0001, 0x007f, 0x0080, 0x00ff, 0x0100, 0x7fff, 0x8000, 0xffff};
+    if (rng() & 1)
+        return rng();
+    return edges[rng() % (sizeof(edges) / sizeof(edges[0]))] + (int)(rng() % 3) - 1;
+}
+
+/* reg/rm fields for an instruction writing its rm (or reg if toReg), so BP stays the loop counter */
+static Byte modRM(std::mt19937 &rng, bool wide, bool toReg)
+{
+    Byte written = wide ? writable(rng) : rng() % 8;
+    Byte other = rng() % 8;
+    return 0xC0 | (toReg ? written << 3 | other : other << 3 | written);
+}
+
+/* The first 8 kinds are the ALU group, TEST and INC/DEC */
+#define ITEM_KINDS 16
+#define ALU_KINDS 8
+
+static Item randomItem(std::mt19937 &rng, int index, int count, u32 kinds)
+{
+    Item item;
+    item.target = -1;
+    std::vector<Byte> &b = item.bytes;
+    bool wide = rng() & 1;
+    Word immediate = operand(rng);
+
+    switch (rng() % kinds)
+    {
+    case 0:
+    case 1:
+    case 2: // alu rm,reg / reg,rm
+    {
+        Byte op = (rng() % 8) << 3 | (rng() & 2) | wide;
+        b = {op, modRM(rng, wide, op & 2)};
+        break;
+    }
+    case 3: // alu al/ax,immed
+        b = {(Byte)((rng() % 8) << 3 | 4 | wide), (Byte)immediate};
+        if (wide)
+            b.push_back(immediate >> 8);
+        break;
+    case 4:
+    case 5: // grp1 rm,immed
+    {
+        Byte op = 0x80 + rng() % 4;
+        wide = op & 1;
+        Byte modrm = modRM(rng, wide, false);
+        b = {op, (Byte)((modrm & 0xC7) | (rng() % 8) << 3), (Byte)immediate};
+        if (op == 0x81)
+            b.push_back(immediate >> 8);
+        break;
+    }
+    case 6: // test rm,reg / test al/ax,immed
+        if (rng() & 1)
+        {
+            b = {(Byte)(0x84 | wide), (Byte)(0xC0 | (rng() % 64))};
+        }
+        else
+        {
+            b = {(Byte)(0xa8 | wide), (Byte)immediate};
+            if (wide)
+                b.push_back(immediate >> 8);
+        }
+        break;
+    case 7: // inc/dec reg16
+        b = {(Byte)(0x40 | (rng() & 8) | writable(rng))};
+        break;
+    case 8: // mov rm,reg / reg,rm / reg,immed / rm,immed
+    {
+        Byte form = rng() % 3;
+        if (form == 0)
+        {
+            Byte op = 0x88 | (rng() & 2) | wide;
+            b = {op, modRM(rng, wide, op & 2)};
+        }
+        else if (form == 1)
+        {
+            b = {(Byte)(wide ? 0xb8 + writable(rng) : 0xb0 + rng() % 8), (Byte)immediate};
+        }
+        else
+        {
+            b = {(Byte)(0xc6 | wide), (Byte)(modRM(rng, wide, false) & 0xC7), (Byte)immediate};
+        }
+        if (wide && form != 0)
+            b.push_back(immediate >> 8);
+        break;
+    }
+    case 9: // cmc / clc / stc
+    {
+        static const Byte flagOps[] = {0xf5, 0xf8, 0xf9};
+        b = {flagOps[rng() % 3]};
+        break;
+    }
+    case 10:
+    case 11: // jcc short, sometimes one of the 0x60-0x6f aliases, or jmp
+    case 12:
+    {
+        Byte kind = rng() % 8;
+        b = {(Byte)(kind == 0 ? 0x60 + rng() % 16 : kind == 1 ? 0xeb : kind == 2 ? 0xe9 : 0x70 + rng() % 16), 0};
+        if (b[0] == 0xe9)
+            b.push_back(0);
+        item.target = index + 1 + rng() % (count - index < 8 ? count - index : 8); // Can be the loop at the end
+        break;
+    }
+    case 13: // alu on memory, the interpreter's lazy flags going into translated code
+    {
+        Byte op = (rng() % 8) << 3 | (rng() & 2) | wide;
+        Byte reg = op & 2 ? writable(rng) : rng() % 8;
+        Word offset = rng() % (DATA_SIZE - 1);
+        b = {op, (Byte)(0x06 | reg << 3), (Byte)offset, (Byte)(offset >> 8)}; // [disp16]
+        break;
+    }
+    case 14: // mov ax,[disp16] / mov [disp16],ax
+    {
+        Word offset = rng() % (DATA_SIZE - 1);
+        b = {(Byte)(rng() & 1 ? 0xa1 : 0xa3), (Byte)offset, (Byte)(offset >> 8)};
+        break;
+    }
+    default: // lahf / sahf
+        b = {(Byte)(rng() & 1 ? 0x9f : 0x9e)};
+        break;
+    }
+    return item;
+}
+
+/* length 0 for --alu */
+static Program randomProgram(std::mt19937 &rng, u32 length)
+{
+    int count = length ? 1 + rng() % length : 1;
+    std::vector<Item> items;
+    for (int i = 0; i < count; i++)
+    {
+        items.push_back(randomItem(rng, i, count, length ? ITEM_KINDS : ALU_KINDS));
+    }
+
+    // dec bp, jz over the jmp back to the start, then jmp $ to idle on; just
+    // the jmp $ for --alu, so the flags are the instruction's
+    std::vector<int> offsets;
+    int size = 0;
+    for (const Item &item : items)
+    {
+        offsets.push_back(size);
+        size += item.bytes.size();
+    }
+    offsets.push_back(size);
+
+    Program program;
+    for (int i = 0; i < count; i++)
+    {
+        Item &item = items[i];
+        if (item.target >= 0)
+        {
+            int displacement = offsets[item.target] - (offsets[i] + (int)item.bytes.size());
+            item.bytes[1] = displacement & 0xFF;
+            if (item.bytes.size() == 3)
+                item.bytes[2] = displacement >> 8;
+        }
+        program.code.insert(program.code.end(), item.bytes.begin(), item.bytes.end());
+    }
+    int back = -(size + 6);
+    Byte tail[] = {(Byte)(0x48 | LOOP_REG), 0x74, 0x03, 0xe9, (Byte)back, (Byte)(back >> 8), 0xeb, 0xfe};
+    u32 tailSize = length ? sizeof(tail) : 2;
+    program.code.insert(program.code.end(), tail + sizeof(tail) - tailSize, tail + sizeof(tail));
+    program.end = size + tailSize - 2;
+
+    // Near page boundaries and the end of the segment more often than chance would have it
+    program.cs = 0x1000 + rng() % 0x6000;
+    program.ip = rng() & 3 ? rng() : (rng() % 2 ? 0x10000 - rng() % 64 : ((rng() % 16) << 12) - rng() % 64);
+    for (int i = 0; i < 8; i++)
+    {
+        program.registers[i] = operand(rng);
+    }
+    program.registers[LOOP_REG] = 1 + rng() % 8;
+    program.flags = (rng() & 0x0CD5) | 0x0002; // Arithmetic flags and DF, not TF or IF
+    program.sliceSeed = rng();
+    return program;
+}
+
+template <class Cpu>
+static void load(Cpu &cpu, const Program &program)
+{
+    static const Byte zero[DATA_SIZE] = {};
+    for (u32 i = 0; i < program.code.size(); i++)
+    {
+        u32 address = cpu.getPhysicalAddress((Word)(program.ip + i), program.cs);
+        cpu.copyToGuest(address, &program.code[i], 1);
+    }
+    cpu.copyToGuest(DATA_SEGMENT << 4, zero, DATA_SIZE);
+    cpu.CS = program.cs;
+    cpu.IP = program.ip;
+    cpu.DS = DATA_SEGMENT;
+    memcpy(cpu.regs.r16, program.registers, sizeof(program.registers));
+    cpu.setFlags(program.flags);
+}
+
+/* What the two have to agree on, as text so a difference can be printed */
+template <class Cpu>
+static std::string describe(Cpu &cpu, u64 cyclesBefore)
+{
+    static const char *const names[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+    char text[512];
+    int used = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        used += snprintf(text + used, sizeof(text) - used, "%s=%04x ", names[i], cpu.regs.r16[i]);
+    }
+    used += snprintf(text + used, sizeof(text) - used, "ip=%04x flags=%04x clocks=%llu", cpu.IP, cpu.getFlags(),
+                     cpu.getCycles() - cyclesBefore);
+
+    Byte data[DATA_SIZE];
+    cpu.copyFromGuest(DATA_SEGMENT << 4, data, DATA_SIZE);
+    u32 sum = 0;
+    for (u32 i = 0; i < DATA_SIZE; i++)
+    {
+        sum = sum * 31 + data[i];
+    }
+    snprintf(text + used, sizeof(text) - used, " data=%08x", sum);
+    return text;
+}
+
+/* Runs program on both machines, false with what differed on the first slice they didn't agree */
+template <class Cpu>
+static bool check(Cpu &interpreted, Cpu &recompiled, const Program &program, u64 &slices, std::string &failure)
+{
+    load(interpreted, program);
+    load(recompiled, program);
+    u64 interpretedBefore = interpreted.getCycles();
+    u64 recompiledBefore = recompiled.getCycles();
+
+    // From a single clock, which stops after every instruction, to long enough for several laps
+    std::mt19937 rng(program.sliceSeed);
+    for (u32 i = 0; i < MAX_SLICES; i++)
+    {
+        u32 kind = rng() % 4;
+        u64 length = kind == 0 ? 1 + rng() % 4 : kind == 1 ? 1 + rng() % 64 : 1 + rng() % 1000;
+        interpreted.start(length, ENGINE_INTERPRETER);
+        recompiled.start(length, ENGINE_JIT);
+        slices++;
+
+        std::string expected = describe(interpreted, interpretedBefore);
+        std::string got = describe(recompiled, recompiledBefore);
+        if (expected != got)
+        {
+            failure = "slice " + std::to_string(i) + " of " + std::to_string(length) + " clocks\n" +
+                      "  interpreter: " + expected + "\n  recompiler:  " + got;
+            return false;
+        }
+        if (interpreted.IP == (Word)(program.ip + program.end))
+        {
+            return true;
+        }
+    }
+    failure = "still running after " + std::to_string(MAX_SLICES) + " slices";
+    return false;
+}
+
+static void printProgram(const Program &program)
+{
+    printf("  at %04x:%04x, flags %04x, registers", program.cs, program.ip, program.flags);
+    for (int i = 0; i < 8; i++)
+    {
+        printf(" %04x", program.registers[i]);
+    }
+    printf("\n  code");
+    for (Byte byte : program.code)
+    {
+        printf(" %02x", byte);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    u32 seed = 1;
+    u32 programs = 10000;
+    u32 length = 32;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--seed") && hasValue)
+            seed = strtoul(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "--programs") && hasValue)
+            programs = strtoul(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "--length") && hasValue && atoi(argv[i + 1]) > 0)
+            length = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--alu"))
+            length = 0;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    std::unique_ptr<i8086> exact[2] = {std::unique_ptr<i8086>(new i8086), std::unique_ptr<i8086>(new i8086)};
+    std::unique_ptr<i8086Fast> fast[2] = {std::unique_ptr<i8086Fast>(new i8086Fast),
+                                          std::unique_ptr<i8086Fast>(new i8086Fast)};
+    for (int i = 0; i < 2; i++)
+    {
+        exact[i]->init();
+        fast[i]->init();
+    }
+
+    // Every program has a seed of its own, so a failure can be run again with --seed <n> --programs 1
+    u64 slices = 0;
+    for (u32 n = 0; n < programs; n++)
+    {
+        std::mt19937 rng(seed + n);
+        Program program = randomProgram(rng, length);
+        std::string failure;
+        const char *machine = "i8086";
+        bool ok = check(*exact[0], *exact[1], program, slices, failure);
+        if (ok)
+        {
+            machine = "i8086Fast";
+            ok = check(*fast[0], *fast[1], program, slices, failure);
+        }
+        if (!ok)
+        {
+            printf("FAIL seed %u on %s, %s\n", seed + n, machine, failure.c_str());
+            printProgram(program);
+            return 1;
+        }
+    }
+
+    printf("%u programs, %llu slices, recompiler and interpreter agree\n", programs, slices);
+    return 0;
+}
@@ -0,0 +1,508 @@
+#include <fcntl.h>
+#include <initializer_list>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../src/disk.h"
+#include "../src/i8086.h"
+#include "../src/snapshot.h"
+#include "../src/video.h"
+
+// Checks of the machine around the CPU: snapshots, the decode cache and the
+// devices. Each check builds a machine of its own, runs it and looks at what
+// it left behind. Prints a line per check and fails if any of them did; files
+// go in $TMPDIR, or /tmp, and are removed again.
+
+/* What a check found wrong, empty when it passed */
+using CheckResult = std::string;
+
+static std::string temporaryPath(const char *name)
+{
+    const char *directory = getenv("TMPDIR");
+    return std::string(directory ? directory : "/tmp") + "/machinecheck-" + std::to_string(getpid()) + "-" + name;
+}
+
+/* Guest programs are assembled by hand and run from 1000:0000, with DS:SI on a results table at 30000h */
+#define PROGRAM_BASE 0x10000
+#define RESULTS_BASE 0x30000
+
+static void emit(std::vector<Byte> &code, std::initializer_list<Byte> bytes)
+{
+    code.insert(code.end(), bytes);
+}
+
+/* int vector with AX, BX, CX and DX loaded, then AX, CX and DX as it left them go in the results table */
+static void emitCall(std::vector<Byte> &code, Byte vector, Word ax, Word bx, Word cx, Word dx)
+{
+    emit(code, {0xB8, (Byte)ax, (Byte)(ax >> 8), 0xBB, (Byte)bx, (Byte)(bx >> 8)}); // mov ax,ax / mov bx,bx
+    emit(code, {0xB9, (Byte)cx, (Byte)(cx >> 8), 0xBA, (Byte)dx, (Byte)(dx >> 8)}); // mov cx,cx / mov dx,dx
+    emit(code, {0xCD, vector});
+    emit(code, {0x89, 0x04, 0x89, 0x4C, 0x02, 0x89, 0x54, 0x04, 0x83, 0xC6, 0x06}); // mov [si],ax ... add si,6
+}
+
+/* Runs the program with ES as given until it gets to the jmp $ put after it */
+static bool runProgram(i8086 &cpu, std::vector<Byte> code, Word es)
+{
+    Word end = code.size();
+    emit(code, {0xEB, 0xFE});
+    cpu.copyToGuest(PROGRAM_BASE, code.data(), code.size());
+    cpu.CS = PROGRAM_BASE >> 4;
+    cpu.IP = 0;
+    cpu.DS = RESULTS_BASE >> 4;
+    cpu.ES = es;
+    cpu.regs.SI = 0;
+    for (int i = 0; i < 100 && cpu.IP != end; i++)
+    {
+        cpu.start(10000);
+    }
+    return cpu.IP == end;
+}
+
+/* Everything a refused snapshot must leave alone */
+struct MachineState
+{
+    Word registers[8];
+    Word cs, ip, ds, ss, es, flags;
+    u64 cycles;
+    bool a20;
+    Byte pageFlags[MAP_PAGES];
+
+    MachineState(i8086 &cpu)
+    {
+        memcpy(registers, cpu.regs.r16, sizeof(registers));
+        cs = cpu.CS, ip = cpu.IP, ds = cpu.DS, ss = cpu.SS, es = cpu.ES;
+        flags = cpu.getFlags();
+        cycles = cpu.getCycles();
+        a20 = cpu.getA20();
+        memcpy(pageFlags, cpu.memMap.flags, sizeof(pageFlags));
+    }
+
+    bool operator==(const MachineState &other) const
+    {
+        return !memcmp(registers, other.registers, sizeof(registers)) && cs == other.cs && ip == other.ip &&
+               ds == other.ds && ss == other.ss && es == other.es && flags == other.flags &&
+               cycles == other.cycles && a20 == other.a20 && !memcmp(pageFlags, other.pageFlags, sizeof(pageFlags));
+    }
+};
+
+/* loadSnapshot() and fork() refuse a snapshot while a device hooks an interrupt, without touching the machine */
+static CheckResult checkRefusedSnapshot()
+{
+    std::string path = temporaryPath("snapshot");
+    std::unique_ptr<i8086> cpu(new i8086);
+    cpu->init();
+    cpu->regs.AX = 0x1111;
+    if (!cpu->saveSnapshot(path.c_str()))
+    {
+        return "can't save a snapshot to " + path;
+    }
+
+    // Something worth keeping: registers, A20 on and video pages watched
+    cpu->regs.AX = 0x2222;
+    cpu->regs.SI = 0x3333;
+    cpu->CS = 0x1234;
+    cpu->IP = 0x5678;
+    cpu->setFlags(0x08D5);
+    cpu->setA20(true);
+    cpu->start(100);
+    videoCard card;
+    videoBios<i8086> bios;
+    card.attach(cpu->memMap, cpu->ioMap);
+    bios.attach(*cpu, card);
+
+    CheckResult result;
+    MachineState before(*cpu);
+    snapshotImage image;
+    if (cpu->loadSnapshot(path.c_str()))
+        result = "loadSnapshot() took a snapshot with INT 10h hooked";
+    else if (!(MachineState(*cpu) == before))
+        result = "a refused loadSnapshot() changed the machine";
+    else if (!image.open(path.c_str()))
+        result = "can't open the snapshot image";
+    else if (cpu->fork(image))
+        result = "fork() took a snapshot with INT 10h hooked";
+    else if (!(MachineState(*cpu) == before))
+        result = "a refused fork() changed the machine";
+    else
+    {
+        // And it does load once the device is gone
+        cpu->hookInterrupt(0x10, nullptr, nullptr);
+        if (!cpu->loadSnapshot(path.c_str()) || cpu->regs.AX != 0x1111)
+            result = "loadSnapshot() failed without devices attached";
+    }
+    unlink(path.c_str());
+    return result;
+}
+
+/* A cached instruction reached again at the end of another segment wraps IP like one decoded there */
+static CheckResult checkWrappedDecode()
+{
+    std::unique_ptr<i8086> cpu(new i8086);
+    cpu->init();
+    // mov ax,1234h at 2000Eh, inside one page, so the decode cache keeps it
+    static const Byte code[] = {0xB8, 0x34, 0x12};
+    cpu->copyToGuest(0x2000E, code, sizeof(code));
+    static const Byte wrapped[] = {0x56};
+    cpu->copyToGuest(0x10010, wrapped, sizeof(wrapped));
+
+    cpu->CS = 0x2000;
+    cpu->IP = 0x000E;
+    cpu->execute();
+    if (cpu->regs.AX != 0x1234)
+        return "mov ax,1234h didn't run";
+
+    // The same address as 1001:FFFE, where the immediate's high byte is at 1001:0000, 10010h
+    cpu->CS = 0x1001;
+    cpu->IP = 0xFFFE;
+    cpu->execute();
+    if (cpu->regs.AX != 0x5634 || cpu->IP != 0x0001)
+    {
+        char text[80];
+        snprintf(text, sizeof(text), "AX %04X IP %04X after the wrapping mov, not 5634 0001", cpu->regs.AX, cpu->IP);
+        return text;
+    }
+    return CheckResult();
+}
+
+/* Sector contents the images start with, the LBA and a pattern of its own */
+static void fillSector(Byte *sector, u32 lba)
+{
+    for (u32 i = 0; i < SECTOR_SIZE; i++)
+    {
+        sector[i] = (Byte)(lba * 13 + i * 7);
+    }
+    memcpy(sector, &lba, sizeof(lba));
+}
+
+static bool sectorIs(const Byte *sector, u32 lba)
+{
+    Byte expected[SECTOR_SIZE];
+    fillSector(expected, lba);
+    return !memcmp(sector, expected, SECTOR_SIZE);
+}
+
+#define FLOPPY_SIZE 1474560                            // 1.44M, 80 cylinders of 2 heads of 18 sectors
+#define HARD_DISK_CYLINDERS 260                        // Past 255, so CL carries the cylinder's top bits
+#define HARD_DISK_HIGH_LBA ((257 * 16 + 3) * 63)       // Cylinder 257, head 3, sector 1
+#define HARD_DISK_SIZE ((u64)HARD_DISK_CYLINDERS * 16 * 63 * SECTOR_SIZE)
+
+/* The guest half of checkDiskBios(), with the images made */
+static CheckResult runDiskGuest(const std::string &floppyPath, const std::string &hardDiskPath)
+{
+    diskImage floppy, hardDisk;
+    if (!floppy.open(floppyPath.c_str(), true, true) || !hardDisk.open(hardDiskPath.c_str(), false))
+        return "can't open the images";
+    if (floppy.open(hardDiskPath.c_str(), true) || floppy.getGeometry().sectors != 18 || // No floppy size
+        floppy.getSectorCount() != FLOPPY_SIZE / SECTOR_SIZE)
+        return "a failed open() changed the floppy already open";
+    if (hardDisk.getGeometry().cylinders != HARD_DISK_CYLINDERS || hardDisk.getGeometry().heads != 16)
+        return "wrong hard disk geometry";
+
+    std::unique_ptr<i8086> cpu(new i8086);
+    cpu->init();
+    diskBios<i8086> bios;
+    bios.attach(*cpu);
+    bios.setDrive(0x00, &floppy);
+    bios.setDrive(0x80, &hardDisk);
+
+    // Every call leaves AX, CX and DX in the results, with what they should be
+    static const struct
+    {
+        Word ax, bx, cx, dx;
+        Word result[3];
+        const char *name;
+    } calls[] = {
+        {0x0203, 0x0000, 0x0105, 0x0100, {0x0003, 0x0105, 0x0100}, "read floppy 1/1/5"},
+        {0x0202, 0x0600, 0x0108, 0x0100, {0x0002, 0x0108, 0x0100}, "read on, 1/1/8"},
+        {0x0201, 0x0A00, 0x0141, 0x0380, {0x0001, 0x0141, 0x0380}, "read hard disk 257/3/1"},
+        {0x0302, 0x0000, 0x0002, 0x0080, {0x0002, 0x0002, 0x0080}, "write hard disk 0/0/2"},
+        {0x0301, 0x0000, 0x0001, 0x0000, {0x0300, 0x0001, 0x0000}, "write read-only floppy"},
+        {0x0201, 0x0C00, 0x0013, 0x0000, {0x0400, 0x0013, 0x0000}, "read floppy sector 19"},
+        {0x0800, 0x0000, 0x0000, 0x0080, {0x0000, 0x037F, 0x0F01}, "hard disk parameters"},
+        {0x0201, 0x0000, 0x0001, 0x0081, {0x8001, 0x0001, 0x0081}, "read missing drive"},
+    };
+    std::vector<Byte> code;
+    for (const auto &call : calls)
+    {
+        emitCall(code, 0x13, call.ax, call.bx, call.cx, call.dx);
+    }
+    if (!runProgram(*cpu, code, 0x2000))
+        return "the INT 13h program didn't finish";
+
+    Word results[sizeof(calls) / sizeof(calls[0])][3];
+    cpu->copyFromGuest(RESULTS_BASE, (Byte *)results, sizeof(results));
+    for (u32 i = 0; i < sizeof(calls) / sizeof(calls[0]); i++)
+    {
+        if (memcmp(results[i], calls[i].result, sizeof(results[i])))
+        {
+            char text[120];
+            snprintf(text, sizeof(text), "%s: AX %04X CX %04X DX %04X, not %04X %04X %04X", calls[i].name,
+                     results[i][0], results[i][1], results[i][2], calls[i].result[0], calls[i].result[1],
+                     calls[i].result[2]);
+            return text;
+        }
+    }
+
+    // Floppy LBA 58 to 62 at 20000h, in two reads, and the far hard disk sector after them
+    Byte buffer[6 * SECTOR_SIZE];
+    cpu->copyFromGuest(0x20000, buffer, sizeof(buffer));
+    for (u32 i = 0; i < 5; i++)
+    {
+        if (!sectorIs(buffer + i * SECTOR_SIZE, 58 + i))
+            return "floppy sector " + std::to_string(58 + i) + " read wrong";
+    }
+    if (!sectorIs(buffer + 5 * SECTOR_SIZE, HARD_DISK_HIGH_LBA))
+        return "hard disk sector " + std::to_string(HARD_DISK_HIGH_LBA) + " read wrong";
+
+    // The write reaches the file after flush(), and only the sectors written
+    if (!hardDisk.flush())
+        return "flush() failed";
+    int fd = ::open(hardDiskPath.c_str(), O_RDONLY);
+    bool read = fd >= 0 && pread(fd, buffer, 4 * SECTOR_SIZE, 0) == 4 * SECTOR_SIZE;
+    if (fd >= 0)
+        close(fd);
+    Byte zero[SECTOR_SIZE] = {};
+    if (!read)
+        return "can't read the hard disk image back";
+    if (!sectorIs(buffer + SECTOR_SIZE, 58) || !sectorIs(buffer + 2 * SECTOR_SIZE, 59))
+        return "the written sectors aren't in the hard disk image";
+    if (memcmp(buffer, zero, SECTOR_SIZE) || memcmp(buffer + 3 * SECTOR_SIZE, zero, SECTOR_SIZE))
+        return "the write went past its sectors";
+    return CheckResult();
+}
+
+/* INT 13h reads and writes through CHS to images in files, and the drive parameters */
+static CheckResult checkDiskBios()
+{
+    std::string floppyPath = temporaryPath("floppy");
+    std::string hardDiskPath = temporaryPath("harddisk");
+
+    // A floppy with every sector filled, and a sparse hard disk with only the sector read filled
+    std::vector<Byte> image(FLOPPY_SIZE);
+    for (u32 lba = 0; lba < FLOPPY_SIZE / SECTOR_SIZE; lba++)
+    {
+        fillSector(&image[lba * SECTOR_SIZE], lba);
+    }
+    Byte sector[SECTOR_SIZE];
+    fillSector(sector, HARD_DISK_HIGH_LBA);
+    int floppyFd = ::open(floppyPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int hardDiskFd = ::open(hardDiskPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool made = floppyFd >= 0 && hardDiskFd >= 0 && write(floppyFd, image.data(), image.size()) == FLOPPY_SIZE &&
+                ftruncate(hardDiskFd, HARD_DISK_SIZE) == 0 &&
+                pwrite(hardDiskFd, sector, SECTOR_SIZE, (u64)HARD_DISK_HIGH_LBA * SECTOR_SIZE) == SECTOR_SIZE;
+    if (floppyFd >= 0)
+        close(floppyFd);
+    if (hardDiskFd >= 0)
+        close(hardDiskFd);
+
+    CheckResult result = made ? runDiskGuest(floppyPath, hardDiskPath) : "can't make the disk images in " + floppyPath;
+    unlink(floppyPath.c_str());
+    unlink(hardDiskPath.c_str());
+    return result;
+}
+
+/* The RGB of pixel x, y in a frame width pixels wide */
+static std::string pixelAt(const Byte *frame, u32 width, u32 x, u32 y)
+{
+    const Byte *pixel = frame + (y * width + x) * 3;
+    char text[16];
+    snprintf(text, sizeof(text), "%02X%02X%02X", pixel[0], pixel[1], pixel[2]);
+    return text;
+}
+
+static bool readFile(const std::string &path, std::vector<Byte> &contents)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+    Byte buffer[65536];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        contents.insert(contents.end(), buffer, buffer + length);
+    }
+    fclose(file);
+    return true;
+}
+
+static u32 bigEndian(const Byte *bytes)
+{
+    return (u32)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+/* The RGB rows of a PNG as writePng() makes them, IDAT in stored deflate blocks behind filter type 0 */
+static bool decodePng(const std::vector<Byte> &png, u32 &width, u32 &height, std::vector<Byte> &frame)
+{
+    static const Byte signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (png.size() < 8 || memcmp(png.data(), signature, 8))
+        return false;
+
+    std::vector<Byte> compressed;
+    width = height = 0;
+    for (size_t offset = 8; offset + 12 <= png.size();)
+    {
+        u32 length = bigEndian(&png[offset]);
+        if (offset + 12 + length > png.size())
+            return false;
+        const Byte *type = &png[offset + 4];
+        const Byte *data = &png[offset + 8];
+        if (!memcmp(type, "IHDR", 4) && length == 13)
+        {
+            width = bigEndian(data);
+            height = bigEndian(data + 4);
+            if (data[8] != 8 || data[9] != 2)
+                return false; // Not 8-bit RGB
+        }
+        else if (!memcmp(type, "IDAT", 4))
+            compressed.insert(compressed.end(), data, data + length);
+        offset += 12 + length;
+    }
+
+    std::vector<Byte> raw;
+    bool last = false;
+    for (size_t offset = 2; !last && offset + 5 <= compressed.size();) // Past the zlib header
+    {
+        last = compressed[offset] & 1;
+        u32 length = compressed[offset + 1] | compressed[offset + 2] << 8;
+        if ((compressed[offset] & 6) || (length ^ 0xFFFF) != (u32)(compressed[offset + 3] | compressed[offset + 4] << 8) ||
+            offset + 5 + length > compressed.size())
+            return false; // Only stored blocks
+        raw.insert(raw.end(), &compressed[offset + 5], &compressed[offset + 5 + length]);
+        offset += 5 + length;
+    }
+    if (!last || !width || raw.size() != (width * 3 + 1) * height)
+        return false;
+
+    frame.clear();
+    for (u32 y = 0; y < height; y++)
+    {
+        const Byte *row = &raw[y * (width * 3 + 1)];
+        if (row[0] != 0)
+            return false;
+        frame.insert(frame.end(), row + 1, row + 1 + width * 3);
+    }
+    return true;
+}
+
+/* Mode 13h through INT 10h, the DAC ports, redrawing only what changed, and the frame as PPM and PNG */
+static CheckResult checkVideoBios()
+{
+    std::unique_ptr<i8086> cpu(new i8086);
+    cpu->init();
+    videoCard card;
+    videoBios<i8086> bios;
+    card.attach(cpu->memMap, cpu->ioMap);
+    bios.attach(*cpu, card);
+
+    // Mode 13h and back what it is, colour 5 set to 3F,20,00 and read back, and pixel 7,10 in it
+    std::vector<Byte> code;
+    emitCall(code, 0x10, 0x0013, 0, 0, 0);
+    emitCall(code, 0x10, 0x0F00, 0, 0, 0);
+    emit(code, {0xBA, 0xC8, 0x03, 0xB0, 0x05, 0xEE, 0x42});             // mov dx,3C8h / mov al,5 / out dx,al / inc dx
+    emit(code, {0xB0, 0x3F, 0xEE, 0xB0, 0x20, 0xEE, 0xB0, 0x00, 0xEE}); // out 3Fh, 20h and 00h to 3C9h
+    emit(code, {0xBA, 0xC7, 0x03, 0xB0, 0x05, 0xEE, 0xBA, 0xC9, 0x03}); // mov dx,3C7h / mov al,5 / out dx,al / mov dx,3C9h
+    for (int i = 0; i < 3; i++)
+    {
+        emit(code, {0xEC, 0x88, 0x04, 0x46}); // in al,dx / mov [si],al / inc si
+    }
+    emit(code, {0x26, 0xC6, 0x06, 0x87, 0x0C, 0x05}); // mov byte es:[0C87h],5, row 10 column 7
+    if (!runProgram(*cpu, code, VIDEO_GRAPHICS_BASE >> 4))
+        return "the INT 10h program didn't finish";
+
+    Byte results[15];
+    cpu->copyFromGuest(RESULTS_BASE, results, sizeof(results));
+    if (card.getMode() != VIDEO_MODE_GRAPHICS || card.getWidth() != 320 || card.getHeight() != 200)
+        return "INT 10h AX=0013h didn't set mode 13h";
+    if (results[6] != VIDEO_MODE_GRAPHICS || results[7] != 40)
+        return "INT 10h AH=0Fh didn't report mode 13h";
+    if (results[12] != 0x3F || results[13] != 0x20 || results[14] != 0x00)
+        return "colour 5 read back wrong from 3C9h";
+
+    const u32 width = 320;
+    if (!card.update())
+        return "update() found nothing to draw after the mode set";
+    std::string orange = "FF8200"; // 3F,20,00 in 8 bits
+    if (pixelAt(card.getFrame(), width, 7, 10) != orange || pixelAt(card.getFrame(), width, 8, 10) != "000000")
+        return "pixel 7,10 drawn " + pixelAt(card.getFrame(), width, 7, 10) + ", not " + orange;
+    if (card.update())
+        return "update() drew again with nothing written";
+
+    // A pixel in another page, and the one before written again with what it was
+    code.clear();
+    emit(code, {0x26, 0xC6, 0x06, 0x89, 0xBB, 0x05}); // mov byte es:[0BB89h],5, row 150 column 9
+    emit(code, {0x26, 0xC6, 0x06, 0x87, 0x0C, 0x05});
+    if (!runProgram(*cpu, code, VIDEO_GRAPHICS_BASE >> 4))
+        return "the pixel program didn't finish";
+    if (!card.update() || pixelAt(card.getFrame(), width, 9, 150) != orange)
+        return "pixel 9,150 in a page written since the last frame wasn't drawn";
+
+    code.clear();
+    emit(code, {0x26, 0xC6, 0x06, 0x87, 0x0C, 0x05});
+    if (!runProgram(*cpu, code, VIDEO_GRAPHICS_BASE >> 4))
+        return "the pixel program didn't finish";
+    if (card.update())
+        return "update() drew a row written with what it already held";
+
+    // A palette change redraws everything, colour 0 to blue
+    code.clear();
+    emit(code, {0xBA, 0xC8, 0x03, 0xB0, 0x00, 0xEE, 0x42, 0xB0, 0x00, 0xEE, 0xEE, 0xB0, 0x3F, 0xEE});
+    if (!runProgram(*cpu, code, VIDEO_GRAPHICS_BASE >> 4))
+        return "the DAC program didn't finish";
+    if (!card.update() || pixelAt(card.getFrame(), width, 0, 0) != "0000FF" ||
+        pixelAt(card.getFrame(), width, 319, 199) != "0000FF" || pixelAt(card.getFrame(), width, 7, 10) != orange)
+        return "the frame wasn't redrawn with colour 0 changed";
+
+    // The files hold the same frame
+    std::string ppmPath = temporaryPath("frame.ppm");
+    std::string pngPath = temporaryPath("frame.png");
+    std::vector<Byte> ppm, png, decoded;
+    u32 pngWidth, pngHeight;
+    std::string header = "P6\n320 200\n255\n";
+    std::vector<Byte> expected(card.getFrame(), card.getFrame() + width * 200 * 3);
+    CheckResult result;
+    if (!card.writePpm(ppmPath.c_str()) || !readFile(ppmPath, ppm))
+        result = "can't write " + ppmPath;
+    else if (ppm.size() != header.size() + expected.size() || memcmp(ppm.data(), header.data(), header.size()) ||
+             memcmp(&ppm[header.size()], expected.data(), expected.size()))
+        result = "the PPM isn't the frame";
+    else if (!card.writePng(pngPath.c_str()) || !readFile(pngPath, png))
+        result = "can't write " + pngPath;
+    else if (!decodePng(png, pngWidth, pngHeight, decoded))
+        result = "can't decode the PNG";
+    else if (pngWidth != width || pngHeight != 200 || decoded != expected)
+        result = "the PNG isn't the frame";
+    unlink(ppmPath.c_str());
+    unlink(pngPath.c_str());
+    return result;
+}
+
+static const struct
+{
+    const char *name;
+    CheckResult (*run)();
+} checks[] = {
+    {"refused snapshot", checkRefusedSnapshot},
+    {"wrapped decode", checkWrappedDecode},
+    {"disk bios", checkDiskBios},
+    {"video bios", checkVideoBios},
+};
+
+int main()
+{
+    int failed = 0;
+    for (const auto &check : checks)
+    {
+        CheckResult result = check.run();
+        printf("%-20s %s%s%s\n", check.name, result.empty() ? "pass" : "FAIL", result.empty() ? "" : "  ",
+               result.c_str());
+        if (!result.empty())
+            failed++;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+#include <stdarg.h>
+#include <string.h>
+#include <string>
+
+#include "../src/trace.h"
+
+// Prints a trace written through traceRecorder, one line per instruction:
+//
+//   1000:0005  26 c7 06 00 00 41 1f   AX=b800 [b8000]=1f41
+//
+// CS:IP and opcode bytes, then what the instruction changed: registers, and
+// memory writes with their physical address. Interrupts taken after an
+// instruction are on it too. With --registers every line ends with all of
+// the registers as they were after the instruction.
+
+static void usage()
+{
+    fprintf(stderr, "Usage: tracedump [--registers] <trace>\n");
+}
+
+static void appendf(std::string &text, const char *format, ...)
+{
+    char buffer[64];
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(buffer, sizeof(buffer), format, arguments);
+    va_end(arguments);
+    text += buffer;
+}
+
+int main(int argc, char **argv)
+{
+    bool allRegisters = false;
+    const char *path = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--registers"))
+            allRegisters = true;
+        else if (!path && argv[i][0] != '-')
+            path = argv[i];
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (!path)
+    {
+        usage();
+        return 1;
+    }
+
+    traceReader reader;
+    if (!reader.open(path))
+    {
+        return 1;
+    }
+
+    // An instruction's effects only show up in the records after it, so each line is printed when the next step comes
+    std::string line;
+    std::string effects;
+    bool pending = false;
+    u64 steps = 0;
+    TraceEvent event;
+
+    auto finish = [&](const TraceEvent *after) {
+        if (!pending)
+            return;
+        if (after)
+        {
+            for (u32 i = 0; i < TRACE_REGISTERS; i++)
+            {
+                if (i != TRACE_IP && i != TRACE_CS && (after->changed & (1 << i))) // The next line has CS:IP
+                    appendf(effects, " %s=%04x", traceRegisterNames[i], after->registers[i]);
+            }
+        }
+        if (effects.empty() && !allRegisters)
+            printf("%s", line.c_str());
+        else
+            printf("%-36s%s", line.c_str(), effects.c_str());
+        if (allRegisters && after)
+        {
+            printf("  |");
+            for (u32 i = 0; i < TRACE_REGISTERS; i++)
+                printf(" %s=%04x", traceRegisterNames[i], after->registers[i]);
+        }
+        printf("\n");
+        pending = false;
+    };
+
+    while (reader.next(event))
+    {
+        switch (event.type)
+        {
+        case TRACE_STEP:
+            finish(&event);
+            line.clear();
+            effects.clear();
+            appendf(line, "%04x:%04x ", event.registers[TRACE_CS], event.registers[TRACE_IP]);
+            for (u32 i = 0; i < event.length; i++)
+                appendf(line, " %02x", event.code[i]);
+            pending = true;
+            steps++;
+            break;
+        case TRACE_WRITE8:
+            appendf(effects, " [%05x]=%02x", event.address, event.data[0]);
+            break;
+        case TRACE_WRITE16:
+            appendf(effects, " [%05x]=%04x", event.address, event.data[0] | event.data[1] << 8);
+            break;
+        case TRACE_BLOCK:
+            appendf(effects, " [%05x]=<%u bytes>", event.address, event.length);
+            break;
+        case TRACE_INTERRUPT:
+            appendf(effects, " INT %02x", event.vector);
+            break;
+        }
+    }
+    finish(nullptr);
+    fprintf(stderr, "%llu instructions\n", steps);
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+
+#include "../src/header.h"
+
+// Writes single-step test vectors for MOV between registers, for conformance.
+// One file per opcode in the format of the published 8086 single-step tests:
+// 88.json to 8B.json with every register to register ModR/M, 8 and 16 bit,
+// and B0.json to BF.json for MOV reg,immed. Registers, flags, CS:IP and the
+// immediates are random. The expected state comes from a model of its own
+// that names registers the way the Intel tables do, rather than from the
+// emulator's register file, so the two can be held against each other:
+//
+//   vectorgen vectors && conformance vectors
+
+static void usage()
+{
+    fprintf(stderr, "Usage: vectorgen [--seed <n>] [--count <vectors per file>] <directory>\n");
+}
+
+/* Test file register order */
+enum
+{
+    AX,
+    BX,
+    CX,
+    DX,
+    SP,
+    BP,
+    SI,
+    DI,
+    CS,
+    DS,
+    ES,
+    SS,
+    IP,
+    FLAGS,
+    REGISTERS
+};
+static const char *const registerNames[REGISTERS] = {"ax", "bx", "cx", "dx", "sp", "bp", "si", "di",
+                                                     "cs", "ds", "es", "ss", "ip", "flags"};
+
+// The reg and rm field encodings, from the 8086 manual
+static const int words[8] = {AX, CX, DX, BX, SP, BP, SI, DI};
+static const char *const wordNames[8] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+static const char *const byteNames[8] = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
+
+static Byte readByte(const Word *registers, int encoding)
+{
+    Word value = registers[words[encoding & 3]];
+    return encoding < 4 ? value & 0xFF : value >> 8;
+}
+
+static void writeByte(Word *registers, int encoding, Byte value)
+{
+    Word &word = registers[words[encoding & 3]];
+    word = encoding < 4 ? (word & 0xFF00) | value : (word & 0x00FF) | value << 8;
+}
+
+static void writeState(FILE *file, const Word *registers, const Word *before, u32 address, const Byte *bytes,
+                       u32 length)
+{
+    fprintf(file, "{\"regs\": {");
+    bool first = true;
+    for (int i = 0; i < REGISTERS; i++)
+    {
+        if (before && registers[i] == before[i])
+            continue; // Only what changed, as in the published tests
+        fprintf(file, "%s\"%s\": %u", first ? "" : ", ", registerNames[i], registers[i]);
+        first = false;
+    }
+    fprintf(file, "}, \"ram\": [");
+    for (u32 i = 0; i < length; i++)
+    {
+        fprintf(file, "%s[%u, %u]", i ? ", " : "", (address + i) & 0xFFFFF, bytes[i]);
+    }
+    fprintf(file, "], \"queue\": []}");
+}
+
+/* One vector, the instruction in bytes and the state after it already in after */
+static void writeVector(FILE *file, bool first, const std::string &name, const Word *before, const Word *after,
+                        const Byte *bytes, u32 length)
+{
+    u32 address = before[CS] * 16 + before[IP]; // The instructions are short enough not to wrap IP
+    fprintf(file, "%s\n{\"name\": \"%s\", \"bytes\": [", first ? "" : ",", name.c_str());
+    for (u32 i = 0; i < length; i++)
+    {
+        fprintf(file, "%s%u", i ? ", " : "", bytes[i]);
+    }
+    fprintf(file, "], \"initial\": ");
+    writeState(file, before, nullptr, address, bytes, length);
+    fprintf(file, ", \"final\": ");
+    writeState(file, after, before, address, bytes, length);
+    fprintf(file, "}");
+}
+
+static bool writeFile(const std::string &directory, Byte opcode, u32 count, std::mt19937 &rng)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "/%02X.json", opcode);
+    std::string path = directory + name;
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file)
+    {
+        return false;
+    }
+
+    fprintf(file, "[");
+    for (u32 n = 0; n < count; n++)
+    {
+        Word before[REGISTERS];
+        for (int i = 0; i < REGISTERS; i++)
+        {
+            before[i] = rng();
+        }
+        before[IP] = rng() % 0xFFF0;
+        before[FLAGS] = (rng() & 0x0CD5) | 0xF002; // Not TF or IF, and what always reads as set
+
+        Word after[REGISTERS];
+        memcpy(after, before, sizeof(after));
+        Byte bytes[3] = {opcode};
+        u32 length;
+        std::string text;
+        bool wide = opcode & 0x01;
+
+        if (opcode < 0xb0) // mov rm,reg / reg,rm, every register pair in turn
+        {
+            int reg = n % 64 >> 3;
+            int rm = n % 8;
+            bytes[1] = 0xC0 | reg << 3 | rm;
+            length = 2;
+            int source = opcode & 0x02 ? rm : reg;
+            int destination = opcode & 0x02 ? reg : rm;
+            if (wide)
+                after[words[destination]] = before[words[source]];
+            else
+                writeByte(after, destination, readByte(before, source));
+            const char *const *names = wide ? wordNames : byteNames;
+            text = std::string("mov ") + names[destination] + "," + names[source];
+        }
+        else // mov reg,immed
+        {
+            int reg = opcode & 7;
+            wide = opcode & 0x08;
+            Word immediate = rng();
+            bytes[1] = immediate & 0xFF;
+            bytes[2] = immediate >> 8;
+            length = wide ? 3 : 2;
+            if (wide)
+                after[words[reg]] = immediate;
+            else
+                writeByte(after, reg, immediate & 0xFF);
+            char operand[8];
+            snprintf(operand, sizeof(operand), "%0*Xh", wide ? 4 : 2, wide ? immediate : immediate & 0xFF);
+            text = std::string("mov ") + (wide ? wordNames : byteNames)[reg] + "," + operand;
+        }
+        after[IP] = before[IP] + length;
+
+        writeVector(file, n == 0, text, before, after, bytes, length);
+    }
+    fprintf(file, "\n]\n");
+    return fclose(file) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    u32 seed = 1;
+    u32 count = 1024; // 16 of every register pair for 88-8B
+    const char *directory = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--seed") && hasValue)
+            seed = strtoul(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "--count") && hasValue && atoi(argv[i + 1]) > 0)
+            count = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && !directory)
+            directory = argv[i];
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (!directory)
+    {
+        usage();
+        return 1;
+    }
+
+    mkdir(directory, 0755);
+    std::mt19937 rng(seed);
+    for (u32 opcode = 0x88; opcode <= 0xbf; opcode++)
+    {
+        if (opcode > 0x8b && opcode < 0xb0)
+            continue;
+        if (!writeFile(directory, opcode, count, rng))
+        {
+            fprintf(stderr, "Error: Can't write %s/%02X.json\n", directory, opcode);
+            return 1;
+        }
+    }
+    return 0;
+}